@@ -43,6 +43,9 @@ build = {
   install = {
     lib = {
       ["lua_async_http"] = "bin/lua_async_http.so"
+    },
+    lua = {
+      ["lua_async_http_ffi"] = "src/lua_async_http_ffi.lua"
     }
   }
 }
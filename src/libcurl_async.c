@@ -1,7 +1,9 @@
 #include "libcurl_async.h"
 
-/* Flag for the first time lib usage */
-static char first_time_library_used = 1;
+#include <pthread.h>
+
+/* libcurl global init runs once per process, whatever thread loads the module first */
+static pthread_once_t global_init_once = PTHREAD_ONCE_INIT;
 
 /**
  * :error
@@ -14,23 +16,562 @@ static int error(lua_State *L, const char* error_message)
 	return lua_error(L);
 }
 
+/**
+ * :curl_init
+ * The one time libcurl initialization (curl_global_init isn't thread safe),
+ * along with the JSON decoder "C" locale
+ */
+static void curl_init(void)
+{
+  curl_global_init(CURL_GLOBAL_ALL);
+  json_init();
+}
+
+/**
+ * :global_init
+ * Initiates libcurl on the first time the library is used
+ */
+static void global_init(void)
+{
+  pthread_once(&global_init_once, curl_init);
+}
+
+/**
+ * :resolve_target
+ * Splits a resolve target ("host", "host:port" or an url) into host and port.
+ * A bare host gets port 0, which stands for both 80 and 443.
+ */
+static int resolve_target(const char* target, char* host, long* port)
+{
+  const char* colon;
+  size_t len;
+
+  if (strstr(target, "://") != NULL) return url_host_port(target, host, DNS_HOST_SZ, port);
+
+  colon = strrchr(target, ':');
+  len = (colon != NULL) ? (size_t)(colon - target) : strlen(target);
+  if (len == 0 || len >= DNS_HOST_SZ) return 0;
+
+  memcpy(host, target, len);
+  host[len] = '\0';
+  *port = (colon != NULL) ? strtol(colon+1, NULL, 10) : 0;
+  return 1;
+}
+
+/**
+ * :l_pushaddresses
+ * Pushes a comma separated addresses list as a lua array (without IPv6 brackets)
+ */
+static void l_pushaddresses(lua_State* L, const char* addresses)
+{
+  char address[DNS_ADDRESSES_SZ];
+  size_t len;
+  int index = 1;
+
+  lua_pushstring(L, "addresses");
+  lua_newtable(L);
+  while (!is_empty(addresses)) {
+    len = strcspn(addresses, ",");
+    if (*addresses == '[' && len >= 2) {
+      memcpy(address, addresses+1, len-2);
+      address[len-2] = '\0';
+    }
+    else {
+      memcpy(address, addresses, len);
+      address[len] = '\0';
+    }
+    lua_pushstring(L, address);
+    lua_rawseti(L, -2, index++);
+    addresses += len + (addresses[len] == ',');
+  }
+  lua_settable(L, -3);
+}
+
+/**
+ * :handle_resolve
+ * Warms the shared dns cache ahead of traffic.
+ * Expects a list of "host", "host:port" or urls, each distinct host is
+ * resolved once (lookups are coalesced) and all hosts are resolved in parallel.
+ */
+static int handle_resolve(lua_State* L)
+{
+  async_context* context;
+  dns_lookup* lookups;
+  size_t* lookup_of;
+  size_t total, count = 0, i, j;
+  long port, ttl;
+  char host[DNS_HOST_SZ];
+  const char* target;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  ttl = context->dns_cache_timeout;
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "dns_cache_timeout");
+    if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0) ttl = (long)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+
+  total = lua_objlen(L, 1);
+  lookups = (dns_lookup*) malloc(sizeof(dns_lookup) * (total + 1));
+  lookup_of = (size_t*) malloc(sizeof(size_t) * (total + 1));
+  if (lookups == NULL || lookup_of == NULL) {
+    free(lookups);
+    free(lookup_of);
+    return error(L, "resolve allocation failed");
+  }
+
+  /* COALESCE THE TARGETS BY HOST NAME */
+  for (i=0; i<total; i++) {
+    lua_rawgeti(L, 1, (int)i+1);
+    target = lua_tostring(L, -1);
+    lookup_of[i] = total;
+    if (target != NULL && resolve_target(target, host, &port)) {
+      for (j=0; j<count; j++)
+        if (strcmp(lookups[j].host, host) == 0) break;
+      if (j == count) strcpy(lookups[count++].host, host);
+      lookup_of[i] = j;
+    }
+    lua_pop(L, 1);
+  }
+
+  dns_resolve(lookups, count);
+
+  lua_newtable(L);
+  for (i=0; i<total; i++) {
+    lua_rawgeti(L, 1, (int)i+1);
+    target = lua_tostring(L, -1);
+    if (target == NULL) {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    lua_newtable(L);
+    if (lookup_of[i] == total) {
+      l_pushaddresses(L, "");
+      l_pushtablestring(L, "error", "invalid resolve target");
+    }
+    else {
+      dns_lookup* lookup = &lookups[lookup_of[i]];
+      resolve_target(target, host, &port);
+      if (is_empty(lookup->error)) {
+        if (port == 0) {
+          dns_cache_put(context, host, 80L, lookup->addresses, ttl);
+          dns_cache_put(context, host, 443L, lookup->addresses, ttl);
+        }
+        else dns_cache_put(context, host, port, lookup->addresses, ttl);
+      }
+      l_pushaddresses(L, lookup->addresses);
+      l_pushtablestring(L, "error", lookup->error);
+    }
+    lua_settable(L, -3);
+  }
+
+  free(lookups);
+  free(lookup_of);
+  return 1;
+}
+
+/**
+ * :handle_configure
+ * Sets the module (context) wide options, used by every later batch.
+ */
+static int handle_configure(lua_State* L)
+{
+  async_context* context;
+  size_t i;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  lua_getfield(L, 1, "resolve");
+  if (lua_istable(L, -1)) {
+    curl_slist_free_all(context->resolve);
+    context->resolve = l_toslist(L, -1);
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "dns_cache_timeout");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0) context->dns_cache_timeout = (long)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, 1, "max_connects");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) context->max_connects = (long)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  /* THE RESPONSES CACHE BOUND, SHRINKING IT EVICTS THE LEAST RECENTLY USED ENTRIES RIGHT AWAY */
+  lua_getfield(L, 1, "cache_size");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0)
+    cache_resize(&context->cache, (size_t)lua_tonumber(L, -1));
+  lua_pop(L, 1);
+
+  /* THE DEFAULT HOST POLICY, HOSTS WITH THEIR OWN POLICY (async.host_policy) KEEP IT */
+  l_tohostpolicy(L, 1, &context->host_policy);
+  for (i=0; i<context->host_states_count; i++)
+    if (!context->host_states[i].has_policy) set_host_policy(&context->host_states[i], &context->host_policy);
+  return 0;
+}
+
+/**
+ * :handle_host_policy
+ * Sets the rate limit / circuit breaker policy of a single host,
+ * overriding the configure() defaults for that host.
+ */
+static int handle_host_policy(lua_State* L)
+{
+  async_context* context;
+  host_state* state;
+  host_policy policy;
+  const char* host = luaL_checkstring(L, 1);
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+  if ((state = get_host_state(context, host)) == NULL) return error(L, "invalid host");
+
+  policy = state->policy;
+  l_tohostpolicy(L, 2, &policy);
+  set_host_policy(state, &policy);
+  state->has_policy = 1;
+  return 0;
+}
+
+/**
+ * :handle_breaker_state
+ * Returns the rate limit / circuit breaker state of a host,
+ * or of every known host when no host is given.
+ */
+static int handle_breaker_state(lua_State* L)
+{
+  async_context* context;
+  host_state* state;
+  size_t i;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  if (lua_isstring(L, 1)) {
+    if ((state = get_host_state(context, lua_tostring(L, 1))) == NULL) return error(L, "invalid host");
+    l_pushhoststate(L, state);
+    return 1;
+  }
+
+  lua_newtable(L);
+  for (i=0; i<context->host_states_count; i++) {
+    lua_pushstring(L, context->host_states[i].host);
+    l_pushhoststate(L, &context->host_states[i]);
+    lua_settable(L, -3);
+  }
+  return 1;
+}
+
+/**
+ * :handle_reset_breaker
+ * Closes the circuit breaker of a host (or of every known host) and refills its token bucket.
+ */
+static int handle_reset_breaker(lua_State* L)
+{
+  async_context* context;
+  host_state* state;
+  size_t i;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  if (lua_isstring(L, 1)) {
+    if ((state = get_host_state(context, lua_tostring(L, 1))) == NULL) return error(L, "invalid host");
+    reset_host_state(state);
+    return 0;
+  }
+  for (i=0; i<context->host_states_count; i++) reset_host_state(&context->host_states[i]);
+  return 0;
+}
+
+/**
+ * :handle_upstream
+ * Defines (or redefines) an upstream pool: requests to svc://name/path
+ * go to one of its endpoint urls, picked as their transfer starts.
+ * The optional policy table sets the load balancing / ejection options.
+ */
+static int handle_upstream(lua_State* L)
+{
+  async_context* context;
+  upstream* pool;
+  const char** urls;
+  const char* name = luaL_checkstring(L, 1);
+  size_t i, count;
+
+  luaL_checktype(L, 2, LUA_TTABLE);
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  count = lua_objlen(L, 2);
+  urls = (const char**) malloc(sizeof(const char*) * ((count > 0) ? count : 1));
+  if (urls == NULL) return error(L, "upstream allocation failed");
+
+  for (i=0; i<count; i++) {
+    lua_rawgeti(L, 2, (int)i+1);
+    urls[i] = lua_tostring(L, -1);
+    lua_pop(L, 1);
+    if (urls[i] == NULL) {
+      free(urls);
+      return error(L, "invalid upstream endpoint");
+    }
+  }
+
+  /* THE URL STRINGS STAY ALIVE IN THE ENDPOINTS TABLE */
+  pool = define_upstream(context, name, urls, count);
+  free(urls);
+  if (pool == NULL) return error(L, "invalid upstream");
+  if (lua_istable(L, 3)) l_toupstreampolicy(L, 3, &pool->policy);
+  return 0;
+}
+
+/**
+ * :handle_upstream_state
+ * Returns the endpoints state of an upstream pool,
+ * or of every pool when no name is given.
+ */
+static int handle_upstream_state(lua_State* L)
+{
+  async_context* context;
+  upstream* pool;
+  size_t i;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  if (lua_isstring(L, 1)) {
+    if ((pool = find_upstream(context, lua_tostring(L, 1), NULL)) == NULL) return error(L, "unknown upstream");
+    l_pushupstream(L, pool);
+    return 1;
+  }
+
+  lua_newtable(L);
+  for (i=0; i<context->upstreams_count; i++) {
+    lua_pushstring(L, context->upstreams[i].name);
+    l_pushupstream(L, &context->upstreams[i]);
+    lua_settable(L, -3);
+  }
+  return 1;
+}
+
+/**
+ * :handle_preconnect
+ * Opens (and keeps) warm connections to the given urls ahead of traffic.
+ * Later requests to those origins, with the same ssl settings, reuse them.
+ * The connections kept between batches stay bounded by the configure
+ * max_connects, preconnect never raises it.
+ */
+static int handle_preconnect(lua_State* L)
+{
+  int returned_status, returned_objects = 0;
+  size_t connections = 1;
+  request_handler* handler;
+
+  luaL_checktype(L, 1, LUA_TTABLE);
+  global_init();
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "connections");
+    if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) connections = (size_t)lua_tonumber(L, -1);
+    lua_pop(L, 1);
+  }
+
+  handler = preconnect_processor(L, connections);
+  if (handler == NULL) return error(L, "preconnect allocation failed");
+
+  returned_status = request_pool(handler);
+  if (returned_status < 0) {
+    free_request_handler(handler);
+    return error(L, "preconnect failed");
+  }
+  returned_objects = generate_preconnect_response(L, handler, connections);
+  free_request_handler(handler);
+  l_drain_log(L);
+  return returned_objects;
+}
+
+/**
+ * :handle_cache_stats
+ * Returns the responses cache counters
+ */
+static int handle_cache_stats(lua_State* L)
+{
+  async_context* context;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+
+  lua_newtable(L);
+  l_pushtablenumber(L, "entries", (double)context->cache.count);
+  l_pushtablenumber(L, "bytes", (double)context->cache.bytes);
+  l_pushtablenumber(L, "max_bytes", (double)context->cache.max_bytes);
+  l_pushtablenumber(L, "hits", (double)context->cache.hits);
+  l_pushtablenumber(L, "misses", (double)context->cache.misses);
+  l_pushtablenumber(L, "revalidations", (double)context->cache.revalidations);
+  l_pushtablenumber(L, "revalidated", (double)context->cache.revalidated);
+  l_pushtablenumber(L, "stores", (double)context->cache.stores);
+  l_pushtablenumber(L, "evictions", (double)context->cache.evictions);
+  return 1;
+}
+
+/**
+ * :handle_cache_clear
+ * Drops every cached response
+ */
+static int handle_cache_clear(lua_State* L)
+{
+  async_context* context;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+  clear_cache(&context->cache);
+  return 0;
+}
+
+/**
+ * :l_tolevel
+ * Reads a log level, a name ("off", "fatal", "error", "info", "debug") or a number (0-4)
+ */
+static int l_tolevel(lua_State* L, int index)
+{
+  const char* name;
+  int severity;
+
+  if (lua_type(L, index) == LUA_TNUMBER) {
+    severity = (int)lua_tonumber(L, index);
+    return (severity >= 0 && severity <= L_DEBUG) ? severity : -1;
+  }
+  if ((name = lua_tostring(L, index)) == NULL) return -1;
+  for (severity = 0; severity <= L_DEBUG; severity++)
+    if (strcmp(name, level_name(severity)) == 0) return severity;
+  return -1;
+}
+
+/**
+ * :handle_set_log_level
+ * Sets the logger level at runtime, returns the previous one
+ */
+static int handle_set_log_level(lua_State* L)
+{
+  int previous = logger_level(), severity = l_tolevel(L, 1);
+
+  if (severity < 0) return error(L, "invalid log level");
+  logger_set_level(severity);
+  lua_pushstring(L, level_name(previous));
+  return 1;
+}
+
+/**
+ * :handle_set_logger
+ * Sets the logger sink: "stderr", a file path (appended) or a lua function,
+ * which gets each record table on the lua thread (after each call, or async.flush_log).
+ * The sink is process wide, a lua function gets the records of every lua state.
+ * Options: format = "kv" (default) | "json".
+ */
+static int handle_set_logger(lua_State* L)
+{
+  int log_format = LOG_FORMAT_KV;
+  const char* target;
+
+  if (lua_istable(L, 2)) {
+    lua_getfield(L, 2, "format");
+    if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "json") == 0) log_format = LOG_FORMAT_JSON;
+    lua_pop(L, 1);
+  }
+
+  if (lua_isfunction(L, 1)) lua_pushvalue(L, 1);
+  else lua_pushnil(L);
+  lua_setfield(L, LUA_REGISTRYINDEX, LOG_CALLBACK_KEY);
+
+  if (lua_isfunction(L, 1)) {
+    logger_set_sink(LOG_SINK_LUA, NULL, log_format, get_context(L));
+    return 0;
+  }
+
+  target = luaL_checkstring(L, 1);
+  if (strcmp(target, "stderr") == 0) logger_set_sink(LOG_SINK_STDERR, NULL, log_format, NULL);
+  else if (!logger_set_sink(LOG_SINK_FILE, target, log_format, NULL)) return error(L, "can't open the log file");
+  return 0;
+}
+
+/**
+ * :handle_flush_log
+ * Writes the queued log records right away (or hands them to the lua sink)
+ */
+static int handle_flush_log(lua_State* L)
+{
+  logger_flush();
+  l_drain_log(L);
+  return 0;
+}
+
+/**
+ * :handle_log_stats
+ * Returns the logger level and counters
+ */
+static int handle_log_stats(lua_State* L)
+{
+  lua_newtable(L);
+  l_pushtablestring(L, "level", (char*)level_name(logger_level()));
+  l_pushtablenumber(L, "written", (double)logger_written());
+  l_pushtablenumber(L, "dropped", (double)logger_dropped());
+  l_pushtablenumber(L, "pending", (double)logger_pending());
+  return 1;
+}
+
+/**
+ * :handle_cancel_token
+ * Creates a new cancel token, passed to a batch by the "cancel" option.
+ */
+static int handle_cancel_token(lua_State* L)
+{
+  cancel_token* token = (cancel_token*) lua_newuserdata(L, sizeof(cancel_token));
+  token->cancelled = 0;
+  luaL_getmetatable(L, CANCEL_TOKEN_MT);
+  lua_setmetatable(L, -2);
+  return 1;
+}
+
+/**
+ * :cancel_token_cancel_method, cancel_token_cancelled_method, cancel_token_reset_method
+ * The cancel token lua methods (token:cancel(), token:cancelled(), token:reset())
+ */
+static int cancel_token_cancel_method(lua_State* L)
+{
+  cancel_token_cancel((cancel_token*) luaL_checkudata(L, 1, CANCEL_TOKEN_MT));
+  return 0;
+}
+
+static int cancel_token_cancelled_method(lua_State* L)
+{
+  lua_pushboolean(L, cancel_token_cancelled((cancel_token*) luaL_checkudata(L, 1, CANCEL_TOKEN_MT)));
+  return 1;
+}
+
+static int cancel_token_reset_method(lua_State* L)
+{
+  cancel_token_reset((cancel_token*) luaL_checkudata(L, 1, CANCEL_TOKEN_MT));
+  return 0;
+}
+
 /**
  * :handle_request
  * The entry point for each lua async request.
  */
 static int handle_request(lua_State* L) {
   int returned_status, returned_objects = 0;
-  request_handler* handler = request_processor(L);
+  request_handler* handler;
+
+  global_init();
+  handler = request_processor(L);
   
   /* CASE init_requests ALLOCATION FAILED */
   if (handler == NULL) return error(L, "requests allocation failed");
-  
-  /* case first time library run */
-  if (first_time_library_used)
-  {
-    curl_global_init(CURL_GLOBAL_ALL);
-    first_time_library_used = 0;
-  }
 
   returned_status = request_pool(handler);
   switch (returned_status)
@@ -44,14 +585,86 @@ static int handle_request(lua_State* L) {
     case INVALID_SELECT_VALUE:
       free_request_handler(handler);
       return error(L, "file descriptors select result is invalid");
+    case SCHEDULER_ERROR:
+      free_request_handler(handler);
+      return error(L, "requests scheduling allocation failed");
     default:
     break;
   }  
-  returned_objects = generate_response(L, handler);
+  if (handler->options.result_format == RESULT_COLUMNAR) returned_objects = generate_columnar_response(L, handler);
+  else returned_objects = generate_response(L, handler);
+  returned_objects += generate_stats(L, handler);
   free_request_handler(handler);
+  l_drain_log(L);
   return returned_objects;
 }
 
+/**
+ * :handle_context
+ * Returns the context of the lua state (a light userdata), the ffi module
+ * runs its batches on it, sharing the connections, caches and host policies.
+ */
+static int handle_context(lua_State* L)
+{
+  async_context* context;
+
+  global_init();
+  if ((context = get_context(L)) == NULL) return error(L, "context allocation failed");
+  lua_pushlightuserdata(L, context);
+  return 1;
+}
+
+/**
+ * :handle_drain_log
+ * Hands the queued log records to the lua sink, as after each request call
+ */
+static int handle_drain_log(lua_State* L)
+{
+  l_drain_log(L);
+  return 0;
+}
+
+/**
+ * :lua_async_http_execute
+ * The LuaJIT FFI entry point (src/lua_async_http_ffi.lua), runs a batch of request
+ * descriptors on a lua state context without the lua C API. The responses point
+ * into the batch until lua_async_http_release. Returns 0, or an ERR.
+ */
+int lua_async_http_execute(async_context* context, const lua_async_http_request* requests, size_t count,
+                           const lua_async_http_batch* batch, lua_async_http_result** result)
+{
+  int returned_status;
+  request_handler* handler;
+
+  global_init();
+  *result = NULL;
+  handler = ffi_request_processor(context, requests, count, batch);
+  if (handler == NULL) return ALLOCATION_ERROR;
+
+  returned_status = request_pool(handler);
+  if (returned_status < 0) {
+    free_request_handler(handler);
+    return returned_status;
+  }
+  if ((*result = ffi_generate_response(handler)) == NULL) {
+    free_request_handler(handler);
+    return ALLOCATION_ERROR;
+  }
+  return 0;
+}
+
+/**
+ * :lua_async_http_release
+ * Frees an ffi batch result, with the batch its responses point into
+ */
+void lua_async_http_release(lua_async_http_result* result)
+{
+  if (result == NULL) return;
+  free_request_handler(result->handler);
+  free(result->responses);
+  free(result);
+}
+
 /**
  * @struct luaL_Reg
  * an internal mapping for the lua stack stracture.
@@ -60,6 +673,35 @@ static int handle_request(lua_State* L) {
 static const struct luaL_Reg lib_mapping [] = 
 {
   {"request", handle_request},
+  {"resolve", handle_resolve},
+  {"configure", handle_configure},
+  {"preconnect", handle_preconnect},
+  {"cancel_token", handle_cancel_token},
+  {"host_policy", handle_host_policy},
+  {"breaker_state", handle_breaker_state},
+  {"reset_breaker", handle_reset_breaker},
+  {"upstream", handle_upstream},
+  {"upstream_state", handle_upstream_state},
+  {"cache_stats", handle_cache_stats},
+  {"cache_clear", handle_cache_clear},
+  {"set_log_level", handle_set_log_level},
+  {"set_logger", handle_set_logger},
+  {"flush_log", handle_flush_log},
+  {"log_stats", handle_log_stats},
+  {"context", handle_context},
+  {"drain_log", handle_drain_log},
+  {NULL, NULL}
+};
+
+/**
+ * @struct luaL_Reg
+ * the cancel token methods
+ **/
+static const struct luaL_Reg cancel_token_mapping [] = 
+{
+  {"cancel", cancel_token_cancel_method},
+  {"cancelled", cancel_token_cancelled_method},
+  {"reset", cancel_token_reset_method},
   {NULL, NULL}
 };
 
@@ -68,6 +710,18 @@ static const struct luaL_Reg lib_mapping [] =
  * An internal lua registeration for lua_async_http library.
  **/
 int luaopen_lua_async_http(lua_State* L) {
+    global_init();
+
+    luaL_newmetatable(L, CANCEL_TOKEN_MT);
+    lua_newtable(L);
+    luaL_register(L, NULL, cancel_token_mapping);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 1);
+
     luaL_register(L, "lua_async_http", lib_mapping);
+
+    /* DECODED JSON NULLS (A TABLE CAN'T HOLD NIL) */
+    lua_pushlightuserdata(L, NULL);
+    lua_setfield(L, -2, "null");
     return 1;
 }
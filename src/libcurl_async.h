@@ -6,22 +6,70 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <stdarg.h>
 #include <unistd.h>
+#include <time.h>
+#include <pthread.h>
 #include <curl/multi.h>
 
 #define DEFAULT_MAX 10                    /* default MAX number of simultaneous transfers               */
+#define DEFAULT_MAX_CONNECTS 64L          /* default MAX number of idle connections kept between batches */
 #define DEFAULT_REQUEST_TIMEOUT 8L        /* default request timeout incase response being delayed      */
 #define MILLISECONDS 1000                 /* milliseconds                                               */
+#define CANCEL_POLL_MS 50L                /* MAX wait between cancel token checks                       */
 #define DEFAULT_REQUEST_EXPECTATIONS 0L   /* default request header expectations aka verifications      */
+#define DEFAULT_BREAKER_FAILURES 5        /* consecutive host failures that open the circuit breaker    */
+#define DEFAULT_BREAKER_ERROR_RATE 0.5    /* host error rate (in the window) that opens the breaker     */
+#define DEFAULT_BREAKER_MIN_REQUESTS 10   /* requests in the window before the error rate applies       */
+#define DEFAULT_BREAKER_WINDOW_MS 10000L  /* error rate window (in milliseconds)                        */
+#define DEFAULT_BREAKER_OPEN_MS 5000L     /* open breaker period before half open probes (milliseconds) */
+#define DEFAULT_EWMA_WEIGHT 0.3           /* weight of the latest latency sample in an endpoint EWMA    */
+#define DEFAULT_EJECT_FAILURES 5          /* consecutive endpoint failures that eject it from its pool  */
+#define DEFAULT_EJECT_MS 10000L           /* base ejection period, grows with each ejection (milliseconds) */
+#define DEFAULT_MAX_EJECTED_PERCENT 50    /* MAX share of a pool endpoints ejected at the same time     */
+#define MAX_EJECT_MULTIPLIER 10           /* caps the ejection period growth (times eject_ms)           */
+#define DEFAULT_DNS_CACHE_TIMEOUT 60L      /* default dns cache entries ttl (in seconds)                 */
+#define DEFAULT_CACHE_MAX_BYTES (32L * 1024 * 1024) /* default response cache size (in bytes)            */
+#define DEFAULT_RANGE_CHUNK_MIN (1024L * 1024) /* default minimal part of a ranged download (in bytes)   */
+#define DEFAULT_RESOLVE_THREADS 8         /* max parallel lookups in a single resolve call              */
+#define MAX_BATCH_THREADS 64              /* MAX worker threads (shards) of a single batch              */
 #define PP_CERT_TYPE "PEM"
-#define LOG_LEVEL 2
+#define LOG_LEVEL 2                       /* default verbosity (VERBOSE_VV), async.set_log_level changes it */
 
-#define LOGGER_BUFFER_SIZE 128
+#define LOG_RING_SIZE 1024                /* logger ring slots (a power of 2)                           */
+#define LOG_FUNC_SZ 48
+#define LOG_NAME_SZ 64
+#define LOG_URL_SZ 256
+#define LOG_MESSAGE_SZ 512
+#define LOG_LINE_SZ 4096
 #define TBL_KEY_SZ 256
 #define TBL_VAL_SZ 1024
 #define HEADER_SPACING 2
+#define JSON_MAX_DEPTH 512                /* MAX nesting of a decoded JSON body                         */
+#define JSON_INITIAL_TOKENS 64
+#define RANGE_HEADER_SZ 320
+#define MAX_SUCCESS_CODES 32
+#define COLUMNS_COUNT 14                  /* the columnar result columns (RESULT_COLUMNS)               */
+#define ALL_COLUMNS ((1u << COLUMNS_COUNT) - 1)
+#define FFI_NUMBERS_COUNT 10              /* the ffi request number fields (FFI_NUMBERS)                */
+#define FFI_STRINGS_COUNT 11              /* the ffi request string fields (FFI_STRINGS)                */
+#define SCHEDULER_NONE ((size_t)-1)
+#define DNS_HOST_SZ 256
+#define UPSTREAM_SCHEME "svc://"
+#define UPSTREAM_NAME_SZ 64
+#define UPSTREAM_URL_SZ 256
+#define DNS_ADDRESSES_SZ 512
+#define FNV_OFFSET_BASIS 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+#define CACHE_VALIDATOR_SZ 256
+#define CACHE_VARY_SZ 256
+#define CACHE_BUCKETS 1024
 #define LUA_ASYNC_HTTP_TITLE "LUA_ASYNC_HTTP_LIB"
+#define CANCEL_TOKEN_MT "lua_async_http.cancel_token"
+#define LOG_CALLBACK_KEY "lua_async_http.log_callback"
+#define CONTEXT_KEY "lua_async_http.context"
+#define CONTEXT_MT "lua_async_http.context_mt"
 #define DISABLE_EXPECT_100_CONTINUE "Expect:"
 
 /* ============================================= OBJECTS ============================================= */
@@ -37,6 +85,38 @@ typedef struct {
   size_t  count;
 } header;
 
+typedef struct cache_entry cache_entry;
+typedef struct batch_shard batch_shard;
+typedef struct range_part range_part;
+
+typedef struct {
+  unsigned char type;                     /* token type (JSON_TYPES)                                    */
+  unsigned char escaped;                  /* the string was unescaped into the tape strings             */
+  size_t  len;                            /* string length, or the container elements count             */
+  size_t  offset;                         /* string offset (in the body, or in the tape strings)        */
+  double  number;                         /* number value                                               */
+} json_token;
+
+typedef struct {
+  json_token* tokens;                     /* the decoded values, in document order                      */
+  size_t  count;                          /* tokens count                                               */
+  size_t  capacity;                       /* tokens allocated count                                     */
+  char*   strings;                        /* unescaped strings                                          */
+  size_t  strings_len;                    /* unescaped strings length                                   */
+  size_t  strings_capacity;               /* unescaped strings allocated length                         */
+} json_tape;
+
+typedef struct {
+  char    etag[CACHE_VALIDATOR_SZ];       /* ETag response header                                       */
+  char    last_modified[CACHE_VALIDATOR_SZ]; /* Last-Modified response header                           */
+  char    vary[CACHE_VARY_SZ];            /* Vary response header (lower case header names)             */
+  long    max_age;                        /* Cache-Control max-age in seconds (-1 when missing)         */
+  int     no_store;                       /* Cache-Control no-store / private                           */
+  int     no_cache;                       /* Cache-Control no-cache (always revalidate)                 */
+  int     is_public;                      /* Cache-Control public (stored for Authorization requests)   */
+  int     accept_ranges;                  /* Accept-Ranges: bytes (ranged downloads)                    */
+} cache_headers;
+
 typedef struct {
   string  request_key;                    /* the outer request id                                       */
   string  url;                            /* request url                                                */
@@ -55,34 +135,457 @@ typedef struct {
   string  password;                       /* request password                                           */
 
   char*   read_cb_ptr;                    /* read callback ptr address (request_body ptr may change)    */
+  struct  curl_slist* resolve_slist;      /* dns overrides for the request host (freed on completion)   */
+  CURL*   easy;                           /* the running libcurl easy handle (NULL when not running)    */
+  CURLcode result;                        /* the transfer result code                                   */
+  int     state;                          /* the request state (REQUEST_STATES)                         */
+  int     priority;                       /* scheduling priority, higher starts first (default 0)       */
+  size_t  host_index;                     /* the request batch host (and its scheduler queue)           */
+  size_t  shard;                          /* the shard running the transfer (threads option)            */
+  double  queue_time;                     /* time spent queued before the transfer started (seconds)    */
+  double  total_time;                     /* transfer start to completion (seconds, 0 if not completed) */
+  size_t  upstream;                       /* the svc:// url upstream pool (SCHEDULER_NONE otherwise)    */
+  size_t  endpoint;                       /* the upstream endpoint picked for the transfer (SCHEDULER_NONE) */
+  int     endpoint_held;                  /* the request counts in its endpoint in flight requests      */
+  char    endpoint_url[UPSTREAM_URL_SZ];  /* the picked endpoint url                                    */
+  string  target_url;                     /* the url sent to the picked endpoint                        */
+  int     breaker_probe;                  /* the request is a half open breaker probe                   */
+  size_t  leader;                         /* the coalesced request running the transfer (SCHEDULER_NONE) */
+  size_t  next_follower;                  /* the next request coalesced into this one (SCHEDULER_NONE)  */
+  int     shared_response;                /* the response buffers belong to the leader                  */
+  cache_headers cache_meta;               /* caching headers captured by the header callback            */
+  cache_entry* cached;                    /* the (pinned) stale cache entry being revalidated           */
+  int     cache_status;                   /* the request cache outcome (CACHE_STATUSES)                 */
+  long    parallel_ranges;                /* MAX concurrent Range parts of the download (0 for off)     */
+  long    range_chunk_min;                /* minimal download part (in bytes)                           */
+  int     range_phase;                    /* the ranged download phase (RANGE_PHASES)                   */
+  range_part* parts;                      /* the download parts (NULL once completed)                   */
+  size_t  parts_count;                    /* download parts count (0 for a single stream)               */
+  size_t  parts_running;                  /* download parts still running                               */
+  string  output_file;                    /* writes the response body to this file instead of memory   */
+  int     decode;                         /* response body decoding (DECODES)                           */
+  int     keep_body;                      /* returns the raw body along with the decoded one            */
+  json_tape* json;                        /* the decoded body (NULL until decoded)                      */
+  char    decode_error[CURL_ERROR_SIZE];  /* body decoding error                                        */
+  int     output_fd;                      /* the output file descriptor (-1 when closed)                */
   int     verify_peer;                    /* ssl peer verification                                      */
   int     verify_host;                    /* ssl host verification                                      */
   int     debug;                          /* debug certain request                                      */
   long    timeout;                        /* request timeout                                            */
+  long    connect_timeout;                /* connect timeout, split between the resolved addresses      */
   long    expectations;                   /* header expectations for request continuation               */
 } request;
 
+struct range_part {
+  request* parent;                        /* the ranged request                                         */
+  CURL*   easy;                           /* the part easy handle (NULL once completed)                 */
+  struct  curl_slist* headers;            /* the part request headers (Range, If-Range)                 */
+  size_t  offset;                         /* first byte of the part                                     */
+  size_t  length;                         /* part length                                                */
+  size_t  written;                        /* part bytes received                                        */
+  char    error[CURL_ERROR_SIZE];         /* part transfer error                                        */
+};
+
+typedef struct {
+  char    host[DNS_HOST_SZ];              /* resolved host name                                         */
+  long    port;                           /* resolved host port                                         */
+  char    addresses[DNS_ADDRESSES_SZ];    /* comma separated addresses (CURLOPT_RESOLVE format)         */
+  double  expires_at;                     /* monotonic expiry time (in milliseconds)                    */
+} dns_entry;
+
+typedef struct {
+  char    host[DNS_HOST_SZ];              /* host name to lookup                                        */
+  char    addresses[DNS_ADDRESSES_SZ];    /* lookup result, comma separated addresses                   */
+  char    error[CURL_ERROR_SIZE];         /* lookup error                                               */
+} dns_lookup;
+
+typedef struct {
+  double  rate;                           /* token bucket refill, requests per second (0 for no limit)  */
+  double  burst;                          /* token bucket size                                          */
+  size_t  failure_threshold;              /* consecutive failures that open the breaker (0 disables)    */
+  double  error_rate;                     /* window error rate that opens the breaker (0 disables)      */
+  size_t  min_requests;                   /* window requests before the error rate applies              */
+  long    window_ms;                      /* error rate window (in milliseconds)                        */
+  long    open_ms;                        /* open period before half open probes (in milliseconds)      */
+  size_t  half_open_max;                  /* concurrent half open probes                                */
+} host_policy;
+
+typedef struct {
+  char    host[DNS_HOST_SZ];              /* host name                                                  */
+  host_policy policy;                     /* host policy                                                */
+  int     has_policy;                     /* the policy was set for this host (async.host_policy)       */
+  double  tokens;                         /* token bucket tokens                                        */
+  double  refilled_at;                    /* last token bucket refill (monotonic ms)                    */
+  int     breaker;                        /* breaker state (BREAKER_STATES)                             */
+  size_t  consecutive_failures;           /* failures in a row                                          */
+  size_t  window_requests;                /* requests in the current window                             */
+  size_t  window_failures;                /* failures in the current window                             */
+  double  window_start;                   /* current window start (monotonic ms)                        */
+  double  opened_at;                      /* breaker open time (monotonic ms)                           */
+  size_t  half_open_in_flight;            /* running half open probes                                   */
+  size_t  requests;                       /* total requests                                             */
+  size_t  failures;                       /* total failures                                             */
+  size_t  rejected;                       /* total requests failed fast by the breaker                  */
+} host_state;
+
+typedef struct {
+  double  ewma_weight;                    /* weight of the latest latency sample (0-1]                  */
+  size_t  eject_failures;                 /* consecutive failures that eject an endpoint (0 disables)   */
+  long    eject_ms;                       /* base ejection period (in milliseconds)                     */
+  double  max_ejected_percent;            /* MAX share of the endpoints ejected at once                 */
+} upstream_policy;
+
+typedef struct {
+  char    url[UPSTREAM_URL_SZ];           /* endpoint base url (scheme://host[:port][/prefix])          */
+  size_t  in_flight;                      /* running requests on the endpoint                           */
+  double  ewma_ms;                        /* completion latency EWMA (0 before the first sample)        */
+  size_t  consecutive_failures;           /* failures in a row                                          */
+  size_t  ejections;                      /* ejections since the last success (grows the period)        */
+  double  ejected_until;                  /* ejected until (monotonic ms, 0 when never ejected)         */
+  size_t  requests;                       /* total requests                                             */
+  size_t  failures;                       /* total failures                                             */
+} upstream_endpoint;
+
+typedef struct {
+  char    name[UPSTREAM_NAME_SZ];         /* pool name, the svc://name urls                             */
+  upstream_policy policy;                 /* load balancing / ejection policy                           */
+  upstream_endpoint* endpoints;           /* the pool endpoints                                         */
+  size_t  count;                          /* endpoints count                                            */
+  size_t  cursor;                         /* rotates the first endpoint looked at, spreads the ties     */
+} upstream;
+
+struct cache_entry {
+  char*   key;                            /* cache key: method and url                                  */
+  unsigned long long hash;                /* cache key hash                                             */
+  char    vary[CACHE_VARY_SZ];            /* Vary header names of the stored response                   */
+  char*   vary_values;                    /* request values of the Vary headers                         */
+  long    status;                         /* stored response status                                     */
+  string  body;                           /* stored response body                                       */
+  string  headers;                        /* stored response headers                                    */
+  char    etag[CACHE_VALIDATOR_SZ];       /* revalidation ETag                                          */
+  char    last_modified[CACHE_VALIDATOR_SZ]; /* revalidation Last-Modified                              */
+  double  expires_at;                     /* freshness end (monotonic ms)                               */
+  size_t  size;                           /* memory accounted for the entry                             */
+  size_t  pins;                           /* in-flight revalidations holding the entry                  */
+  cache_entry* prev;                      /* LRU list, more recently used                               */
+  cache_entry* next;                      /* LRU list, less recently used                               */
+  cache_entry* chain;                     /* next entry of the same hash bucket                         */
+};
+
+typedef struct {
+  cache_entry** buckets;                  /* entries hash table (CACHE_BUCKETS chains)                  */
+  cache_entry* head;                      /* most recently used entry                                   */
+  cache_entry* tail;                      /* least recently used entry                                  */
+  size_t  max_bytes;                      /* cache size bound                                           */
+  size_t  bytes;                          /* cached bytes                                               */
+  size_t  count;                          /* cached entries                                             */
+  size_t  hits;                           /* fresh responses served from the cache                      */
+  size_t  misses;                         /* cacheable requests sent to the network                     */
+  size_t  revalidations;                  /* stale entries revalidated with a conditional request       */
+  size_t  revalidated;                    /* revalidations answered by 304 (served from the cache)      */
+  size_t  stores;                         /* responses stored                                           */
+  size_t  evictions;                      /* entries evicted by the size bound                          */
+} http_cache;
+
+typedef struct {
+  CURLM*       multi;                     /* persistent multi handle, keeps connections between batches */
+  CURLM*       shard_multis[MAX_BATCH_THREADS - 1]; /* the other shards multi handles (created on first use) */
+  long         max_connects;              /* MAX idle connections kept by the multi handle              */
+  CURLSH*      share;                     /* share handle, keeps the dns cache between batches          */
+  pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST]; /* share handle locks, the shards share it           */
+  struct curl_slist* resolve;             /* static host:port:address overrides                         */
+  long         dns_cache_timeout;         /* dns cache entries ttl (in seconds)                         */
+  dns_entry*   dns_entries;               /* warmed dns entries (async.resolve)                         */
+  size_t       dns_count;                 /* warmed dns entries count                                   */
+  size_t       dns_capacity;              /* warmed dns entries allocated count                         */
+  host_policy  host_policy;               /* default rate limit / breaker policy                        */
+  host_state*  host_states;               /* persistent per host state                                  */
+  size_t       host_states_count;         /* per host states count                                      */
+  size_t       host_states_capacity;      /* per host states allocated count                            */
+  upstream*    upstreams;                 /* upstream pools (async.upstream)                            */
+  size_t       upstreams_count;           /* upstream pools count                                       */
+  http_cache   cache;                     /* responses cache                                            */
+} async_context;
+
+typedef struct {
+  char    host[DNS_HOST_SZ];              /* host name                                                  */
+  long    weight;                         /* host share of the scheduling rounds                        */
+} host_weight;
+
+typedef struct {
+  char    host[DNS_HOST_SZ];              /* host name                                                  */
+  long    port;                           /* host port                                                  */
+  size_t  in_flight;                      /* running requests of the host, every shard included         */
+  long    weight;                         /* host weight                                                */
+  long    current_weight;                 /* smooth weighted round robin state                          */
+} batch_host;
+
+typedef struct {
+  size_t  head;                           /* first queued request index (SCHEDULER_NONE when empty)     */
+  size_t  tail;                           /* last queued request index                                  */
+  double  blocked_until;                  /* rate limited until (monotonic ms)                          */
+} host_queue;
+
+typedef struct {
+  host_queue*  hosts;                     /* a queue per batch host (the batch hosts indexes)           */
+  size_t       count;                     /* host queues count                                          */
+  size_t*      next;                      /* the next queued request index, per request (linked queues) */
+  size_t       queued;                    /* queued requests count                                      */
+} scheduler;
+
+typedef struct {
+  volatile int cancelled;                 /* set once, from lua, another thread or a signal handler     */
+} cancel_token;
+
+typedef struct {
+  cancel_token* cancel;                   /* optional batch cancel token                                */
+  long         deadline_ms;               /* batch deadline, relative to the batch start (0 for none)   */
+  size_t       concurrency;               /* MAX simultaneous transfers of the batch                    */
+  int          wait;                      /* batch completion mode (WAIT_MODES)                         */
+  size_t       quorum;                    /* successes needed by WAIT_QUORUM                            */
+  long         success_codes[MAX_SUCCESS_CODES]; /* exact success statuses                              */
+  size_t       success_codes_count;       /* exact success statuses count                               */
+  unsigned int success_classes;           /* success status classes bitmask (1 << 2 stands for 2xx)     */
+  struct curl_slist* resolve;             /* batch static host:port:address overrides                   */
+  long         dns_cache_timeout;         /* batch dns cache ttl (-1 uses the context ttl, never forever) */
+  int          prefetch_dns;              /* resolve the batch hosts (coalesced) before transfers       */
+  size_t       max_per_host;              /* MAX in-flight requests per host:port (0 for no limit)      */
+  host_weight* host_weights;              /* hosts scheduling weights                                   */
+  size_t       host_weights_count;        /* hosts scheduling weights count                             */
+  int          coalesce;                  /* run identical idempotent requests once                     */
+  struct curl_slist* coalesce_headers;    /* header names of the coalescing fingerprint (NULL for all)  */
+  int          cache;                     /* serve and store GET responses with the context cache       */
+  size_t       threads;                   /* worker threads (shards) running the batch                  */
+  int          preconnect;                /* warm-up batch: a connection per request, never multiplexed */
+  int          result_format;             /* the responses layout (RESULT_FORMATS)                      */
+  unsigned int columns;                   /* the columnar result columns (1 << RESULT_COLUMNS)          */
+} batch_options;
+
+typedef struct {
+  size_t       completed;                 /* requests that completed a transfer                         */
+  size_t       succeeded;                 /* completed requests that matched the success statuses       */
+  size_t       cancelled;                 /* requests cancelled (wait condition settled / cancel token) */
+  size_t       deadline_exceeded;         /* requests ended (or never started) by the batch deadline    */
+  size_t       circuit_open;              /* requests failed fast by an open host circuit breaker       */
+  size_t       coalesced;                 /* requests served by an identical request transfer           */
+  size_t       cache_hits;                /* requests served fresh from the cache                       */
+  size_t       cache_misses;              /* cacheable requests sent to the network                     */
+  size_t       cache_revalidated;         /* stale requests answered by 304 (served from the cache)     */
+  size_t       threads;                   /* threads (shards) that ran the batch                        */
+  size_t       stolen;                    /* requests run by another shard than the one queuing them    */
+  int          wait_met;                  /* the wait condition was met                                 */
+} batch_stats;
+
 typedef struct {
   request*     requests;                  /* request objects                                            */
   size_t       count;                     /* request count                                              */
+  batch_options options;                  /* batch wide options                                         */
+  batch_stats  stats;                     /* batch counters, returned to lua                            */
+  double       deadline;                  /* absolute batch deadline (monotonic ms, 0 for none)         */
+  double       started_at;                /* batch start (monotonic ms)                                 */
+  batch_host*  hosts;                     /* the batch hosts (in flight, weights), shared by the shards */
+  size_t       hosts_count;               /* batch hosts count                                          */
+  batch_shard* shards;                    /* the batch partitions, a multi handle and a scheduler each  */
+  size_t       shards_count;              /* shards count (the threads option)                          */
+  pthread_mutex_t lock;                   /* guards the batch state shared by the shards                */
+  int          stop_state;                /* the state ending the unfinished requests (0 while running) */
+  const char*  stop_reason;               /* why the batch stopped early                                */
+  async_context* context;                 /* the persistent context the batch runs on                   */
 } request_handler;
 
-char logger_buffer[LOGGER_BUFFER_SIZE];   /* the buffer used for logger messages                        */
+struct batch_shard {
+  request_handler* handler;               /* the batch                                                  */
+  size_t       index;                     /* shard index, owns the requests where index % shards == i   */
+  CURLM*       multi;                     /* the shard multi handle (persistent, one per shard index)   */
+  scheduler    sched;                     /* the shard queued requests, by priority and host            */
+  size_t       running;                   /* running requests                                           */
+  size_t       max_running;               /* the shard share of the batch concurrency                   */
+  int          status;                    /* the shard result (1, or an ERR)                            */
+};
+
+typedef struct {
+  size_t  sequence;                       /* ring slot sequence (lock-free MPMC ring)                   */
+  unsigned char level;                    /* record severity (LOG_LEVELS)                               */
+  double  time;                           /* wall clock time (milliseconds since epoch)                 */
+  char    func[LOG_FUNC_SZ];              /* the logging function                                       */
+  char    name[LOG_NAME_SZ];              /* request name (empty without a request context)             */
+  char    url[LOG_URL_SZ];                /* request url (empty without a request context)              */
+  char    message[LOG_MESSAGE_SZ];        /* the formatted message                                      */
+} log_record;
+
+/* THE LUAJIT FFI ABI, src/lua_async_http_ffi.lua DECLARES THE SAME LAYOUT (CHANGE BOTH) */
+
+typedef struct {
+  const char* ptr;                        /* the data (not always NUL terminated)                       */
+  size_t  len;                            /* the data length                                            */
+} lua_async_http_buffer;
+
+typedef struct {
+  const char* strings[FFI_STRINGS_COUNT]; /* the request string keys (FFI_STRINGS), NULL when not given */
+  double  numbers[FFI_NUMBERS_COUNT];     /* the request number keys (FFI_NUMBERS), booleans as 1|0     */
+  unsigned int numbers_set;               /* the number keys given (1 << FFI_NUMBERS)                   */
+  const char* const* headers;             /* "Name: value" header lines                                 */
+  size_t  headers_count;                  /* header lines count                                         */
+} lua_async_http_request;
+
+typedef struct {
+  void*   cancel;                         /* an async.cancel_token() (NULL for none)                    */
+  double  deadline_ms;                    /* the batch options, 0 when not given...                     */
+  double  concurrency;
+  double  threads;
+  double  quorum;                         /* the "k" option                                             */
+  double  max_per_host;
+  double  dns_cache_timeout;              /* ...but this one, -1 when not given                         */
+  int     wait;                           /* WAIT_MODES                                                 */
+  int     prefetch_dns;
+  int     coalesce;
+  int     cache;
+  long    success_codes[MAX_SUCCESS_CODES]; /* exact success statuses                                   */
+  size_t  success_codes_count;            /* exact success statuses count                               */
+  unsigned int success_classes;           /* success status classes bitmask (1 << 2 stands for 2xx)     */
+} lua_async_http_batch;
+
+typedef struct {
+  lua_async_http_buffer name;             /* the request name                                           */
+  lua_async_http_buffer url;              /* the request url                                            */
+  lua_async_http_buffer body;             /* the raw body (empty once decoded, unless keep_body)        */
+  lua_async_http_buffer headers;          /* the raw response headers                                   */
+  lua_async_http_buffer error;            /* response_error                                             */
+  lua_async_http_buffer decode_error;     /* body decoding error                                        */
+  const char* state;                      /* response_state                                             */
+  const char* cache_status;               /* cache_status                                               */
+  long    status;                         /* response_status                                            */
+  double  queue_time;                     /* seconds the request was queued                             */
+  size_t  ranges;                         /* parts of a ranged download                                 */
+  int     decode;                         /* body decoding (DECODES)                                    */
+  const json_token* json;                 /* the decoded body tape (NULL when not decoded)              */
+  size_t  json_count;                     /* the tape tokens count                                      */
+  const char* json_strings;               /* the tape unescaped strings                                 */
+  const char* json_body;                  /* the body the other tape strings point into                 */
+  double  total_time;                     /* transfer start to completion (seconds)                     */
+  lua_async_http_buffer endpoint;         /* the upstream endpoint (svc:// urls only)                   */
+} lua_async_http_response;
+
+typedef struct {
+  size_t  requests;                       /* the batch counters (batch_stats)                           */
+  size_t  completed;
+  size_t  succeeded;
+  size_t  cancelled;
+  size_t  deadline_exceeded;
+  size_t  circuit_open;
+  size_t  coalesced;
+  size_t  cache_hits;
+  size_t  cache_misses;
+  size_t  cache_revalidated;
+  size_t  threads;
+  size_t  stolen;
+  int     wait_met;
+} lua_async_http_stats;
+
+typedef struct {
+  lua_async_http_response* responses;     /* the responses, in the requests order                       */
+  size_t  count;                          /* responses count                                            */
+  lua_async_http_stats stats;             /* the batch counters                                         */
+  request_handler* handler;               /* the batch the responses point into                         */
+} lua_async_http_result;
 
 /* ============================================= FUNCTIONS ============================================= */
 
 /* LIBCURL METHODS */
 int request_pool(request_handler* request_handler);
 struct curl_slist* define_request_headers(CURL *eh, request* request);
-void init_curl_handle(CURLM *cm, int i, request* requests);
+int init_curl_handle(CURLM *cm, request_handler* handler, size_t i);
+void setup_transfer(CURL *eh, request_handler* handler, request* request);
+void release_curl_handle(CURLM *cm, request* request);
+int is_success(request_handler* handler, request* request);
+int batch_settled(request_handler* handler);
+void cancel_requests(batch_shard* shard, int state, const char* reason);
 void setup_ssl_request(CURL *eh, request* request);
 void setup_put_request(CURL *eh, request* request);
 void setup_post_request(CURL *eh, request* request);
 
+/* CONTEXT METHODS */
+int init_context(async_context* ctx);
+async_context* get_context(lua_State* L);
+CURLM* context_multi(async_context* ctx, size_t shard);
+void free_context(async_context* context);
+
+/* SCHEDULER METHODS */
+int scheduler_hosts(request_handler* handler);
+int scheduler_init(request_handler* handler, scheduler* sched, size_t shard, size_t shards);
+size_t scheduler_next(request_handler* handler, scheduler* sched);
+void scheduler_done(request_handler* handler, request* request);
+void scheduler_requeue(request_handler* handler, scheduler* sched, size_t index, double until);
+double scheduler_wake_at(scheduler* sched);
+void free_scheduler(scheduler* sched);
+void free_scheduler_hosts(request_handler* handler);
+
+/* CACHE METHODS */
+void init_cache(http_cache* cache);
+void clear_cache(http_cache* cache);
+void cache_resize(http_cache* cache, size_t max_bytes);
+void cache_lookup(request_handler* handler);
+void cache_response(request_handler* handler, request* request);
+void cache_release(request* request);
+size_t header_callback(void* ptr, size_t size, size_t nmemb, request* request);
+struct curl_slist* define_cache_headers(struct curl_slist* headers, request* request);
+const char* cache_status_name(int status);
+
+/* RANGES METHODS */
+int is_ranged(request* request);
+int range_transfer_done(request_handler* handler, CURLM *cm, request* request, CURL* easy, CURLcode* result);
+void release_range_parts(CURLM *cm, request* request);
+int open_output_file(request* request);
+void close_output_file(request* request);
+size_t output_write(void* ptr, size_t size, size_t nmemb, request* request);
+size_t range_write(void* ptr, size_t size, size_t nmemb, void* userp);
+
+/* JSON METHODS */
+void json_init(void);
+int decode_response(request* request);
+void free_json(json_tape* tape);
+
+/* COALESCING METHODS */
+int coalesce_requests(request_handler* handler);
+void settle_followers(request_handler* handler, request* leader);
+
+/* HOST BREAKER METHODS */
+void default_host_policy(host_policy* policy);
+void reset_host_state(host_state* state);
+void set_host_policy(host_state* state, const host_policy* policy);
+host_state* get_host_state(async_context* context, const char* host);
+void refresh_breaker(host_state* state, double now);
+int host_admit(async_context* context, request* request, double* retry_at);
+void host_report(async_context* context, request* request, int outcome);
+int is_host_failure(request* request);
+const char* breaker_state_name(int breaker);
+
+/* UPSTREAM METHODS */
+void default_upstream_policy(upstream_policy* policy);
+int is_upstream_url(const char* url);
+upstream* find_upstream(async_context* context, const char* name, size_t* index);
+upstream* define_upstream(async_context* context, const char* name, const char** urls, size_t count);
+void upstream_pick(async_context* context, request* request);
+void upstream_report(async_context* context, request* request, int outcome);
+const char* request_url(request* request);
+void free_upstreams(async_context* context);
+
+/* DNS METHODS */
+int dns_resolve(dns_lookup* lookups, size_t count);
+void dns_cache_put(async_context* context, const char* host, long port, const char* addresses, long ttl);
+const dns_entry* dns_cache_get(async_context* context, const char* host, long port);
+struct curl_slist* define_request_resolve(request_handler* handler, request* request);
+void prefetch_dns(request_handler* handler);
+
 /* REQUEST HANDLER METHODS */
 int init_requests(request_handler* handler);
 int init_request_headers(request* request, int total_header_fields);
 
+/* CANCEL TOKEN METHODS */
+void cancel_token_cancel(cancel_token* token);
+void cancel_token_reset(cancel_token* token);
+int cancel_token_cancelled(cancel_token* token);
+
 /* HELPERS METHODS */
 void init_string(string *s);
 size_t writefunc(void *ptr, size_t size, size_t nmemb, string *s);
@@ -90,37 +593,196 @@ void set_read_cb_ptr(request* request);
 size_t read_callback(void *dest, size_t size, size_t nmemb, void *userp);
 size_t memcpy_string(const char *str, string *s);
 int is_https(const char* url);
+int url_host_port(const char* url, char* host, size_t host_sz, long* port);
+double monotonic_ms(void);
+double realtime_ms(void);
+unsigned long long fnv1a(unsigned long long hash, const char* data, size_t len, int lower);
+int request_header_value(request* request, const char* name, char* value, size_t value_sz);
 int is_empty(const char* str);
 int method_put(const char* method);
 int method_get(const char* method);
 int method_post(const char* method);
+int method_head(const char* method);
+
+/* FFI METHODS */
+int lua_async_http_execute(async_context* context, const lua_async_http_request* requests, size_t count,
+                           const lua_async_http_batch* batch, lua_async_http_result** result);
+void lua_async_http_release(lua_async_http_result* result);
+request_handler* ffi_request_processor(async_context* context, const lua_async_http_request* requests, size_t count,
+                                       const lua_async_http_batch* batch);
+lua_async_http_result* ffi_generate_response(request_handler* handler);
 
 /* LUA API METHODS */
 void free_request_handler(request_handler* handler);
 request_handler* request_processor(lua_State* L);
+request_handler* preconnect_processor(lua_State* L, size_t connections);
+int generate_preconnect_response(lua_State* L, request_handler* handler, size_t connections);
+void default_batch_options(batch_options* options);
+void batch_options_processor(lua_State* L, int index, batch_options* options);
+struct curl_slist* l_toslist(lua_State* L, int index);
+int l_tobool(lua_State* L, int index);
+void* l_toudata(lua_State* L, int index, const char* tname);
+void l_tohostpolicy(lua_State* L, int index, host_policy* policy);
+void l_pushhoststate(lua_State* L, host_state* state);
+void l_toupstreampolicy(lua_State* L, int index, upstream_policy* policy);
+void l_pushupstream(lua_State* L, upstream* pool);
+void l_drain_log(lua_State* L);
 void set_request_data(request* request, const char* key, const char* s_value);
 void set_request_integers(request* request, const char* key, lua_Number number);
 int set_request_headers(request* request, const char* key, lua_State* L);
 void l_pushheaders(lua_State* L, char* response_headers_key, char* response_headers);
+void l_pushheaderstable(lua_State* L, char* response_headers);
 void l_pushtablestring(lua_State* L , char* key , char* value);
+void l_pushtablelstring(lua_State* L , char* key , char* value, size_t len);
+void l_pushjson(lua_State* L, request* request);
 void l_pushtablenumber(lua_State* L, char* key, double value);
 int generate_response(lua_State* L, request_handler* handler);
+int generate_columnar_response(lua_State* L, request_handler* handler);
+int generate_stats(lua_State* L, request_handler* handler);
+const char* request_state_name(int state);
 
 /* LOGGER METHODS */
-void print_log(const char* severity, const char* func, const char* message);
-void create_log_by_severity(unsigned char severity, const char* func, const char* message);
-void create_log(unsigned char severity, const char* func, const char* message);
-void log_debug_info(const char* func, const char* format, ...);
-void log_info(const char* func, const char* format, ...);
-void log_error(const char* func, const char* format, ...);
-void log_fatal_error(const char* func, const char* format, ...);
+void create_log(unsigned char severity, const char* func, request* request, const char* format_str, va_list arg);
+int logger_enabled(unsigned char severity);
+void logger_set_level(int new_level);
+int logger_level(void);
+int logger_set_sink(int new_sink, const char* path, int new_format, const void* owner);
+int logger_owns_lua_sink(const void* owner);
+void logger_release_owner(const void* owner);
+int logger_sink(void);
+int logger_pop(log_record* record);
+void logger_flush(void);
+void logger_record_written(void);
+size_t logger_dropped(void);
+size_t logger_written(void);
+size_t logger_pending(void);
+const char* level_name(int severity);
+void log_request(unsigned char severity, const char* func, request* request, const char* format_str, ...);
+void log_debug_info(const char* func, const char* format_str, ...);
+void log_info(const char* func, const char* format_str, ...);
+void log_error(const char* func, const char* format_str, ...);
+void log_fatal_error(const char* func, const char* format_str, ...);
 
 /* ============================================= ENUMS ============================================= */
 
 enum ERR {
   FDSET_ERROR = -1,
   MULTI_TIMEOUT = -2,
-  INVALID_SELECT_VALUE = -3
+  INVALID_SELECT_VALUE = -3,
+  SCHEDULER_ERROR = -4,
+  ALLOCATION_ERROR = -5
+};
+
+enum RESULT_FORMATS {
+  RESULT_ROWS = 0,
+  RESULT_COLUMNAR = 1
+};
+
+enum RESULT_COLUMNS {
+  COLUMN_NAMES = 0,
+  COLUMN_URL = 1,
+  COLUMN_STATUS = 2,
+  COLUMN_BODY = 3,
+  COLUMN_HEADERS = 4,
+  COLUMN_ERROR = 5,
+  COLUMN_STATE = 6,
+  COLUMN_QUEUE_TIME = 7,
+  COLUMN_TOTAL_TIME = 8,
+  COLUMN_CACHE_STATUS = 9,
+  COLUMN_RANGES = 10,
+  COLUMN_JSON = 11,
+  COLUMN_DECODE_ERROR = 12,
+  COLUMN_ENDPOINT = 13
+};
+
+enum FFI_NUMBERS {
+  FFI_TIMEOUT = 0,
+  FFI_CONNECT_TIMEOUT = 1,
+  FFI_EXPECTATIONS = 2,
+  FFI_PRIORITY = 3,
+  FFI_PARALLEL_RANGES = 4,
+  FFI_RANGE_CHUNK_MIN = 5,
+  FFI_VERIFY_PEER = 6,
+  FFI_VERIFY_HOST = 7,
+  FFI_DEBUG = 8,
+  FFI_KEEP_BODY = 9
+};
+
+enum FFI_STRINGS {
+  FFI_NAME = 0,
+  FFI_METHOD = 1,
+  FFI_POST_PARAMS = 2,
+  FFI_DATA = 3,
+  FFI_URL = 4,
+  FFI_CERTIFICATE = 5,
+  FFI_CAFILE = 6,
+  FFI_KEY = 7,
+  FFI_PASSWORD = 8,
+  FFI_OUTPUT_FILE = 9,
+  FFI_DECODE = 10
+};
+
+enum REQUEST_STATES {
+  REQUEST_PENDING = 0,
+  REQUEST_RUNNING = 1,
+  REQUEST_DONE = 2,
+  REQUEST_CANCELLED = 3,
+  REQUEST_DEADLINE_EXCEEDED = 4,
+  REQUEST_CIRCUIT_OPEN = 5
+};
+
+enum DECODES {
+  DECODE_NONE = 0,
+  DECODE_JSON = 1
+};
+
+enum JSON_TYPES {
+  JSON_NULL = 0,
+  JSON_FALSE = 1,
+  JSON_TRUE = 2,
+  JSON_NUMBER = 3,
+  JSON_STRING = 4,
+  JSON_ARRAY = 5,
+  JSON_OBJECT = 6
+};
+
+enum RANGE_PHASES {
+  RANGE_NONE = 0,
+  RANGE_PROBE = 1,
+  RANGE_PARTS = 2,
+  RANGE_SINGLE = 3
+};
+
+enum CACHE_STATUSES {
+  CACHE_NONE = 0,
+  CACHE_MISS = 1,
+  CACHE_HIT = 2,
+  CACHE_STALE = 3,
+  CACHE_REVALIDATED = 4
+};
+
+enum BREAKER_STATES {
+  BREAKER_CLOSED = 0,
+  BREAKER_OPEN = 1,
+  BREAKER_HALF_OPEN = 2
+};
+
+enum HOST_ADMISSION {
+  HOST_ADMITTED = 0,
+  HOST_REJECTED = 1,
+  HOST_THROTTLED = 2
+};
+
+enum HOST_OUTCOMES {
+  HOST_SUCCESS = 0,
+  HOST_FAILURE = 1,
+  HOST_ABORTED = 2
+};
+
+enum WAIT_MODES {
+  WAIT_ALL = 0,
+  WAIT_ANY = 1,
+  WAIT_QUORUM = 2
 };
 
 enum LOG_LEVELS {
@@ -136,3 +798,14 @@ enum LOG_VERBOSE {
   VERBOSE_VVV = 3
 };
 
+enum LOG_SINKS {
+  LOG_SINK_STDERR = 0,
+  LOG_SINK_FILE = 1,
+  LOG_SINK_LUA = 2
+};
+
+enum LOG_FORMATS {
+  LOG_FORMAT_KV = 0,
+  LOG_FORMAT_JSON = 1
+};
+
@@ -0,0 +1,244 @@
+#include "libcurl_async.h"
+
+/**
+ * :default_host_policy
+ * Sets the default host policy: no rate limit and no breaker. Both are
+ * opt-in, a breaker table turns the breaker on (see l_tohostpolicy).
+ */
+void default_host_policy(host_policy* policy)
+{
+  policy->rate               = 0;
+  policy->burst              = 0;
+  policy->failure_threshold  = 0;
+  policy->error_rate         = 0;
+  policy->min_requests       = DEFAULT_BREAKER_MIN_REQUESTS;
+  policy->window_ms          = DEFAULT_BREAKER_WINDOW_MS;
+  policy->open_ms            = DEFAULT_BREAKER_OPEN_MS;
+  policy->half_open_max      = 1;
+}
+
+/**
+ * :reset_host_state
+ * Closes the host breaker and refills its token bucket
+ */
+void reset_host_state(host_state* state)
+{
+  state->breaker              = BREAKER_CLOSED;
+  state->consecutive_failures = 0;
+  state->window_requests      = 0;
+  state->window_failures      = 0;
+  state->window_start         = monotonic_ms();
+  state->opened_at            = 0;
+  state->half_open_in_flight  = 0;
+  state->tokens               = state->policy.burst;
+  state->refilled_at          = state->window_start;
+}
+
+/**
+ * :set_host_policy
+ * Installs a host policy. A new rate or burst starts from a full bucket,
+ * so the burst goes out right away, otherwise the tokens left are kept.
+ */
+void set_host_policy(host_state* state, const host_policy* policy)
+{
+  int refill = policy->rate != state->policy.rate || policy->burst != state->policy.burst;
+
+  state->policy = *policy;
+  if (refill) {
+    state->tokens      = state->policy.burst;
+    state->refilled_at = monotonic_ms();
+  }
+  else if (state->tokens > state->policy.burst) state->tokens = state->policy.burst;
+}
+
+/**
+ * :get_host_state
+ * Returns the persistent state of a host, adding it (with the context
+ * default policy) when missing. Returns NULL on allocation failure.
+ */
+host_state* get_host_state(async_context* context, const char* host)
+{
+  host_state* states, *state;
+  size_t i;
+
+  if (strlen(host) >= DNS_HOST_SZ) return NULL;
+  for (i=0; i<context->host_states_count; i++)
+    if (strcmp(context->host_states[i].host, host) == 0) return &context->host_states[i];
+
+  if (context->host_states_count == context->host_states_capacity) {
+    size_t capacity = (context->host_states_capacity > 0) ? context->host_states_capacity * 2 : 16;
+    states = (host_state*) realloc(context->host_states, sizeof(host_state) * capacity);
+    if (states == NULL) {
+      log_error("get_host_state", "realloc() failed!");
+      return NULL;
+    }
+    context->host_states          = states;
+    context->host_states_capacity = capacity;
+  }
+
+  state = &context->host_states[context->host_states_count++];
+  strcpy(state->host, host);
+  state->policy     = context->host_policy;
+  state->has_policy = 0;
+  state->requests   =
+  state->failures   =
+  state->rejected   = 0;
+  reset_host_state(state);
+  return state;
+}
+
+/**
+ * :request_host_state
+ * Returns the persistent state of the request host, NULL when the url has no host.
+ */
+static host_state* request_host_state(async_context* context, request* request)
+{
+  char host[DNS_HOST_SZ];
+  long port;
+
+  if (!url_host_port(request->url.ptr, host, DNS_HOST_SZ, &port)) return NULL;
+  return get_host_state(context, host);
+}
+
+/**
+ * :open_breaker
+ * Opens the host breaker, requests fail fast until 'open_ms' passes
+ */
+static void open_breaker(host_state* state, double now)
+{
+  if (state->breaker != BREAKER_OPEN)
+    log_info("open_breaker", "circuit breaker opened for host '%s'", state->host);
+  state->breaker             = BREAKER_OPEN;
+  state->opened_at           = now;
+  state->half_open_in_flight = 0;
+}
+
+/**
+ * :refresh_breaker
+ * Moves an open breaker to half open once its open period passed
+ */
+void refresh_breaker(host_state* state, double now)
+{
+  if (state->breaker == BREAKER_OPEN && now - state->opened_at >= state->policy.open_ms) {
+    state->breaker = BREAKER_HALF_OPEN;
+    state->half_open_in_flight = 0;
+  }
+}
+
+/**
+ * :host_admit
+ * Decides if a request may start now:
+ * HOST_REJECTED while the host breaker is open (or its half open probes are taken),
+ * HOST_THROTTLED when the host token bucket is empty ('retry_at' is when a token is due),
+ * HOST_ADMITTED otherwise (a token is consumed).
+ */
+int host_admit(async_context* context, request* request, double* retry_at)
+{
+  host_state* state = request_host_state(context, request);
+  double now = monotonic_ms();
+
+  request->breaker_probe = 0;
+  if (state == NULL) return HOST_ADMITTED;
+
+  refresh_breaker(state, now);
+
+  if (state->breaker == BREAKER_OPEN ||
+      (state->breaker == BREAKER_HALF_OPEN && state->half_open_in_flight >= state->policy.half_open_max)) {
+    state->rejected++;
+    return HOST_REJECTED;
+  }
+
+  /* TOKEN BUCKET */
+  if (state->policy.rate > 0) {
+    state->tokens += (now - state->refilled_at) / MILLISECONDS * state->policy.rate;
+    if (state->tokens > state->policy.burst) state->tokens = state->policy.burst;
+    state->refilled_at = now;
+
+    if (state->tokens < 1) {
+      *retry_at = now + (1 - state->tokens) / state->policy.rate * MILLISECONDS;
+      return HOST_THROTTLED;
+    }
+    state->tokens -= 1;
+  }
+
+  if (state->breaker == BREAKER_HALF_OPEN) {
+    state->half_open_in_flight++;
+    request->breaker_probe = 1;
+  }
+  return HOST_ADMITTED;
+}
+
+/**
+ * :host_report
+ * Feeds a request outcome to its host breaker.
+ * HOST_ABORTED (a cancelled transfer) only releases a half open probe.
+ */
+void host_report(async_context* context, request* request, int outcome)
+{
+  host_state* state = request_host_state(context, request);
+  double now = monotonic_ms();
+
+  if (state == NULL) return;
+  if (request->breaker_probe && state->half_open_in_flight > 0) state->half_open_in_flight--;
+  request->breaker_probe = 0;
+  if (outcome == HOST_ABORTED) return;
+
+  state->requests++;
+  if (outcome == HOST_FAILURE) state->failures++;
+
+  if (state->breaker == BREAKER_HALF_OPEN) {
+    if (outcome == HOST_SUCCESS) {
+      log_info("host_report", "circuit breaker closed for host '%s'", state->host);
+      reset_host_state(state);
+    }
+    else open_breaker(state, now);
+    return;
+  }
+  if (state->breaker == BREAKER_OPEN) return;
+
+  /* FIXED ERROR RATE WINDOW */
+  if (now - state->window_start >= state->policy.window_ms) {
+    state->window_start    = now;
+    state->window_requests = 0;
+    state->window_failures = 0;
+  }
+  state->window_requests++;
+
+  if (outcome == HOST_SUCCESS) {
+    state->consecutive_failures = 0;
+    return;
+  }
+  state->window_failures++;
+  state->consecutive_failures++;
+
+  if ((state->policy.failure_threshold > 0 && state->consecutive_failures >= state->policy.failure_threshold) ||
+      (state->policy.error_rate > 0 && state->window_requests >= state->policy.min_requests &&
+       (double)state->window_failures / state->window_requests >= state->policy.error_rate))
+    open_breaker(state, now);
+}
+
+/**
+ * :is_host_failure
+ * A transfer error or a server error (5xx) counts as a host failure,
+ * a local write error (the output file) doesn't
+ */
+int is_host_failure(request* request)
+{
+  if (request->result == CURLE_WRITE_ERROR) return 0;
+  return request->result != CURLE_OK || request->response_status >= 500;
+}
+
+/**
+ * :breaker_state_name
+ * Simply returns the lua name of a breaker state
+ */
+const char* breaker_state_name(int breaker)
+{
+  switch (breaker)
+  {
+    case BREAKER_CLOSED:    return "closed";
+    case BREAKER_OPEN:      return "open";
+    case BREAKER_HALF_OPEN: return "half_open";
+  }
+  return "unknown";
+}
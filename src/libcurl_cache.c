@@ -0,0 +1,503 @@
+#include "libcurl_async.h"
+
+#include <strings.h>
+
+/**
+ * :init_cache
+ * Initiating an empty cache, the buckets are allocated on the first store
+ */
+void init_cache(http_cache* cache)
+{
+  cache->buckets       = NULL;
+  cache->head          =
+  cache->tail          = NULL;
+  cache->max_bytes     = DEFAULT_CACHE_MAX_BYTES;
+  cache->bytes         =
+  cache->count         =
+  cache->hits          =
+  cache->misses        =
+  cache->revalidations =
+  cache->revalidated   =
+  cache->stores        =
+  cache->evictions     = 0;
+}
+
+/**
+ * :is_cacheable_request
+ * Only GET requests without a body and without their own
+ * conditional / no-store headers go through the cache
+ */
+static int is_cacheable_request(request* request)
+{
+  char value[CACHE_VALIDATOR_SZ];
+
+  if (!is_empty(request->request_method.ptr) && !method_get(request->request_method.ptr)) return 0;
+  if (!is_empty(request->post_params.ptr) || !is_empty(request->request_body.ptr)) return 0;
+  if (is_ranged(request) || !is_empty(request->output_file.ptr)) return 0;
+  if (request_header_value(request, "If-None-Match", value, sizeof(value)) ||
+      request_header_value(request, "If-Modified-Since", value, sizeof(value))) return 0;
+  if (request_header_value(request, "Cache-Control", value, sizeof(value)) &&
+      (strstr(value, "no-store") != NULL || strstr(value, "no-cache") != NULL)) return 0;
+  return 1;
+}
+
+/**
+ * :vary_values
+ * Collects the request values of the given Vary header names ("name=value\n" each)
+ */
+static char* vary_values(request* request, const char* vary)
+{
+  char name[CACHE_VARY_SZ], value[TBL_VAL_SZ];
+  string values;
+  size_t len;
+
+  init_string(&values);
+  while (*vary != '\0') {
+    while (*vary == ',' || *vary == ' ') vary++;
+    len = strcspn(vary, ", ");
+    if (len == 0) break;
+    memcpy(name, vary, len);
+    name[len] = '\0';
+    vary += len;
+
+    if (!request_header_value(request, name, value, sizeof(value))) value[0] = '\0';
+    memcpy_string(name, &values);
+    memcpy_string("=", &values);
+    memcpy_string(value, &values);
+    memcpy_string("\n", &values);
+  }
+  return values.ptr;
+}
+
+/**
+ * :cache_key
+ * The cache key is the method, the url and the tls identity (client
+ * certificate, key, ca and verification), as the coalescing key
+ */
+static char* cache_key(request* request, unsigned long long* hash)
+{
+  string key;
+  char verify[8];
+
+  init_string(&key);
+  memcpy_string("GET ", &key);
+  memcpy_string(request->url.ptr, &key);
+  memcpy_string("\n", &key);
+  memcpy_string(request->certificate_path.ptr, &key);
+  memcpy_string("\n", &key);
+  memcpy_string(request->key_path.ptr, &key);
+  memcpy_string("\n", &key);
+  memcpy_string(request->ca_path.ptr, &key);
+  snprintf(verify, sizeof(verify), "\n%d%d", request->verify_peer, request->verify_host);
+  memcpy_string(verify, &key);
+  *hash = fnv1a(FNV_OFFSET_BASIS, key.ptr, key.len, 0);
+  return key.ptr;
+}
+
+/**
+ * :unlink_entry
+ * Removes an entry from the LRU list and from its hash bucket
+ */
+static void unlink_entry(http_cache* cache, cache_entry* entry)
+{
+  cache_entry** link = &cache->buckets[entry->hash % CACHE_BUCKETS];
+
+  while (*link != entry) link = &(*link)->chain;
+  *link = entry->chain;
+
+  if (entry->prev != NULL) entry->prev->next = entry->next;
+  else cache->head = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+
+  cache->bytes -= entry->size;
+  cache->count--;
+}
+
+/**
+ * :free_entry
+ * Simply freeing a cache entry
+ */
+static void free_entry(cache_entry* entry)
+{
+  free(entry->key);
+  free(entry->vary_values);
+  free(entry->body.ptr);
+  free(entry->headers.ptr);
+  free(entry);
+}
+
+/**
+ * :touch_entry
+ * Moves an entry to the LRU list head (most recently used)
+ */
+static void touch_entry(http_cache* cache, cache_entry* entry)
+{
+  if (cache->head == entry) return;
+
+  entry->prev->next = entry->next;
+  if (entry->next != NULL) entry->next->prev = entry->prev;
+  else cache->tail = entry->prev;
+
+  entry->prev = NULL;
+  entry->next = cache->head;
+  cache->head->prev = entry;
+  cache->head = entry;
+}
+
+/**
+ * :evict_entries
+ * Evicts the least recently used entries until the cache fits its bound.
+ * Entries pinned by an in-flight revalidation are kept.
+ */
+static void evict_entries(http_cache* cache)
+{
+  cache_entry* entry = cache->tail, *prev;
+
+  while (cache->bytes > cache->max_bytes && entry != NULL) {
+    prev = entry->prev;
+    if (entry->pins == 0) {
+      unlink_entry(cache, entry);
+      free_entry(entry);
+      cache->evictions++;
+    }
+    entry = prev;
+  }
+}
+
+/**
+ * :cache_resize
+ * Sets the cache bound, a smaller bound evicts the least recently used entries down to it
+ */
+void cache_resize(http_cache* cache, size_t max_bytes)
+{
+  cache->max_bytes = max_bytes;
+  evict_entries(cache);
+}
+
+/**
+ * :find_entry
+ * Finds the entry of a request: same key, and same values for the stored Vary headers
+ */
+static cache_entry* find_entry(http_cache* cache, request* request, const char* key, unsigned long long hash)
+{
+  cache_entry* entry;
+  char* values;
+  int same;
+
+  if (cache->buckets == NULL) return NULL;
+  for (entry = cache->buckets[hash % CACHE_BUCKETS]; entry != NULL; entry = entry->chain) {
+    if (entry->hash != hash || strcmp(entry->key, key) != 0) continue;
+
+    values = vary_values(request, entry->vary);
+    same = (strcmp(values, entry->vary_values) == 0);
+    free(values);
+    if (same) return entry;
+  }
+  return NULL;
+}
+
+/**
+ * :copy_entry_response
+ * Copies a cached response into the request response buffers
+ */
+static void copy_entry_response(request* request, cache_entry* entry)
+{
+  request->response_body.len = request->response_headers.len = 0;
+  writefunc(entry->body.ptr, entry->body.len, 1, &request->response_body);
+  writefunc(entry->headers.ptr, entry->headers.len, 1, &request->response_headers);
+  request->response_status = entry->status;
+}
+
+/**
+ * :cache_lookup
+ * Serves the batch GET requests with a fresh cache entry right away (never queued).
+ * Requests with a stale entry pin it and are sent as conditional requests.
+ * Coalesced followers are left to their leader, served along with it.
+ */
+void cache_lookup(request_handler* handler)
+{
+  http_cache* cache = &handler->context->cache;
+  cache_entry* entry;
+  request* request;
+  unsigned long long hash;
+  char* key;
+  size_t i;
+
+  for (i=0; i<handler->count; i++) {
+    request = &handler->requests[i];
+    if (request->state != REQUEST_PENDING || request->leader != SCHEDULER_NONE || !is_cacheable_request(request)) continue;
+
+    key = cache_key(request, &hash);
+    entry = find_entry(cache, request, key, hash);
+    free(key);
+
+    if (entry != NULL && monotonic_ms() < entry->expires_at) {
+      copy_entry_response(request, entry);
+      touch_entry(cache, entry);
+      request->state        = REQUEST_DONE;
+      request->result       = CURLE_OK;
+      request->cache_status = CACHE_HIT;
+      cache->hits++;
+      handler->stats.cache_hits++;
+      handler->stats.completed++;
+      if (is_success(handler, request)) handler->stats.succeeded++;
+      settle_followers(handler, request);
+    }
+    else if (entry != NULL && (!is_empty(entry->etag) || !is_empty(entry->last_modified))) {
+      entry->pins++;
+      request->cached       = entry;
+      request->cache_status = CACHE_STALE;
+      cache->revalidations++;
+    }
+    else {
+      request->cache_status = CACHE_MISS;
+      cache->misses++;
+      handler->stats.cache_misses++;
+    }
+  }
+}
+
+/**
+ * :define_cache_headers
+ * Adds the revalidation headers of a stale cache entry to the request headers
+ */
+struct curl_slist* define_cache_headers(struct curl_slist* headers, request* request)
+{
+  char line[CACHE_VALIDATOR_SZ + 32];
+
+  if (request->cached == NULL) return headers;
+  if (!is_empty(request->cached->etag)) {
+    snprintf(line, sizeof(line), "If-None-Match: %s", request->cached->etag);
+    headers = curl_slist_append(headers, line);
+  }
+  if (!is_empty(request->cached->last_modified)) {
+    snprintf(line, sizeof(line), "If-Modified-Since: %s", request->cached->last_modified);
+    headers = curl_slist_append(headers, line);
+  }
+  return headers;
+}
+
+/**
+ * :copy_header_value
+ * Copies a response header value without its trailing CRLF
+ */
+static void copy_header_value(char* dest, size_t dest_sz, const char* value, size_t len)
+{
+  while (len > 0 && (*value == ' ' || *value == '\t')) { value++; len--; }
+  while (len > 0 && isspace((unsigned char)value[len-1])) len--;
+  if (len >= dest_sz) len = dest_sz - 1;
+  memcpy(dest, value, len);
+  dest[len] = '\0';
+}
+
+/**
+ * :parse_cache_control
+ * Reads the Cache-Control directives the cache respects
+ */
+static void parse_cache_control(cache_headers* meta, const char* value, size_t len)
+{
+  char directives[TBL_VAL_SZ];
+  const char* max_age;
+  size_t i;
+
+  copy_header_value(directives, sizeof(directives), value, len);
+  for (i=0; directives[i] != '\0'; i++) directives[i] = tolower(directives[i]);
+
+  if (strstr(directives, "no-store") != NULL || strstr(directives, "private") != NULL) meta->no_store = 1;
+  if (strstr(directives, "no-cache") != NULL) meta->no_cache = 1;
+  if (strstr(directives, "public") != NULL) meta->is_public = 1;
+  if ((max_age = strstr(directives, "max-age=")) != NULL && (max_age == directives || max_age[-1] != '-'))
+    meta->max_age = strtol(max_age + 8, NULL, 10);
+}
+
+/**
+ * :header_callback
+ * Stores the response headers (as writefunc does), and captures the caching
+ * headers (ETag, Last-Modified, Cache-Control, Vary) and Accept-Ranges of the final response.
+ */
+size_t header_callback(void* ptr, size_t size, size_t nmemb, request* request)
+{
+  const char* line = (const char*)ptr;
+  size_t len = size*nmemb, i;
+  cache_headers* meta = &request->cache_meta;
+  char ranges[16];
+
+  writefunc(ptr, size, nmemb, &request->response_headers);
+
+  /* A NEW STATUS LINE (REDIRECTION, 100 CONTINUE), ONLY THE LAST RESPONSE COUNTS */
+  if (len > 5 && strncmp(line, "HTTP/", 5) == 0) {
+    meta->etag[0] = meta->last_modified[0] = meta->vary[0] = '\0';
+    meta->max_age = -1;
+    meta->no_store = meta->no_cache = meta->is_public = meta->accept_ranges = 0;
+  }
+  else if (len > 5 && strncasecmp(line, "ETag:", 5) == 0)
+    copy_header_value(meta->etag, CACHE_VALIDATOR_SZ, line + 5, len - 5);
+  else if (len > 14 && strncasecmp(line, "Last-Modified:", 14) == 0)
+    copy_header_value(meta->last_modified, CACHE_VALIDATOR_SZ, line + 14, len - 14);
+  else if (len > 14 && strncasecmp(line, "Cache-Control:", 14) == 0)
+    parse_cache_control(meta, line + 14, len - 14);
+  else if (len > 14 && strncasecmp(line, "Accept-Ranges:", 14) == 0) {
+    copy_header_value(ranges, sizeof(ranges), line + 14, len - 14);
+    meta->accept_ranges = (strcasecmp(ranges, "bytes") == 0);
+  }
+  else if (len > 5 && strncasecmp(line, "Vary:", 5) == 0) {
+    copy_header_value(meta->vary, CACHE_VARY_SZ, line + 5, len - 5);
+    for (i=0; meta->vary[i] != '\0'; i++) meta->vary[i] = tolower(meta->vary[i]);
+  }
+  return len;
+}
+
+/**
+ * :store_response
+ * Stores a completed 200 response, replacing the entry of the same key and Vary values.
+ * The response of a request with Authorization is only stored when public (RFC 9111 3.5).
+ */
+static void store_response(http_cache* cache, request* request)
+{
+  cache_headers* meta = &request->cache_meta;
+  cache_entry* entry, *existing;
+  unsigned long long hash;
+  char* key, value[CACHE_VALIDATOR_SZ];
+  size_t i;
+
+  if (meta->no_store || strchr(meta->vary, '*') != NULL) return;
+  if (!meta->is_public && request_header_value(request, "Authorization", value, sizeof(value))) return;
+  if (meta->max_age < 0 && is_empty(meta->etag) && is_empty(meta->last_modified)) return;
+
+  if (cache->buckets == NULL) {
+    cache->buckets = (cache_entry**) malloc(sizeof(cache_entry*) * CACHE_BUCKETS);
+    if (cache->buckets == NULL) return;
+    for (i=0; i<CACHE_BUCKETS; i++) cache->buckets[i] = NULL;
+  }
+
+  key = cache_key(request, &hash);
+  if ((existing = find_entry(cache, request, key, hash)) != NULL) {
+    if (existing->pins > 0) {
+      free(key);
+      return;
+    }
+    unlink_entry(cache, existing);
+    free_entry(existing);
+  }
+
+  entry = (cache_entry*) malloc(sizeof(cache_entry));
+  if (entry == NULL) {
+    free(key);
+    return;
+  }
+  entry->key         = key;
+  entry->hash        = hash;
+  strcpy(entry->vary, meta->vary);
+  entry->vary_values = vary_values(request, meta->vary);
+  entry->status      = request->response_status;
+  init_string(&entry->body);
+  init_string(&entry->headers);
+  writefunc(request->response_body.ptr, request->response_body.len, 1, &entry->body);
+  writefunc(request->response_headers.ptr, request->response_headers.len, 1, &entry->headers);
+  strcpy(entry->etag, meta->etag);
+  strcpy(entry->last_modified, meta->last_modified);
+  entry->expires_at  = monotonic_ms() + ((meta->no_cache || meta->max_age < 0) ? 0 : (double)meta->max_age * MILLISECONDS);
+  entry->size        = sizeof(cache_entry) + strlen(key) + strlen(entry->vary_values) + entry->body.len + entry->headers.len;
+  entry->pins        = 0;
+
+  if (entry->size > cache->max_bytes) {
+    free_entry(entry);
+    return;
+  }
+
+  entry->chain = cache->buckets[hash % CACHE_BUCKETS];
+  cache->buckets[hash % CACHE_BUCKETS] = entry;
+  entry->prev = NULL;
+  entry->next = cache->head;
+  if (cache->head != NULL) cache->head->prev = entry;
+  else cache->tail = entry;
+  cache->head = entry;
+
+  cache->bytes += entry->size;
+  cache->count++;
+  cache->stores++;
+  evict_entries(cache);
+}
+
+/**
+ * :cache_response
+ * Handles a completed request: a 304 answer to a revalidation is served
+ * from the cache (and refreshes the entry), a cacheable 200 is stored.
+ */
+void cache_response(request_handler* handler, request* request)
+{
+  http_cache* cache = &handler->context->cache;
+  cache_entry* entry = request->cached;
+  cache_headers* meta = &request->cache_meta;
+
+  if (request->state != REQUEST_DONE || request->result != CURLE_OK) {
+    cache_release(request);
+    return;
+  }
+
+  if (entry != NULL && request->response_status == 304) {
+    copy_entry_response(request, entry);
+    if (!is_empty(meta->etag)) strcpy(entry->etag, meta->etag);
+    if (!is_empty(meta->last_modified)) strcpy(entry->last_modified, meta->last_modified);
+    if (meta->max_age >= 0 && !meta->no_cache) entry->expires_at = monotonic_ms() + (double)meta->max_age * MILLISECONDS;
+    touch_entry(cache, entry);
+    request->cache_status = CACHE_REVALIDATED;
+    cache->revalidated++;
+    handler->stats.cache_revalidated++;
+    cache_release(request);
+    return;
+  }
+
+  cache_release(request);
+  if (request->response_status == 200 && (request->cache_status == CACHE_MISS || request->cache_status == CACHE_STALE))
+    store_response(cache, request);
+}
+
+/**
+ * :cache_release
+ * Unpins the stale entry a request was revalidating
+ */
+void cache_release(request* request)
+{
+  if (request->cached == NULL) return;
+  request->cached->pins--;
+  request->cached = NULL;
+}
+
+/**
+ * :clear_cache
+ * Drops every cache entry, the counters are kept
+ */
+void clear_cache(http_cache* cache)
+{
+  cache_entry* entry = cache->head, *next;
+
+  while (entry != NULL) {
+    next = entry->next;
+    free_entry(entry);
+    entry = next;
+  }
+  free(cache->buckets);
+  cache->buckets = NULL;
+  cache->head    =
+  cache->tail    = NULL;
+  cache->bytes   =
+  cache->count   = 0;
+}
+
+/**
+ * :cache_status_name
+ * Simply returns the lua name of a request cache outcome
+ */
+const char* cache_status_name(int status)
+{
+  switch (status)
+  {
+    case CACHE_MISS:        return "miss";
+    case CACHE_HIT:         return "hit";
+    case CACHE_STALE:       return "stale";
+    case CACHE_REVALIDATED: return "revalidated";
+  }
+  return "";
+}
@@ -0,0 +1,183 @@
+#include "libcurl_async.h"
+
+#include <strings.h>
+
+/**
+ * :header_selected
+ * Checks if a request header line ("Name: value") is part of the fingerprint:
+ * every header when the batch didn't select any, only the selected names otherwise.
+ */
+static int header_selected(request_handler* handler, const char* line)
+{
+  struct curl_slist* name;
+  size_t len = strcspn(line, ":");
+
+  if (handler->options.coalesce_headers == NULL) return 1;
+  for (name = handler->options.coalesce_headers; name != NULL; name = name->next)
+    if (strlen(name->data) == len && strncasecmp(name->data, line, len) == 0) return 1;
+  return 0;
+}
+
+/**
+ * :is_coalescable
+ * Only idempotent requests without a body are coalesced (GET, HEAD),
+ * requests already served by the cache (or downloaded to a file, or by ranges) are left alone.
+ */
+static int is_coalescable(request* request)
+{
+  const char* method = request->request_method.ptr;
+  if (request->state != REQUEST_PENDING) return 0;
+  if (is_ranged(request) || !is_empty(request->output_file.ptr)) return 0;
+  if (!is_empty(method) && !method_get(method) && !method_head(method)) return 0;
+  return is_empty(request->post_params.ptr) && is_empty(request->request_body.ptr);
+}
+
+/**
+ * :request_fingerprint
+ * Hashes the request method, url, ssl identity and the selected headers
+ */
+static unsigned long long request_fingerprint(request_handler* handler, request* request)
+{
+  unsigned long long hash = FNV_OFFSET_BASIS;
+  const char* method = is_empty(request->request_method.ptr) ? "GET" : request->request_method.ptr;
+  size_t i;
+
+  hash = fnv1a(hash, method, strlen(method) + 1, 1);
+  hash = fnv1a(hash, request->url.ptr, request->url.len + 1, 0);
+  hash = fnv1a(hash, request->certificate_path.ptr, request->certificate_path.len + 1, 0);
+  hash = fnv1a(hash, request->key_path.ptr, request->key_path.len + 1, 0);
+  hash = fnv1a(hash, request->ca_path.ptr, request->ca_path.len + 1, 0);
+  hash ^= (unsigned long long)(request->verify_peer << 1 | request->verify_host);
+  hash *= FNV_PRIME;
+
+  for (i=0; i<request->header_fields.count; i++)
+    if (header_selected(handler, request->header_fields.headers[i].ptr))
+      hash = fnv1a(hash, request->header_fields.headers[i].ptr, request->header_fields.headers[i].len + 1, 0);
+  return hash;
+}
+
+/**
+ * :next_selected_header
+ * Returns the index of the next selected header line from 'i' (the count when there's none left)
+ */
+static size_t next_selected_header(request_handler* handler, request* request, size_t i)
+{
+  while (i < request->header_fields.count && !header_selected(handler, request->header_fields.headers[i].ptr)) i++;
+  return i;
+}
+
+/**
+ * :same_request
+ * Guards the fingerprint against hash collisions on the request identity,
+ * the selected header lines included (same lines, in the same order)
+ */
+static int same_request(request_handler* handler, request* a, request* b)
+{
+  size_t i, j;
+
+  if (method_head(a->request_method.ptr) != method_head(b->request_method.ptr) ||
+      strcmp(a->url.ptr, b->url.ptr) != 0 ||
+      strcmp(a->certificate_path.ptr, b->certificate_path.ptr) != 0 ||
+      strcmp(a->key_path.ptr, b->key_path.ptr) != 0 ||
+      strcmp(a->ca_path.ptr, b->ca_path.ptr) != 0 ||
+      a->verify_peer != b->verify_peer || a->verify_host != b->verify_host) return 0;
+
+  for (i = next_selected_header(handler, a, 0), j = next_selected_header(handler, b, 0);
+       i < a->header_fields.count && j < b->header_fields.count;
+       i = next_selected_header(handler, a, i + 1), j = next_selected_header(handler, b, j + 1))
+    if (strcmp(a->header_fields.headers[i].ptr, b->header_fields.headers[j].ptr) != 0) return 0;
+  return i == a->header_fields.count && j == b->header_fields.count;
+}
+
+/**
+ * :coalesce_requests
+ * Finds the identical idempotent requests of the batch. The first one (the leader)
+ * runs the transfer, the others (its followers) are never queued and get the
+ * leader response once it completes. Returns 0 on allocation failure.
+ */
+int coalesce_requests(request_handler* handler)
+{
+  size_t slots = 16, i, slot, leader, *table;
+  unsigned long long* fingerprints;
+  request* current;
+
+  while (slots < handler->count * 2) slots *= 2;
+  table = (size_t*) malloc(sizeof(size_t) * slots);
+  fingerprints = (unsigned long long*) malloc(sizeof(unsigned long long) * (handler->count + 1));
+  if (table == NULL || fingerprints == NULL) {
+    free(table);
+    free(fingerprints);
+    return 0;
+  }
+  for (i=0; i<slots; i++) table[i] = SCHEDULER_NONE;
+
+  for (i=0; i<handler->count; i++) {
+    current = &handler->requests[i];
+    if (!is_coalescable(current)) continue;
+
+    /* OPEN ADDRESSING (LINEAR PROBING) ON THE FINGERPRINT */
+    fingerprints[i] = request_fingerprint(handler, current);
+    for (slot = fingerprints[i] & (slots - 1); table[slot] != SCHEDULER_NONE; slot = (slot + 1) & (slots - 1)) {
+      leader = table[slot];
+      if (fingerprints[leader] == fingerprints[i] && same_request(handler, &handler->requests[leader], current)) break;
+    }
+
+    if (table[slot] == SCHEDULER_NONE) {
+      table[slot] = i;
+      continue;
+    }
+
+    /* FOLLOWERS ARE KEPT IN BATCH ORDER */
+    leader = table[slot];
+    current->leader = leader;
+    while (handler->requests[leader].next_follower != SCHEDULER_NONE) leader = handler->requests[leader].next_follower;
+    handler->requests[leader].next_follower = i;
+    handler->stats.coalesced++;
+  }
+
+  free(table);
+  free(fingerprints);
+  return 1;
+}
+
+/**
+ * :settle_followers
+ * Hands the leader outcome to each of its followers. The followers share
+ * the leader response buffers instead of copying them, and its final cache
+ * status: served from the cache along with the leader, never sent themselves.
+ */
+void settle_followers(request_handler* handler, request* leader)
+{
+  request* follower;
+  size_t i;
+
+  for (i = leader->next_follower; i != SCHEDULER_NONE; i = follower->next_follower) {
+    follower = &handler->requests[i];
+    if (follower->state != REQUEST_PENDING) continue;
+
+    free(follower->response_body.ptr);
+    free(follower->response_headers.ptr);
+    follower->response_body    = leader->response_body;
+    follower->response_headers = leader->response_headers;
+    follower->shared_response  = 1;
+
+    follower->state           = leader->state;
+    follower->result          = leader->result;
+    follower->response_status = leader->response_status;
+    follower->queue_time      = leader->queue_time;
+    follower->total_time      = leader->total_time;
+    follower->cache_status    = leader->cache_status;
+    memcpy(follower->response_err, leader->response_err, CURL_ERROR_SIZE);
+    memcpy(follower->endpoint_url, leader->endpoint_url, UPSTREAM_URL_SZ);
+
+    if (follower->state == REQUEST_CIRCUIT_OPEN) {
+      handler->stats.circuit_open++;
+      continue;
+    }
+    if (follower->state == REQUEST_DEADLINE_EXCEEDED) handler->stats.deadline_exceeded++;
+    if (follower->cache_status == CACHE_HIT) handler->stats.cache_hits++;
+    else if (follower->cache_status == CACHE_REVALIDATED) handler->stats.cache_revalidated++;
+    handler->stats.completed++;
+    if (is_success(handler, follower)) handler->stats.succeeded++;
+  }
+}
@@ -0,0 +1,143 @@
+#include "libcurl_async.h"
+
+/**
+ * :share_lock
+ * The share handle lock callback, the shards of a batch resolve
+ * and resume tls sessions from different threads.
+ */
+static void share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* ctx)
+{
+  pthread_mutex_lock(&((async_context*)ctx)->share_locks[data]);
+}
+
+/**
+ * :share_unlock
+ * The share handle unlock callback
+ */
+static void share_unlock(CURL* handle, curl_lock_data data, void* ctx)
+{
+  pthread_mutex_unlock(&((async_context*)ctx)->share_locks[data]);
+}
+
+/**
+ * :init_context
+ * Initiating the context defaults, the libcurl multi and share handles.
+ * The multi handle keeps connections alive between batches,
+ * the share handle keeps the dns cache and tls sessions.
+ */
+int init_context(async_context* ctx)
+{
+  size_t i;
+
+  ctx->max_connects       = DEFAULT_MAX_CONNECTS;
+  ctx->resolve            = NULL;
+  ctx->dns_cache_timeout  = DEFAULT_DNS_CACHE_TIMEOUT;
+  ctx->dns_entries        = NULL;
+  ctx->dns_count          =
+  ctx->dns_capacity       = 0;
+  ctx->host_states        = NULL;
+  ctx->host_states_count  =
+  ctx->host_states_capacity = 0;
+  ctx->upstreams          = NULL;
+  ctx->upstreams_count    = 0;
+  default_host_policy(&ctx->host_policy);
+  init_cache(&ctx->cache);
+  for (i=0; i<MAX_BATCH_THREADS - 1; i++) ctx->shard_multis[i] = NULL;
+  for (i=0; i<CURL_LOCK_DATA_LAST; i++) pthread_mutex_init(&ctx->share_locks[i], NULL);
+
+  ctx->multi = curl_multi_init();
+  ctx->share = curl_share_init();
+  if (ctx->multi == NULL || ctx->share == NULL) {
+    free_context(ctx);
+    return 0;
+  }
+  curl_share_setopt(ctx->share, CURLSHOPT_LOCKFUNC, share_lock);
+  curl_share_setopt(ctx->share, CURLSHOPT_UNLOCKFUNC, share_unlock);
+  curl_share_setopt(ctx->share, CURLSHOPT_USERDATA, ctx);
+  curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+
+  /* TLS SESSIONS ARE RESUMED BY LATER HANDSHAKES TO THE SAME ORIGIN */
+  curl_share_setopt(ctx->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+  return 1;
+}
+
+/**
+ * :context_multi
+ * Returns the multi handle of a batch shard. Shard 0 is the context multi handle,
+ * the others are created on first use and kept (with their connections) between batches.
+ */
+CURLM* context_multi(async_context* ctx, size_t shard)
+{
+  if (shard == 0) return ctx->multi;
+  if (shard >= MAX_BATCH_THREADS) return NULL;
+  if (ctx->shard_multis[shard - 1] == NULL) ctx->shard_multis[shard - 1] = curl_multi_init();
+  return ctx->shard_multis[shard - 1];
+}
+
+/**
+ * :context_gc
+ * The context userdata __gc, frees the context once its lua state closes
+ */
+static int context_gc(lua_State* L)
+{
+  free_context((async_context*) luaL_checkudata(L, 1, CONTEXT_MT));
+  return 0;
+}
+
+/**
+ * :get_context
+ * Returns the context of the given lua state, creates it on first use.
+ * Each lua state owns its context (a userdata kept in its registry), so
+ * lua states running on different threads never share libcurl handles.
+ */
+async_context* get_context(lua_State* L)
+{
+  async_context* ctx;
+
+  lua_getfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+  ctx = (async_context*) lua_touserdata(L, -1);
+  lua_pop(L, 1);
+  if (ctx != NULL) return ctx;
+
+  ctx = (async_context*) lua_newuserdata(L, sizeof(async_context));
+  if (!init_context(ctx)) {
+    lua_pop(L, 1);
+    return NULL;
+  }
+  if (luaL_newmetatable(L, CONTEXT_MT)) {
+    lua_pushcfunction(L, context_gc);
+    lua_setfield(L, -2, "__gc");
+  }
+  lua_setmetatable(L, -2);
+  lua_setfield(L, LUA_REGISTRYINDEX, CONTEXT_KEY);
+  return ctx;
+}
+
+/**
+ * :free_context
+ * Simply freeing the context content (the context memory belongs to lua)
+ */
+void free_context(async_context* ctx)
+{
+  size_t i;
+
+  if (ctx == NULL) return;
+  logger_release_owner(ctx);
+  if (ctx->multi != NULL) curl_multi_cleanup(ctx->multi);
+  for (i=0; i<MAX_BATCH_THREADS - 1; i++) {
+    if (ctx->shard_multis[i] != NULL) curl_multi_cleanup(ctx->shard_multis[i]);
+    ctx->shard_multis[i] = NULL;
+  }
+  if (ctx->share != NULL) curl_share_cleanup(ctx->share);
+  for (i=0; i<CURL_LOCK_DATA_LAST; i++) pthread_mutex_destroy(&ctx->share_locks[i]);
+  curl_slist_free_all(ctx->resolve);
+  free(ctx->dns_entries);
+  free(ctx->host_states);
+  free_upstreams(ctx);
+  clear_cache(&ctx->cache);
+  ctx->multi       = NULL;
+  ctx->share       = NULL;
+  ctx->resolve     = NULL;
+  ctx->dns_entries = NULL;
+  ctx->host_states = NULL;
+}
@@ -0,0 +1,270 @@
+#include "libcurl_async.h"
+
+#include <netdb.h>
+#include <pthread.h>
+#include <strings.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+typedef struct {
+  dns_lookup*     lookups;                /* lookups to run                                             */
+  size_t          count;                  /* lookups count                                              */
+  size_t          next;                   /* next lookup to pick                                        */
+  pthread_mutex_t lock;                   /* guards 'next'                                              */
+} resolve_job;
+
+/**
+ * :lookup_host
+ * Resolves a single host (blocking) and joins all of its
+ * addresses in the CURLOPT_RESOLVE format ("a1,a2,[a3]").
+ * Keeping every address allows libcurl to fail over to the
+ * next one when a connect attempt fails.
+ */
+static void lookup_host(dns_lookup* lookup)
+{
+  struct addrinfo hints, *result = NULL, *ai;
+  char address[INET6_ADDRSTRLEN];
+  size_t used = 0, address_len;
+  int rc;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family   = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  lookup->addresses[0] = '\0';
+  lookup->error[0]     = '\0';
+
+  if ((rc = getaddrinfo(lookup->host, NULL, &hints, &result)) != 0) {
+    snprintf(lookup->error, CURL_ERROR_SIZE, "Couldn't resolve host '%.200s': %s", lookup->host, gai_strerror(rc));
+    return;
+  }
+
+  for (ai = result; ai != NULL; ai = ai->ai_next) {
+    if (getnameinfo(ai->ai_addr, ai->ai_addrlen, address, sizeof(address), NULL, 0, NI_NUMERICHOST)) continue;
+
+    /* IPV6 ADDRESSES ARE BRACKETED + ONE COMMA SEPARATOR */
+    address_len = strlen(address) + ((ai->ai_family == AF_INET6) ? 2 : 0) + 1;
+    if (used + address_len >= DNS_ADDRESSES_SZ) break;
+    used += snprintf(lookup->addresses + used, DNS_ADDRESSES_SZ - used,
+                     (ai->ai_family == AF_INET6) ? "%s[%s]" : "%s%s",
+                     (used > 0) ? "," : "", address);
+  }
+  freeaddrinfo(result);
+
+  if (used == 0)
+    snprintf(lookup->error, CURL_ERROR_SIZE, "Couldn't resolve host '%.200s'", lookup->host);
+}
+
+/**
+ * :resolve_worker
+ * Picks lookups from the shared job until there are none left.
+ */
+static void* resolve_worker(void* arg)
+{
+  resolve_job* job = (resolve_job*) arg;
+  size_t i;
+
+  for (;;) {
+    pthread_mutex_lock(&job->lock);
+    i = job->next++;
+    pthread_mutex_unlock(&job->lock);
+    if (i >= job->count) break;
+    lookup_host(&job->lookups[i]);
+  }
+  return NULL;
+}
+
+/**
+ * :dns_resolve
+ * Resolves the given lookups in parallel (up to DEFAULT_RESOLVE_THREADS at once).
+ * The caller is in charge of coalescing, each lookup is resolved exactly once.
+ */
+int dns_resolve(dns_lookup* lookups, size_t count)
+{
+  pthread_t threads[DEFAULT_RESOLVE_THREADS];
+  size_t total_threads = (count > DEFAULT_RESOLVE_THREADS) ? DEFAULT_RESOLVE_THREADS : count, i, started = 0;
+  resolve_job job;
+
+  if (count == 0) return 1;
+  job.lookups = lookups;
+  job.count   = count;
+  job.next    = 0;
+  pthread_mutex_init(&job.lock, NULL);
+
+  for (i=0; i<total_threads; i++)
+    if (pthread_create(&threads[started], NULL, resolve_worker, &job) == 0) started++;
+
+  /* CASE NO THREAD COULD START, RESOLVE ON THE CALLER THREAD */
+  if (started == 0) resolve_worker(&job);
+  for (i=0; i<started; i++) pthread_join(threads[i], NULL);
+
+  pthread_mutex_destroy(&job.lock);
+  return 1;
+}
+
+/**
+ * :dns_cache_get
+ * Returns the warmed dns entry of host:port, NULL when missing or expired.
+ */
+const dns_entry* dns_cache_get(async_context* context, const char* host, long port)
+{
+  size_t i;
+  double now = monotonic_ms();
+
+  for (i=0; i<context->dns_count; i++) {
+    if (context->dns_entries[i].port != port || strcmp(context->dns_entries[i].host, host) != 0) continue;
+    if (context->dns_entries[i].expires_at <= now) return NULL;
+    return &context->dns_entries[i];
+  }
+  return NULL;
+}
+
+/**
+ * :dns_cache_put
+ * Adds (or refreshes) a warmed dns entry of host:port for 'ttl' seconds.
+ * Expired entries are reused before growing the entries array.
+ */
+void dns_cache_put(async_context* context, const char* host, long port, const char* addresses, long ttl)
+{
+  dns_entry* entry = NULL, *entries;
+  double now = monotonic_ms();
+  size_t i;
+
+  if (strlen(host) >= DNS_HOST_SZ || strlen(addresses) >= DNS_ADDRESSES_SZ) return;
+
+  for (i=0; i<context->dns_count && entry == NULL; i++)
+    if (context->dns_entries[i].port == port && strcmp(context->dns_entries[i].host, host) == 0)
+      entry = &context->dns_entries[i];
+
+  for (i=0; i<context->dns_count && entry == NULL; i++)
+    if (context->dns_entries[i].expires_at <= now) entry = &context->dns_entries[i];
+
+  if (entry == NULL) {
+    if (context->dns_count == context->dns_capacity) {
+      size_t capacity = (context->dns_capacity > 0) ? context->dns_capacity * 2 : 16;
+      entries = (dns_entry*) realloc(context->dns_entries, sizeof(dns_entry) * capacity);
+      if (entries == NULL) {
+        log_error("dns_cache_put", "realloc() failed!");
+        return;
+      }
+      context->dns_entries  = entries;
+      context->dns_capacity = capacity;
+    }
+    entry = &context->dns_entries[context->dns_count++];
+  }
+
+  strcpy(entry->host, host);
+  strcpy(entry->addresses, addresses);
+  entry->port       = port;
+  entry->expires_at = now + (double)ttl * MILLISECONDS;
+}
+
+/**
+ * :append_matching_overrides
+ * Appends the static overrides that belong to host:port to 'list'.
+ * Overrides look like "host:port:address[,address]" (optionally prefixed by '+' or '-').
+ */
+static struct curl_slist* append_matching_overrides(struct curl_slist* list, struct curl_slist* overrides,
+                                                    const char* host_port)
+{
+  size_t host_port_len = strlen(host_port);
+  const char* entry;
+
+  for (; overrides != NULL; overrides = overrides->next) {
+    entry = overrides->data;
+    if (*entry == '+' || *entry == '-') entry++;
+    if (strncasecmp(entry, host_port, host_port_len) == 0 &&
+        (entry[host_port_len] == ':' || entry[host_port_len] == '\0'))
+      list = curl_slist_append(list, overrides->data);
+  }
+  return list;
+}
+
+/**
+ * :define_request_resolve
+ * Builds the CURLOPT_RESOLVE list of a single request:
+ * batch overrides, else module overrides, else the warmed entries.
+ * A single source per host:port, so the batch overrides win whatever entry libcurl keeps.
+ */
+struct curl_slist* define_request_resolve(request_handler* handler, request* request)
+{
+  char host[DNS_HOST_SZ], host_port[DNS_HOST_SZ + 16], entry[DNS_HOST_SZ + DNS_ADDRESSES_SZ + 24];
+  struct curl_slist* list = NULL;
+  const dns_entry* warmed;
+  long port;
+
+  if (!url_host_port(request_url(request), host, DNS_HOST_SZ, &port)) return NULL;
+  snprintf(host_port, sizeof(host_port), "%s:%ld", host, port);
+
+  list = append_matching_overrides(list, handler->options.resolve, host_port);
+  if (list == NULL) list = append_matching_overrides(list, handler->context->resolve, host_port);
+  if (list != NULL) return list;
+
+  if ((warmed = dns_cache_get(handler->context, host, port)) == NULL) return NULL;
+
+  /* '+' MARKS THE ENTRY AS A REGULAR (TIMING OUT) DNS CACHE ENTRY, SINCE LIBCURL 7.75.0 */
+#if LIBCURL_VERSION_NUM >= 0x074b00
+  snprintf(entry, sizeof(entry), "+%s:%s", host_port, warmed->addresses);
+#else
+  snprintf(entry, sizeof(entry), "%s:%s", host_port, warmed->addresses);
+#endif
+  return curl_slist_append(list, entry);
+}
+
+/**
+ * :prefetch_dns
+ * Resolves every distinct host of the batch once, in parallel,
+ * before any transfer starts. Hosts with a static override or a
+ * warmed entry are skipped, so concurrent transfers to the same
+ * host share a single lookup instead of resolving one each.
+ * A zero ttl disables the dns cache, nothing is prefetched then.
+ */
+void prefetch_dns(request_handler* handler)
+{
+  dns_lookup* lookups;
+  char host[DNS_HOST_SZ];
+  struct curl_slist* overrides;
+  size_t i, j, count = 0;
+  long port, ttl = (handler->options.dns_cache_timeout >= 0) ? handler->options.dns_cache_timeout
+                                                             : handler->context->dns_cache_timeout;
+
+  if (ttl <= 0) return;
+  if ((lookups = (dns_lookup*) malloc(sizeof(dns_lookup) * handler->count)) == NULL) return;
+
+  for (i=0; i<handler->count; i++) {
+    if (is_upstream_url(handler->requests[i].url.ptr)) continue;
+    if (!url_host_port(handler->requests[i].url.ptr, host, DNS_HOST_SZ, &port)) continue;
+    if (dns_cache_get(handler->context, host, port) != NULL) continue;
+
+    /* SKIP HOSTS PINNED BY A STATIC OVERRIDE */
+    overrides = define_request_resolve(handler, &handler->requests[i]);
+    if (overrides != NULL) {
+      curl_slist_free_all(overrides);
+      continue;
+    }
+
+    for (j=0; j<count; j++)
+      if (strcmp(lookups[j].host, host) == 0) break;
+    if (j < count) continue;
+
+    strcpy(lookups[count++].host, host);
+  }
+
+  dns_resolve(lookups, count);
+
+  /* A HOST MAY BE USED WITH SEVERAL PORTS IN THE SAME BATCH */
+  for (i=0; i<handler->count; i++) {
+    if (!url_host_port(handler->requests[i].url.ptr, host, DNS_HOST_SZ, &port)) continue;
+    for (j=0; j<count; j++) {
+      if (strcmp(lookups[j].host, host) != 0 || is_empty(lookups[j].addresses)) continue;
+      if (dns_cache_get(handler->context, host, port) == NULL)
+        dns_cache_put(handler->context, host, port, lookups[j].addresses, ttl);
+      break;
+    }
+  }
+
+  for (j=0; j<count; j++)
+    if (!is_empty(lookups[j].error)) log_error("prefetch_dns", "%s", lookups[j].error);
+
+  free(lookups);
+}
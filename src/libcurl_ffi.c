@@ -0,0 +1,168 @@
+#include "libcurl_async.h"
+
+/* THE LUA KEYS OF THE FFI REQUEST FIELDS, IN FFI_NUMBERS / FFI_STRINGS ORDER */
+static const char* number_keys[FFI_NUMBERS_COUNT] = {
+  "timeout", "connect_timeout", "expectations", "priority", "parallel_ranges",
+  "range_chunk_min", "verify_peer", "verify_host", "debug", "keep_body"
+};
+
+static const char* string_keys[FFI_STRINGS_COUNT] = {
+  "name", "method", "post_params", "data", "url", "certificate",
+  "cafile", "key", "password", "output_file", "decode"
+};
+
+/**
+ * :set_buffer
+ * Points an ffi buffer at some data
+ */
+static void set_buffer(lua_async_http_buffer* buffer, const char* ptr, size_t len)
+{
+  buffer->ptr = (ptr != NULL) ? ptr : "";
+  buffer->len = (ptr != NULL) ? len : 0;
+}
+
+/**
+ * :ffi_batch_options
+ * Reads the (optional) batch descriptor, with the bounds of batch_options_processor
+ */
+static void ffi_batch_options(const lua_async_http_batch* batch, batch_options* options)
+{
+  default_batch_options(options);
+  if (batch == NULL) return;
+
+  if (batch->deadline_ms > 0) options->deadline_ms = (long)batch->deadline_ms;
+  options->cancel = (cancel_token*) batch->cancel;
+  if (batch->concurrency >= 1) options->concurrency = (size_t)batch->concurrency;
+  if (batch->threads >= 1) options->threads = (size_t)batch->threads;
+  if (batch->wait == WAIT_ANY || batch->wait == WAIT_QUORUM) options->wait = batch->wait;
+  if (batch->quorum >= 1) options->quorum = (size_t)batch->quorum;
+  if (batch->max_per_host >= 1) options->max_per_host = (size_t)batch->max_per_host;
+
+  options->success_codes_count = (batch->success_codes_count < MAX_SUCCESS_CODES) ? batch->success_codes_count : MAX_SUCCESS_CODES;
+  memcpy(options->success_codes, batch->success_codes, sizeof(long) * options->success_codes_count);
+  options->success_classes   = batch->success_classes;
+  options->dns_cache_timeout = (batch->dns_cache_timeout >= 0) ? (long)batch->dns_cache_timeout : -1;
+  options->prefetch_dns      = batch->prefetch_dns != 0;
+  options->coalesce          = batch->coalesce != 0;
+  options->cache             = batch->cache != 0;
+}
+
+/**
+ * :ffi_request_processor
+ * Initiates the request handler out of the ffi request descriptors. The fields
+ * go through the lua setters (set_request_data, set_request_integers), so both
+ * paths read a request the same way.
+ */
+request_handler* ffi_request_processor(async_context* context, const lua_async_http_request* requests, size_t count,
+                                       const lua_async_http_batch* batch)
+{
+  size_t i, k;
+  request* request;
+  request_handler* handler = (request_handler*) malloc(sizeof(request_handler));
+  if (handler == NULL) return NULL;
+
+  handler->count    = 0;
+  handler->requests = NULL;
+  handler->context  = context;
+  handler->deadline = 0;
+  memset(&handler->stats, 0, sizeof(batch_stats));
+  ffi_batch_options(batch, &handler->options);
+
+  handler->count = count;
+  if (context == NULL || !init_requests(handler)) {
+    handler->count = 0;
+    handler->requests = NULL;
+    free_request_handler(handler);
+    return NULL;
+  }
+
+  /* QUORUM DEFAULTS TO THE BATCH MAJORITY */
+  if (handler->options.quorum == 0) handler->options.quorum = handler->count / 2 + 1;
+
+  for (i=0; i<count; i++) {
+    request = &handler->requests[i];
+    for (k=0; k<FFI_STRINGS_COUNT; k++)
+      if (requests[i].strings[k] != NULL) set_request_data(request, string_keys[k], requests[i].strings[k]);
+
+    for (k=0; k<FFI_NUMBERS_COUNT; k++)
+      if (requests[i].numbers_set & (1u << k)) set_request_integers(request, number_keys[k], (lua_Number)requests[i].numbers[k]);
+
+    if (requests[i].headers == NULL) continue;
+    if (!init_request_headers(request, (int)requests[i].headers_count)) {
+      free_request_handler(handler);
+      return NULL;
+    }
+    for (k=0; k<requests[i].headers_count; k++)
+      if (requests[i].headers[k] != NULL) memcpy_string(requests[i].headers[k], &request->header_fields.headers[k]);
+  }
+  return handler;
+}
+
+/**
+ * :ffi_generate_response
+ * Describes the batch responses (and counters) for the ffi caller.
+ * The buffers point into the batch, they live until lua_async_http_release.
+ */
+lua_async_http_result* ffi_generate_response(request_handler* handler)
+{
+  size_t i;
+  request* request;
+  lua_async_http_response* response;
+  lua_async_http_result* result = (lua_async_http_result*) malloc(sizeof(lua_async_http_result));
+  if (result == NULL) return NULL;
+
+  result->responses = (lua_async_http_response*) calloc((handler->count > 0) ? handler->count : 1, sizeof(lua_async_http_response));
+  if (result->responses == NULL) {
+    free(result);
+    return NULL;
+  }
+  result->count   = handler->count;
+  result->handler = handler;
+
+  for (i=0; i<handler->count; i++)
+  {
+    request  = &handler->requests[i];
+    response = &result->responses[i];
+
+    /* FOLLOWERS AND CACHE HITS ARE DECODED HERE, AS BY generate_response */
+    decode_response(request);
+    set_buffer(&response->name,         request->request_key.ptr, request->request_key.len);
+    set_buffer(&response->url,          request->url.ptr, request->url.len);
+    set_buffer(&response->headers,      request->response_headers.ptr, request->response_headers.len);
+    set_buffer(&response->error,        request->response_err, strlen(request->response_err));
+    set_buffer(&response->decode_error, request->decode_error, strlen(request->decode_error));
+    set_buffer(&response->endpoint,     request->endpoint_url, strlen(request->endpoint_url));
+    if (request->json == NULL || request->keep_body)
+      set_buffer(&response->body, request->response_body.ptr, request->response_body.len);
+    else set_buffer(&response->body, NULL, 0);
+
+    response->state        = request_state_name(request->state);
+    response->cache_status = cache_status_name(request->cache_status);
+    response->status       = request->response_status;
+    response->queue_time   = request->queue_time;
+    response->total_time   = request->total_time;
+    response->ranges       = request->parts_count;
+    response->decode       = request->decode;
+    if (request->json != NULL) {
+      response->json         = request->json->tokens;
+      response->json_count   = request->json->count;
+      response->json_strings = request->json->strings;
+      response->json_body    = request->response_body.ptr;
+    }
+  }
+
+  result->stats.requests          = handler->count;
+  result->stats.completed         = handler->stats.completed;
+  result->stats.succeeded         = handler->stats.succeeded;
+  result->stats.cancelled         = handler->stats.cancelled;
+  result->stats.deadline_exceeded = handler->stats.deadline_exceeded;
+  result->stats.circuit_open      = handler->stats.circuit_open;
+  result->stats.coalesced         = handler->stats.coalesced;
+  result->stats.cache_hits        = handler->stats.cache_hits;
+  result->stats.cache_misses      = handler->stats.cache_misses;
+  result->stats.cache_revalidated = handler->stats.cache_revalidated;
+  result->stats.threads           = handler->stats.threads;
+  result->stats.stolen            = handler->stats.stolen;
+  result->stats.wait_met          = handler->stats.wait_met;
+  return result;
+}
@@ -1,5 +1,7 @@
 #include "libcurl_async.h"
 
+#include <strings.h>
+
 /**
  * :is_empty
  * Simply returns if string is empty or not.
@@ -42,6 +44,16 @@ int method_get(const char* method)
   return (strcmp(method, "GET") == 0 || strcmp(method, "get") == 0);
 }
 
+/**
+ * :method_head
+ * Checks if method HEAD is lower or uppercase
+ */
+int method_head(const char* method)
+{
+  if (is_empty(method)) return 0;
+  return (strcmp(method, "HEAD") == 0 || strcmp(method, "head") == 0);
+}
+
 /**
  * :method_post
  * Checks if method POST is lower or uppercase
@@ -70,6 +82,137 @@ int is_https(const char* url)
   return 1;
 }
 
+/**
+ * :url_host_port
+ * Extracts the host name and port out of a given url.
+ * The port defaults to the scheme port (443 for https, 80 otherwise).
+ * IPv6 literal hosts are returned without their brackets.
+ */
+int url_host_port(const char* url, char* host, size_t host_sz, long* port)
+{
+  const char *start, *end, *host_end, *p;
+  size_t len, i;
+
+  if (is_empty(url) || (start = strstr(url, "://")) == NULL) return 0;
+  *port = is_https(url) ? 443L : 80L;
+  start += 3;
+  end = start + strcspn(start, "/?#");
+
+  /* SKIP USERINFO (user:password@) */
+  for (p = end; p > start; p--)
+    if (*(p-1) == '@') { start = p; break; }
+
+  if (*start == '[') {
+    host_end = memchr(start, ']', end - start);
+    if (host_end == NULL) return 0;
+    start++;
+    p = host_end + 1;
+  }
+  else {
+    host_end = memchr(start, ':', end - start);
+    if (host_end == NULL) host_end = end;
+    p = host_end;
+  }
+
+  len = host_end - start;
+  if (len == 0 || len >= host_sz) return 0;
+  for (i=0; i<len; i++) host[i] = tolower(start[i]);
+  host[len] = '\0';
+
+  if (p < end && *p == ':') *port = strtol(p+1, NULL, 10);
+  return 1;
+}
+
+/**
+ * :monotonic_ms
+ * Returns a monotonic clock reading in milliseconds.
+ */
+double monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec * MILLISECONDS + (double)now.tv_nsec / 1000000.0;
+}
+
+/**
+ * :realtime_ms
+ * Returns the wall clock time in milliseconds (since epoch).
+ */
+double realtime_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (double)now.tv_sec * MILLISECONDS + (double)now.tv_nsec / 1000000.0;
+}
+
+/**
+ * :fnv1a
+ * Folds 'len' bytes into a FNV-1a 64 bit hash, optionally lower casing them
+ */
+unsigned long long fnv1a(unsigned long long hash, const char* data, size_t len, int lower)
+{
+  size_t i;
+  for (i=0; i<len; i++) {
+    hash ^= (unsigned char)(lower ? tolower(data[i]) : data[i]);
+    hash *= FNV_PRIME;
+  }
+  return hash;
+}
+
+/**
+ * :request_header_value
+ * Finds a request header ("Name: value") by its name (case insensitive)
+ * and copies its trimmed value. Returns 0 when the header isn't set.
+ */
+int request_header_value(request* request, const char* name, char* value, size_t value_sz)
+{
+  size_t i, name_len = strlen(name), len;
+  const char* line;
+
+  for (i=0; i<request->header_fields.count; i++) {
+    line = request->header_fields.headers[i].ptr;
+    if (strncasecmp(line, name, name_len) != 0 || line[name_len] != ':') continue;
+
+    line += name_len + 1;
+    while (*line == ' ' || *line == '\t') line++;
+    len = strlen(line);
+    while (len > 0 && isspace((unsigned char)line[len-1])) len--;
+    if (len >= value_sz) len = value_sz - 1;
+    memcpy(value, line, len);
+    value[len] = '\0';
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * :cancel_token_cancel
+ * Fires the cancel token. A single atomic store, so it's safe
+ * to call from another thread or from a signal handler.
+ */
+void cancel_token_cancel(cancel_token* token)
+{
+  __atomic_store_n(&token->cancelled, 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * :cancel_token_reset
+ * Re-arms the cancel token for a later batch
+ */
+void cancel_token_reset(cancel_token* token)
+{
+  __atomic_store_n(&token->cancelled, 0, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * :cancel_token_cancelled
+ * Checks if the cancel token fired
+ */
+int cancel_token_cancelled(cancel_token* token)
+{
+  return __atomic_load_n(&token->cancelled, __ATOMIC_SEQ_CST);
+}
+
 /**
  * :init_string
  * Inits a string object of type 'string'
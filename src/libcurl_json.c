@@ -0,0 +1,415 @@
+#define _GNU_SOURCE
+#include "libcurl_async.h"
+
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+  const char* body;                       /* the parsed body                                            */
+  const char* p;                          /* parsing position                                           */
+  const char* end;                        /* body end                                                   */
+  json_tape*  tape;                       /* the produced tape                                          */
+  char*       error;                      /* error buffer (CURL_ERROR_SIZE)                             */
+} json_parser;
+
+static int parse_value(json_parser* parser, size_t depth);
+
+/* the "C" locale numbers convert in, whatever LC_NUMERIC the host program (or os.setlocale) picked */
+static locale_t c_locale = (locale_t)0;
+
+/**
+ * :json_init
+ * Creates the "C" locale once per process (called from the global init)
+ */
+void json_init(void)
+{
+  c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+}
+
+/**
+ * :parse_error
+ * Records the first parse error with its body offset, always returns 0
+ */
+static int parse_error(json_parser* parser, const char* reason)
+{
+  if (parser->error[0] == '\0')
+    snprintf(parser->error, CURL_ERROR_SIZE, "%s at offset %zu", reason, (size_t)(parser->p - parser->body));
+  return 0;
+}
+
+/**
+ * :skip_whitespace
+ * Skips the JSON insignificant whitespace
+ */
+static void skip_whitespace(json_parser* parser)
+{
+  while (parser->p < parser->end &&
+         (*parser->p == ' ' || *parser->p == '\n' || *parser->p == '\r' || *parser->p == '\t')) parser->p++;
+}
+
+/**
+ * :scan_string
+ * Returns the first quote, backslash or control character from 'p' (or 'end').
+ * 16 bytes a time with SSE2, most strings have nothing to unescape.
+ */
+static const char* scan_string(const char* p, const char* end)
+{
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"'), backslash = _mm_set1_epi8('\\'), control = _mm_set1_epi8(0x1f);
+  __m128i chunk, special;
+  int mask;
+
+  while (end - p >= 16) {
+    chunk = _mm_loadu_si128((const __m128i*)p);
+
+    /* CONTROL CHARACTERS ARE THE BYTES WHERE MIN(BYTE, 0x1F) == BYTE (UNSIGNED) */
+    special = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)),
+                           _mm_cmpeq_epi8(_mm_min_epu8(chunk, control), chunk));
+    if ((mask = _mm_movemask_epi8(special)) != 0) return p + __builtin_ctz(mask);
+    p += 16;
+  }
+#endif
+  while (p < end && *p != '"' && *p != '\\' && (unsigned char)*p >= 0x20) p++;
+  return p;
+}
+
+/**
+ * :push_token
+ * Appends a token to the tape, returns its index (SCHEDULER_NONE when out of memory)
+ */
+static size_t push_token(json_tape* tape, unsigned char type)
+{
+  json_token* tokens;
+  size_t capacity;
+
+  if (tape->count == tape->capacity) {
+    capacity = (tape->capacity > 0) ? tape->capacity * 2 : JSON_INITIAL_TOKENS;
+    if ((tokens = realloc(tape->tokens, sizeof(json_token) * capacity)) == NULL) return SCHEDULER_NONE;
+    tape->tokens = tokens;
+    tape->capacity = capacity;
+  }
+  memset(&tape->tokens[tape->count], 0, sizeof(json_token));
+  tape->tokens[tape->count].type = type;
+  return tape->count++;
+}
+
+/**
+ * :append_strings
+ * Appends unescaped bytes to the tape strings buffer
+ */
+static int append_strings(json_tape* tape, const char* data, size_t len)
+{
+  char* strings;
+  size_t capacity;
+
+  if (tape->strings_len + len > tape->strings_capacity) {
+    capacity = (tape->strings_capacity > 0) ? tape->strings_capacity : 256;
+    while (capacity < tape->strings_len + len) capacity *= 2;
+    if ((strings = realloc(tape->strings, capacity)) == NULL) return 0;
+    tape->strings = strings;
+    tape->strings_capacity = capacity;
+  }
+  memcpy(tape->strings + tape->strings_len, data, len);
+  tape->strings_len += len;
+  return 1;
+}
+
+/**
+ * :parse_hex4
+ * Reads the 4 hex digits of a \u escape
+ */
+static int parse_hex4(const char* p, unsigned int* code)
+{
+  size_t i;
+  *code = 0;
+  for (i=0; i<4; i++) {
+    *code <<= 4;
+    if      (p[i] >= '0' && p[i] <= '9') *code |= (unsigned int)(p[i] - '0');
+    else if (p[i] >= 'a' && p[i] <= 'f') *code |= (unsigned int)(p[i] - 'a' + 10);
+    else if (p[i] >= 'A' && p[i] <= 'F') *code |= (unsigned int)(p[i] - 'A' + 10);
+    else return 0;
+  }
+  return 1;
+}
+
+/**
+ * :append_utf8
+ * Appends a code point as UTF-8
+ */
+static int append_utf8(json_tape* tape, unsigned int code)
+{
+  char utf8[4];
+  size_t len;
+
+  if (code < 0x80) { utf8[0] = (char)code; len = 1; }
+  else if (code < 0x800) {
+    utf8[0] = (char)(0xc0 | (code >> 6));
+    utf8[1] = (char)(0x80 | (code & 0x3f));
+    len = 2;
+  }
+  else if (code < 0x10000) {
+    utf8[0] = (char)(0xe0 | (code >> 12));
+    utf8[1] = (char)(0x80 | ((code >> 6) & 0x3f));
+    utf8[2] = (char)(0x80 | (code & 0x3f));
+    len = 3;
+  }
+  else {
+    utf8[0] = (char)(0xf0 | (code >> 18));
+    utf8[1] = (char)(0x80 | ((code >> 12) & 0x3f));
+    utf8[2] = (char)(0x80 | ((code >> 6) & 0x3f));
+    utf8[3] = (char)(0x80 | (code & 0x3f));
+    len = 4;
+  }
+  return append_strings(tape, utf8, len);
+}
+
+/**
+ * :parse_escape
+ * Unescapes a single escape sequence ('p' on the backslash) into the strings buffer
+ */
+static int parse_escape(json_parser* parser)
+{
+  const char* p = parser->p + 1;
+  unsigned int code, low;
+  char c;
+
+  if (p >= parser->end) return parse_error(parser, "unterminated string");
+  switch (*p)
+  {
+    case '"':  c = '"';  break;
+    case '\\': c = '\\'; break;
+    case '/':  c = '/';  break;
+    case 'b':  c = '\b'; break;
+    case 'f':  c = '\f'; break;
+    case 'n':  c = '\n'; break;
+    case 'r':  c = '\r'; break;
+    case 't':  c = '\t'; break;
+
+    case 'u':
+      if (parser->end - p < 5 || !parse_hex4(p + 1, &code)) return parse_error(parser, "invalid unicode escape");
+      parser->p = p + 5;
+
+      /* A HIGH SURROGATE MUST BE FOLLOWED BY ITS LOW SURROGATE */
+      if (code >= 0xd800 && code <= 0xdbff) {
+        if (parser->end - parser->p < 6 || parser->p[0] != '\\' || parser->p[1] != 'u' ||
+            !parse_hex4(parser->p + 2, &low) || low < 0xdc00 || low > 0xdfff)
+          return parse_error(parser, "invalid unicode surrogate pair");
+        code = 0x10000 + ((code - 0xd800) << 10) + (low - 0xdc00);
+        parser->p += 6;
+      }
+      else if (code >= 0xdc00 && code <= 0xdfff) return parse_error(parser, "invalid unicode surrogate pair");
+      return append_utf8(parser->tape, code) || parse_error(parser, "out of memory");
+
+    default:
+      return parse_error(parser, "invalid escape");
+  }
+  parser->p = p + 1;
+  return append_strings(parser->tape, &c, 1) || parse_error(parser, "out of memory");
+}
+
+/**
+ * :parse_string
+ * Parses a string ('p' on the opening quote). Strings without escapes point
+ * into the body, the others are unescaped into the tape strings buffer.
+ */
+static int parse_string(json_parser* parser)
+{
+  const char* start = ++parser->p;
+  size_t index, offset;
+
+  if ((index = push_token(parser->tape, JSON_STRING)) == SCHEDULER_NONE) return parse_error(parser, "out of memory");
+  parser->p = scan_string(parser->p, parser->end);
+
+  /* THE COMMON CASE, NOTHING TO UNESCAPE */
+  if (parser->p < parser->end && *parser->p == '"') {
+    parser->tape->tokens[index].offset = (size_t)(start - parser->body);
+    parser->tape->tokens[index].len    = (size_t)(parser->p - start);
+    parser->p++;
+    return 1;
+  }
+
+  offset = parser->tape->strings_len;
+  while (1) {
+    if (!append_strings(parser->tape, start, (size_t)(parser->p - start))) return parse_error(parser, "out of memory");
+    if (parser->p >= parser->end) return parse_error(parser, "unterminated string");
+    if (*parser->p == '"') break;
+    if (*parser->p != '\\') return parse_error(parser, "control character in string");
+    if (!parse_escape(parser)) return 0;
+    start = parser->p;
+    parser->p = scan_string(parser->p, parser->end);
+  }
+
+  parser->tape->tokens[index].escaped = 1;
+  parser->tape->tokens[index].offset  = offset;
+  parser->tape->tokens[index].len     = parser->tape->strings_len - offset;
+  parser->p++;
+  return 1;
+}
+
+/**
+ * :parse_number
+ * Validates the JSON number grammar, then converts it in the "C" locale,
+ * a comma decimal LC_NUMERIC would otherwise stop "1.5" at "1"
+ */
+static int parse_number(json_parser* parser)
+{
+  const char* start = parser->p, *p = parser->p, *end = parser->end;
+  size_t index;
+
+  if (p < end && *p == '-') p++;
+  if (p < end && *p == '0') p++;
+  else if (p < end && *p >= '1' && *p <= '9') while (p < end && isdigit((unsigned char)*p)) p++;
+  else return parse_error(parser, "invalid number");
+
+  if (p < end && *p == '.') {
+    if (++p >= end || !isdigit((unsigned char)*p)) return parse_error(parser, "invalid number");
+    while (p < end && isdigit((unsigned char)*p)) p++;
+  }
+  if (p < end && (*p == 'e' || *p == 'E')) {
+    if (++p < end && (*p == '+' || *p == '-')) p++;
+    if (p >= end || !isdigit((unsigned char)*p)) return parse_error(parser, "invalid number");
+    while (p < end && isdigit((unsigned char)*p)) p++;
+  }
+
+  if ((index = push_token(parser->tape, JSON_NUMBER)) == SCHEDULER_NONE) return parse_error(parser, "out of memory");
+  parser->tape->tokens[index].number = (c_locale != (locale_t)0) ? strtod_l(start, NULL, c_locale) : strtod(start, NULL);
+  parser->p = p;
+  return 1;
+}
+
+/**
+ * :parse_literal
+ * Parses true, false and null
+ */
+static int parse_literal(json_parser* parser, const char* literal, unsigned char type)
+{
+  size_t len = strlen(literal);
+  if ((size_t)(parser->end - parser->p) < len || memcmp(parser->p, literal, len) != 0)
+    return parse_error(parser, "invalid literal");
+  if (push_token(parser->tape, type) == SCHEDULER_NONE) return parse_error(parser, "out of memory");
+  parser->p += len;
+  return 1;
+}
+
+/**
+ * :parse_container
+ * Parses an array or an object ('p' on the opening bracket). The container
+ * token counts its elements (object members), the walk needs nothing else.
+ */
+static int parse_container(json_parser* parser, size_t depth, int object)
+{
+  char close = object ? '}' : ']';
+  size_t index, count = 0;
+
+  if (depth >= JSON_MAX_DEPTH) return parse_error(parser, "nesting too deep");
+  if ((index = push_token(parser->tape, object ? JSON_OBJECT : JSON_ARRAY)) == SCHEDULER_NONE)
+    return parse_error(parser, "out of memory");
+
+  parser->p++;
+  skip_whitespace(parser);
+  if (parser->p < parser->end && *parser->p == close) {
+    parser->p++;
+    return 1;
+  }
+
+  while (1) {
+    if (object) {
+      skip_whitespace(parser);
+      if (parser->p >= parser->end || *parser->p != '"') return parse_error(parser, "expected an object key");
+      if (!parse_string(parser)) return 0;
+      skip_whitespace(parser);
+      if (parser->p >= parser->end || *parser->p != ':') return parse_error(parser, "expected ':'");
+      parser->p++;
+    }
+    if (!parse_value(parser, depth + 1)) return 0;
+    count++;
+
+    skip_whitespace(parser);
+    if (parser->p < parser->end && *parser->p == ',') { parser->p++; continue; }
+    if (parser->p < parser->end && *parser->p == close) { parser->p++; break; }
+    return parse_error(parser, object ? "expected ',' or '}'" : "expected ',' or ']'");
+  }
+
+  parser->tape->tokens[index].len = count;
+  return 1;
+}
+
+/**
+ * :parse_value
+ * Parses any JSON value
+ */
+static int parse_value(json_parser* parser, size_t depth)
+{
+  skip_whitespace(parser);
+  if (parser->p >= parser->end) return parse_error(parser, "unexpected end of body");
+
+  switch (*parser->p)
+  {
+    case '{': return parse_container(parser, depth, 1);
+    case '[': return parse_container(parser, depth, 0);
+    case '"': return parse_string(parser);
+    case 't': return parse_literal(parser, "true", JSON_TRUE);
+    case 'f': return parse_literal(parser, "false", JSON_FALSE);
+    case 'n': return parse_literal(parser, "null", JSON_NULL);
+  }
+  if (*parser->p != '-' && !isdigit((unsigned char)*parser->p)) return parse_error(parser, "unexpected character");
+  return parse_number(parser);
+}
+
+/**
+ * :free_json
+ * Simply freeing a decoded body tape
+ */
+void free_json(json_tape* tape)
+{
+  if (tape == NULL) return;
+  free(tape->tokens);
+  free(tape->strings);
+  free(tape);
+}
+
+/**
+ * :decode_response
+ * Decodes the request response body (decode option) into a tape of tokens:
+ * the Lua tables are built later on, right from the tape, without the body string.
+ * Runs on the thread completing the transfer. Errors go to 'decode_error'.
+ */
+int decode_response(request* request)
+{
+  json_parser parser;
+
+  /* ONLY COMPLETED TRANSFERS ARE DECODED, ONCE */
+  if (request->decode != DECODE_JSON || request->state != REQUEST_DONE || request->result != CURLE_OK) return 1;
+  if (request->json != NULL || request->decode_error[0] != '\0') return 1;
+  if (!is_empty(request->output_file.ptr)) {
+    snprintf(request->decode_error, CURL_ERROR_SIZE, "the body was written to the output file");
+    return 0;
+  }
+
+  if ((request->json = (json_tape*) calloc(1, sizeof(json_tape))) == NULL) {
+    snprintf(request->decode_error, CURL_ERROR_SIZE, "out of memory");
+    return 0;
+  }
+
+  parser.body  = parser.p = request->response_body.ptr;
+  parser.end   = request->response_body.ptr + request->response_body.len;
+  parser.tape  = request->json;
+  parser.error = request->decode_error;
+
+  if (parse_value(&parser, 0)) {
+    skip_whitespace(&parser);
+    if (parser.p == parser.end) return 1;
+    parse_error(&parser, "trailing characters");
+  }
+
+  free_json(request->json);
+  request->json = NULL;
+  log_request(L_DEBUG, "decode_response", request, "json decoding failed: %s", request->decode_error);
+  return 0;
+}
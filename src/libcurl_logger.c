@@ -1,126 +1,497 @@
 #include "libcurl_async.h"
 
+#include <pthread.h>
+
 /**
- * :print_log
- * basicaly prints the log message to the machine
- * console stderr. those message could monitored later on.
- * @param severity
- * @param func  -   the called function
- * @param message
- **/
-void print_log(const char* severity, 
-            const char* func, const char* message)
+ * The logger is a bounded lock-free MPMC ring (a sequence number per slot).
+ * Any thread formats its message straight into a claimed slot, and never
+ * blocks: when the ring is full the message is dropped (and counted).
+ * A background writer drains the ring into the stderr / file sink, while the
+ * lua sink is drained on the lua thread (a lua function can't run elsewhere).
+ * The sink is process wide: a lua sink belongs to the lua state (context)
+ * that set it, the only one draining the ring.
+ */
+static log_record ring[LOG_RING_SIZE];
+static size_t enqueue_pos = 0;
+static size_t dequeue_pos = 0;
+static size_t dropped = 0;
+static size_t written = 0;
+static int level = LOG_LEVEL ? LOG_LEVEL + 1 : 0;
+
+/* SINK SETTINGS, ONLY THE WRITER SIDE TAKES THE LOCK */
+static pthread_mutex_t sink_lock = PTHREAD_MUTEX_INITIALIZER;
+static int sink = LOG_SINK_STDERR;
+static int format = LOG_FORMAT_KV;
+static FILE* sink_file = NULL;
+static const void* lua_owner = NULL;
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_once_t writer_once = PTHREAD_ONCE_INIT;
+
+/* THE WRITER SLEEPS ON THE CONDITION, A PRODUCER ONLY TAKES THE LOCK WHEN IT'S IDLE */
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_idle = 0;
+static int writer_wake = 0;
+
+/**
+ * :init_ring
+ * Each slot sequence starts at its own index (free for that enqueue position)
+ */
+static void init_ring(void)
 {
-  fprintf(stderr, "[%s][%s] when (%s) : %s\n", LUA_ASYNC_HTTP_TITLE, severity, func, message);
+  size_t i;
+  for (i=0; i<LOG_RING_SIZE; i++) __atomic_store_n(&ring[i].sequence, i, __ATOMIC_RELAXED);
 }
 
 /**
- * :create_log_by_severity
- * organizing the error / warning messages by thier severity.
- * each severity level gets his own badge name and transferred
- * to print_log function.
- * @param severity
- * @param func
- * @param message
- **/
-void create_log_by_severity(unsigned char severity, const char* func, const char* message)
+ * :level_name
+ * Simply returns the name of a log severity
+ */
+const char* level_name(int severity)
 {
   switch (severity)
   {
-      case L_DEBUG: print_log("DEBUG", func, message); break;
-      case L_INFO: print_log("INFO", func, message); break;
-      case L_ERROR: print_log("ERROR", func, message); break;
-      case L_FATAL_ERROR: print_log("FATAL ERROR", func, message); break;
+    case L_DEBUG:       return "debug";
+    case L_INFO:        return "info";
+    case L_ERROR:       return "error";
+    case L_FATAL_ERROR: return "fatal";
+  }
+  return "off";
+}
+
+/**
+ * :logger_enabled
+ * Checks the runtime level, before anything is formatted
+ */
+int logger_enabled(unsigned char severity)
+{
+  return severity <= __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
+
+/**
+ * :logger_set_level
+ * Sets the runtime level (0 turns the logger off, L_DEBUG logs everything)
+ */
+void logger_set_level(int new_level)
+{
+  __atomic_store_n(&level, new_level, __ATOMIC_RELAXED);
+}
+
+/**
+ * :logger_level
+ * Returns the runtime level
+ */
+int logger_level(void)
+{
+  return __atomic_load_n(&level, __ATOMIC_RELAXED);
+}
+
+/**
+ * :json_escape
+ * Copies a string as a JSON string body
+ */
+static size_t json_escape(char* dest, size_t dest_sz, const char* src)
+{
+  size_t used = 0;
+  unsigned char c;
+
+  for (; *src != '\0' && used + 7 < dest_sz; src++) {
+    c = (unsigned char)*src;
+    if (c == '"' || c == '\\') { dest[used++] = '\\'; dest[used++] = c; }
+    else if (c == '\n') { dest[used++] = '\\'; dest[used++] = 'n'; }
+    else if (c < 0x20) used += snprintf(dest + used, dest_sz - used, "\\u%04x", c);
+    else dest[used++] = c;
+  }
+  dest[used] = '\0';
+  return used;
+}
+
+/**
+ * :kv_escape
+ * Copies a key=value value, quoted when it holds spaces, quotes or '='
+ */
+static size_t kv_escape(char* dest, size_t dest_sz, const char* src)
+{
+  size_t used = 0;
+  int quote = (*src == '\0') || strpbrk(src, " =\"\t\n") != NULL;
+
+  if (quote) dest[used++] = '"';
+  for (; *src != '\0' && used + 4 < dest_sz; src++) {
+    if (*src == '"' || *src == '\\') dest[used++] = '\\';
+    dest[used++] = (*src == '\n') ? ' ' : *src;
+  }
+  if (quote) dest[used++] = '"';
+  dest[used] = '\0';
+  return used;
+}
+
+/**
+ * :format_log_record
+ * Formats a record as a single JSON or key=value line
+ */
+static void format_log_record(log_record* record, int record_format, char* line, size_t line_sz)
+{
+  char time_str[32], func[LOG_FUNC_SZ * 2], name[LOG_NAME_SZ * 2], url[LOG_URL_SZ * 2], message[LOG_MESSAGE_SZ * 2];
+  time_t seconds = (time_t)(record->time / MILLISECONDS);
+  struct tm utc;
+  size_t (*escape)(char*, size_t, const char*) = (record_format == LOG_FORMAT_JSON) ? json_escape : kv_escape;
+
+  gmtime_r(&seconds, &utc);
+  strftime(time_str, sizeof(time_str), "%Y-%m-%dT%H:%M:%S", &utc);
+  escape(func, sizeof(func), record->func);
+  escape(name, sizeof(name), record->name);
+  escape(url, sizeof(url), record->url);
+  escape(message, sizeof(message), record->message);
+
+  if (record_format == LOG_FORMAT_JSON)
+    snprintf(line, line_sz, "{\"ts\":\"%s.%03dZ\",\"level\":\"%s\",\"func\":\"%s\",\"request\":\"%s\",\"url\":\"%s\",\"msg\":\"%s\"}\n",
+             time_str, (int)((long long)record->time % MILLISECONDS), level_name(record->level), func, name, url, message);
+  else if (record->url[0] != '\0')
+    snprintf(line, line_sz, "ts=%s.%03dZ lib=%s level=%s func=%s request=%s url=%s msg=%s\n",
+             time_str, (int)((long long)record->time % MILLISECONDS), LUA_ASYNC_HTTP_TITLE, level_name(record->level), func, name, url, message);
+  else
+    snprintf(line, line_sz, "ts=%s.%03dZ lib=%s level=%s func=%s msg=%s\n",
+             time_str, (int)((long long)record->time % MILLISECONDS), LUA_ASYNC_HTTP_TITLE, level_name(record->level), func, message);
+}
+
+/**
+ * :logger_pop
+ * Takes the oldest record out of the ring. Returns 0 when it's empty.
+ */
+int logger_pop(log_record* record)
+{
+  size_t pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED), seq;
+  log_record* slot;
+  long dif;
+
+  pthread_once(&ring_once, init_ring);
+  for (;;) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    dif = (long)seq - (long)(pos + 1);
+
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&dequeue_pos, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    }
+    else if (dif < 0) return 0;
+    else pos = __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+  }
+
+  memcpy(record, slot, sizeof(log_record));
+  __atomic_store_n(&slot->sequence, pos + LOG_RING_SIZE, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * :write_record
+ * Writes a record to the stderr / file sink (sink lock held)
+ */
+static void write_record(log_record* record)
+{
+  char line[LOG_LINE_SZ];
+  FILE* out = (sink == LOG_SINK_FILE && sink_file != NULL) ? sink_file : stderr;
+
+  format_log_record(record, format, line, sizeof(line));
+  fputs(line, out);
+  __atomic_add_fetch(&written, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * :drain_to_sink
+ * Writes every queued record to the stderr / file sink.
+ * The lua sink records are left for the lua thread. Returns the written count.
+ */
+static size_t drain_to_sink(void)
+{
+  log_record record;
+  size_t count = 0;
+
+  pthread_mutex_lock(&sink_lock);
+  if (sink != LOG_SINK_LUA) {
+    while (logger_pop(&record)) {
+      write_record(&record);
+      count++;
+    }
+    if (count > 0) fflush((sink == LOG_SINK_FILE && sink_file != NULL) ? sink_file : stderr);
+  }
+  pthread_mutex_unlock(&sink_lock);
+  return count;
+}
+
+/**
+ * :logger_flush
+ * Writes the queued records right away (stderr / file sinks)
+ */
+void logger_flush(void)
+{
+  drain_to_sink();
+}
+
+/**
+ * :wake_writer
+ * Wakes the writer when it waits on an empty ring, a busy writer costs nothing
+ */
+static void wake_writer(void)
+{
+  /* THE PUBLISHED RECORD IS VISIBLE BEFORE 'writer_idle' IS READ, THE WRITER DOES THE OPPOSITE */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!__atomic_exchange_n(&writer_idle, 0, __ATOMIC_SEQ_CST)) return;
+
+  pthread_mutex_lock(&writer_lock);
+  writer_wake = 1;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+/**
+ * :log_writer
+ * The background writer, sleeps until a record is published (or the sink changes).
+ * With the lua sink it only waits for the sink to change, the lua thread drains the ring.
+ */
+static void* log_writer(void* arg)
+{
+  int lua;
+
+  for (;;) {
+    drain_to_sink();
+
+    pthread_mutex_lock(&writer_lock);
+    lua = (logger_sink() == LOG_SINK_LUA);
+    __atomic_store_n(&writer_idle, !lua, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    while (!writer_wake && (lua || logger_pending() == 0)) pthread_cond_wait(&writer_cond, &writer_lock);
+    writer_wake = 0;
+    __atomic_store_n(&writer_idle, 0, __ATOMIC_SEQ_CST);
+    pthread_mutex_unlock(&writer_lock);
   }
+  return arg;
+}
+
+/**
+ * :start_writer
+ * Starts the detached background writer, the ring is flushed on exit
+ */
+static void start_writer(void)
+{
+  pthread_t thread;
+  pthread_attr_t attr;
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_create(&thread, &attr, log_writer, NULL);
+  pthread_attr_destroy(&attr);
+  atexit(logger_flush);
+}
+
+/**
+ * :logger_set_sink
+ * Sets the sink: LOG_SINK_STDERR, LOG_SINK_FILE (appends to 'path') or LOG_SINK_LUA,
+ * drained by its 'owner' context only. Returns 0 when the file can't be opened (the sink is kept).
+ */
+int logger_set_sink(int new_sink, const char* path, int new_format, const void* owner)
+{
+  FILE* file = NULL;
+
+  if (new_sink == LOG_SINK_FILE && (path == NULL || (file = fopen(path, "a")) == NULL)) return 0;
+
+  drain_to_sink();
+  pthread_mutex_lock(&sink_lock);
+  if (sink_file != NULL) fclose(sink_file);
+  sink_file = file;
+  sink      = new_sink;
+  format    = new_format;
+  lua_owner = (new_sink == LOG_SINK_LUA) ? owner : NULL;
+  pthread_mutex_unlock(&sink_lock);
+
+  /* A WRITER PARKED ON THE LUA SINK DRAINS WHAT'S LEFT IN THE RING */
+  pthread_mutex_lock(&writer_lock);
+  writer_wake = 1;
+  pthread_cond_signal(&writer_cond);
+  pthread_mutex_unlock(&writer_lock);
+  return 1;
+}
+
+/**
+ * :logger_owns_lua_sink
+ * Checks the lua sink is set, and belongs to the 'owner' context
+ */
+int logger_owns_lua_sink(const void* owner)
+{
+  int owned;
+  pthread_mutex_lock(&sink_lock);
+  owned = (sink == LOG_SINK_LUA && owner != NULL && lua_owner == owner);
+  pthread_mutex_unlock(&sink_lock);
+  return owned;
+}
+
+/**
+ * :logger_release_owner
+ * A closing context gives its lua sink back to stderr, nothing would drain the ring anymore
+ */
+void logger_release_owner(const void* owner)
+{
+  if (logger_owns_lua_sink(owner)) logger_set_sink(LOG_SINK_STDERR, NULL, LOG_FORMAT_KV, NULL);
+}
+
+/**
+ * :logger_sink
+ * Returns the current sink
+ */
+int logger_sink(void)
+{
+  int current;
+  pthread_mutex_lock(&sink_lock);
+  current = sink;
+  pthread_mutex_unlock(&sink_lock);
+  return current;
+}
+
+/**
+ * :logger_dropped, logger_written, logger_pending
+ * The logger counters
+ */
+size_t logger_dropped(void)
+{
+  return __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+}
+
+size_t logger_written(void)
+{
+  return __atomic_load_n(&written, __ATOMIC_RELAXED);
+}
+
+size_t logger_pending(void)
+{
+  return __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED) - __atomic_load_n(&dequeue_pos, __ATOMIC_RELAXED);
+}
+
+/**
+ * :logger_record_written
+ * Counts a record the lua sink consumed
+ */
+void logger_record_written(void)
+{
+  __atomic_add_fetch(&written, 1, __ATOMIC_RELAXED);
 }
 
 /**
  * :create_log
- * this function creates a new log message based on the configuration log_level.
- * 
- * severity identifiers are as follow:
- * '1'  -   FATAL ERROR
- * '2'  -   ERROR
- * '3'  -   INFO
- * '4'  -   DEBUG
- * 
- * @param severity
- * @param func
- * @param message
- **/
-void create_log(unsigned char severity, const char* func, const char* message)
+ * Formats a new record straight into a claimed ring slot, with the request
+ * (name and url) context when given. Never blocks: a full ring drops it.
+ * Fatal errors are written synchronously, the process may exit right after.
+ */
+void create_log(unsigned char severity, const char* func, request* request, const char* format_str, va_list arg)
 {
-  if (!LOG_LEVEL) return;
-  switch (LOG_LEVEL)
-  {
-    case VERBOSE_V:
-      if (severity <= L_ERROR) 
-        create_log_by_severity(severity, func, message);
-    break;
-
-    case VERBOSE_VV:
-      if (severity <= L_INFO) 
-        create_log_by_severity(severity, func, message);
-    break;
-
-    case VERBOSE_VVV:
-      if (severity <= L_DEBUG) 
-        create_log_by_severity(severity, func, message);
-    break;
-
-    default:
+  size_t pos, seq;
+  log_record* slot, overflow;
+  char line[LOG_LINE_SZ];
+  long dif;
+
+  pthread_once(&ring_once, init_ring);
+  pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  for (;;) {
+    slot = &ring[pos & (LOG_RING_SIZE - 1)];
+    seq = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    dif = (long)seq - (long)pos;
+
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n(&enqueue_pos, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+    }
+    else if (dif < 0) {
+      __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+      if (severity != L_FATAL_ERROR) return;
+
+      /* A FATAL ERROR IS NEVER DROPPED, A FULL RING HAS IT WRITTEN FROM A PRIVATE RECORD */
+      slot = &overflow;
+      break;
+    }
+    else pos = __atomic_load_n(&enqueue_pos, __ATOMIC_RELAXED);
+  }
+
+  slot->level = severity;
+  slot->time  = realtime_ms();
+  snprintf(slot->func, LOG_FUNC_SZ, "%s", func);
+  snprintf(slot->name, LOG_NAME_SZ, "%s", (request != NULL && request->request_key.ptr != NULL) ? request->request_key.ptr : "");
+  snprintf(slot->url, LOG_URL_SZ, "%s", (request != NULL && request->url.ptr != NULL) ? request->url.ptr : "");
+  vsnprintf(slot->message, LOG_MESSAGE_SZ, format_str, arg);
+
+  if (severity != L_FATAL_ERROR) {
+    __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+    pthread_once(&writer_once, start_writer);
+    wake_writer();
     return;
   }
+
+  /* FORMATTED BEFORE THE SLOT IS PUBLISHED, A CONSUMER MAY TAKE AND REUSE IT RIGHT AFTER */
+  format_log_record(slot, LOG_FORMAT_KV, line, sizeof(line));
+  if (slot != &overflow) __atomic_store_n(&slot->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  /* THE LUA SINK MAY NEVER GET TO DRAIN IT */
+  if (slot == &overflow || logger_sink() == LOG_SINK_LUA) fputs(line, stderr);
+  else logger_flush();
 }
 
 /**
- * :log_debug_info, log_info, log_error, log_fatal_error
+ * :log_debug_info, log_info, log_error, log_fatal_error, log_request
  * this function is the entry point for creating a new log message.
- * with parameters. the request is being made by passing the log request 
+ * with parameters. the request is being made by passing the log request
  * to 'create_log' function.
- * 
+ *
  * those functions are work with va_args, which is unlimited number of arguments.
- * the caller syntax should be like: 
+ * the caller syntax should be like:
  * log_debug_info("function to log", "my number is: %d\n", num).
- * 
+ * log_request adds the request name and url to the message context:
+ * log_request(L_DEBUG, "function to log", request, "status: %ld", status).
+ *
  * the below functions are basicaly the same, just with other severity code.
- * 
+ * disabled levels return before anything is formatted.
+ *
  * @param func
  * @param message
  * @param ... - va_list
  **/
-void log_debug_info(const char* func, const char* format, ...)
+void log_debug_info(const char* func, const char* format_str, ...)
 {
   va_list arg;
-  va_start (arg, format);
-  vsnprintf(logger_buffer, LOGGER_BUFFER_SIZE, format, arg);
+  if (!logger_enabled(L_DEBUG)) return;
+  va_start (arg, format_str);
+  create_log(L_DEBUG, func, NULL, format_str, arg);
   va_end(arg);
-  create_log(L_DEBUG, func, logger_buffer);
 }
 
-void log_info(const char* func, const char* format, ...)
+void log_info(const char* func, const char* format_str, ...)
+{
+  va_list arg;
+  if (!logger_enabled(L_INFO)) return;
+  va_start (arg, format_str);
+  create_log(L_INFO, func, NULL, format_str, arg);
+  va_end (arg);
+}
+
+void log_error(const char* func, const char* format_str, ...)
 {
   va_list arg;
-  va_start (arg, format);
-  vsnprintf(logger_buffer, LOGGER_BUFFER_SIZE, format, arg);
+  if (!logger_enabled(L_ERROR)) return;
+  va_start (arg, format_str);
+  create_log(L_ERROR, func, NULL, format_str, arg);
   va_end (arg);
-  create_log(L_INFO, func, logger_buffer);
 }
 
-void log_error(const char* func, const char* format, ...)
+void log_fatal_error(const char* func, const char* format_str, ...)
 {
   va_list arg;
-  va_start (arg, format);
-  vsnprintf(logger_buffer, LOGGER_BUFFER_SIZE, format, arg);
+  if (!logger_enabled(L_FATAL_ERROR)) return;
+  va_start (arg, format_str);
+  create_log(L_FATAL_ERROR, func, NULL, format_str, arg);
   va_end (arg);
-  create_log(L_ERROR, func, logger_buffer);
 }
 
-void log_fatal_error(const char* func, const char* format, ...)
+void log_request(unsigned char severity, const char* func, request* request, const char* format_str, ...)
 {
   va_list arg;
-  va_start (arg, format);
-  vsnprintf(logger_buffer, LOGGER_BUFFER_SIZE, format, arg);
+  if (!logger_enabled(severity)) return;
+  va_start (arg, format_str);
+  create_log(severity, func, request, format_str, arg);
   va_end (arg);
-  create_log(L_FATAL_ERROR, func, logger_buffer);
-}
\ No newline at end of file
+}
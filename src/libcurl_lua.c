@@ -1,5 +1,11 @@
 #include "libcurl_async.h"
 
+/* THE COLUMNAR RESULT COLUMNS NAMES, IN RESULT_COLUMNS ORDER */
+static const char* column_names[COLUMNS_COUNT] = {
+  "names", "url", "status", "body", "headers", "error", "state",
+  "queue_time", "total_time", "cache_status", "ranges", "json", "decode_error", "endpoint"
+};
+
 /**
  * :l_pushtablestring
  * Pushes key, value pairs to lua stack
@@ -10,6 +16,68 @@ void l_pushtablestring(lua_State* L , char* key , char* value) {
     lua_settable(L, -3);
 }
 
+/**
+ * :l_pushtablelstring
+ * Pushes key, binary string pairs to lua stack
+ */
+void l_pushtablelstring(lua_State* L , char* key , char* value, size_t len) {
+    lua_pushstring(L, key);
+    lua_pushlstring(L, value, len);
+    lua_settable(L, -3);
+}
+
+/**
+ * :l_pushjsonvalue
+ * Pushes the decoded value at 'index' of the request tape (with its children),
+ * returns the index of the next value. JSON null is pushed as async.null.
+ */
+static size_t l_pushjsonvalue(lua_State* L, request* request, size_t index)
+{
+  json_tape* tape = request->json;
+  json_token* token = &tape->tokens[index++];
+  size_t i;
+
+  luaL_checkstack(L, 3, "json nesting too deep");
+  switch (token->type)
+  {
+    case JSON_NULL:   lua_pushlightuserdata(L, NULL); break;
+    case JSON_FALSE:  lua_pushboolean(L, 0); break;
+    case JSON_TRUE:   lua_pushboolean(L, 1); break;
+    case JSON_NUMBER: lua_pushnumber(L, (lua_Number)token->number); break;
+
+    case JSON_STRING:
+      lua_pushlstring(L, (token->escaped ? tape->strings : request->response_body.ptr) + token->offset, token->len);
+      break;
+
+    case JSON_ARRAY:
+      lua_createtable(L, (int)token->len, 0);
+      for (i=1; i<=token->len; i++) {
+        index = l_pushjsonvalue(L, request, index);
+        lua_rawseti(L, -2, (int)i);
+      }
+      break;
+
+    case JSON_OBJECT:
+      lua_createtable(L, 0, (int)token->len);
+      for (i=0; i<token->len; i++) {
+        index = l_pushjsonvalue(L, request, index);                /* the member key          */
+        index = l_pushjsonvalue(L, request, index);                /* the member value        */
+        lua_rawset(L, -3);
+      }
+      break;
+  }
+  return index;
+}
+
+/**
+ * :l_pushjson
+ * Pushes the decoded body of a request
+ */
+void l_pushjson(lua_State* L, request* request)
+{
+  l_pushjsonvalue(L, request, 0);
+}
+
 /**
  * :l_pushtablenumber
  * Pushes key, number pairs to lua stack
@@ -26,33 +94,45 @@ void l_pushtablenumber(lua_State* L , char* key, double value) {
  * where key is the header name, and value is the key header value
  */
 void l_pushheaders(lua_State* L, char* response_headers_key, char* response_headers)
+{
+  lua_pushstring(L, response_headers_key);
+  l_pushheaderstable(L, response_headers);
+  lua_settable(L, -3);
+}
+
+/**
+ * :l_pushheaderstable
+ * Pushes the response headers table.
+ * The headers are left intact, coalesced requests share them.
+ */
+void l_pushheaderstable(lua_State* L, char* response_headers)
 {
   size_t header_size, token_size, index_of, i;
-  char* single_header, *e_token = NULL;
+  char* single_header = response_headers, *e_token = NULL;
   char tbl_key[TBL_KEY_SZ], tbl_value[TBL_VAL_SZ];
 
-  lua_pushstring(L, response_headers_key);
   lua_newtable(L);
 
-  while ((single_header = strtok_r(response_headers, "\n\r", &response_headers))) {
+  while (1) {
     /* single_header looks like "content-type: text/html; charset=UTF-8"
         we'll ignore single_header's that doesn't comply with key, value structure */
-    if (is_empty(single_header)) break;
-    header_size = strlen(single_header);
-    e_token = strchr(single_header, ':');
-    if (!is_empty(e_token))
+    single_header += strspn(single_header, "\n\r");
+    if ((header_size = strcspn(single_header, "\n\r")) == 0) break;
+    e_token = memchr(single_header, ':', header_size);
+    if (e_token != NULL)
     {
-      token_size = strlen(e_token);
-      index_of = header_size - token_size;
-      if (index_of >= TBL_KEY_SZ || token_size >= TBL_VAL_SZ-HEADER_SPACING) continue;
-      for (i=0; i<index_of; i++) tbl_key[i] = tolower(single_header[i]);
-      for (i=0; i<token_size-HEADER_SPACING; i++) tbl_value[i] = e_token[i+HEADER_SPACING];
-      tbl_key[index_of] = '\0';
-      tbl_value[token_size-HEADER_SPACING] = '\0';
-      l_pushtablestring(L, tbl_key, tbl_value);
-    } 
+      index_of = (size_t)(e_token - single_header);
+      token_size = header_size - index_of;
+      if (index_of < TBL_KEY_SZ && token_size < TBL_VAL_SZ-HEADER_SPACING) {
+        for (i=0; i<index_of; i++) tbl_key[i] = tolower(single_header[i]);
+        for (i=0; i+HEADER_SPACING<token_size; i++) tbl_value[i] = e_token[i+HEADER_SPACING];
+        tbl_key[index_of] = '\0';
+        tbl_value[i] = '\0';
+        l_pushtablestring(L, tbl_key, tbl_value);
+      }
+    }
+    single_header += header_size;
   }
-  lua_settable(L, -3);
 }
 
 /**
@@ -70,14 +150,151 @@ int generate_response(lua_State* L, request_handler* handler)
     lua_newtable(L);  
     l_pushtablestring(L, "url",             handler->requests[i].url.ptr);
     l_pushtablenumber(L, "response_status", (double)handler->requests[i].response_status);
-    l_pushtablestring(L, "response_body",   handler->requests[i].response_body.ptr);
+
+    /* DECODED BODIES ARE BUILT RIGHT FROM THE TAPE, THE RAW BODY IS ONLY PUSHED WHEN ASKED FOR (OR UNDECODABLE) */
+    decode_response(&handler->requests[i]);
+    if (handler->requests[i].json != NULL) {
+      lua_pushstring(L, "response_json");
+      l_pushjson(L, &handler->requests[i]);
+      lua_settable(L, -3);
+    }
+    if (handler->requests[i].json == NULL || handler->requests[i].keep_body)
+      l_pushtablelstring(L, "response_body", handler->requests[i].response_body.ptr, handler->requests[i].response_body.len);
+    else l_pushtablestring(L, "response_body", "");
+    if (handler->requests[i].decode != DECODE_NONE)
+      l_pushtablestring(L, "decode_error", handler->requests[i].decode_error);
     l_pushheaders(L,     "response_headers",handler->requests[i].response_headers.ptr);
     l_pushtablestring(L, "response_error",  handler->requests[i].response_err);
+    l_pushtablestring(L, "response_state",  (char*)request_state_name(handler->requests[i].state));
+    l_pushtablenumber(L, "queue_time",      handler->requests[i].queue_time);
+    l_pushtablenumber(L, "total_time",      handler->requests[i].total_time);
+    l_pushtablestring(L, "cache_status",    (char*)cache_status_name(handler->requests[i].cache_status));
+    l_pushtablenumber(L, "ranges",          (double)handler->requests[i].parts_count);
+    if (is_upstream_url(handler->requests[i].url.ptr))
+      l_pushtablestring(L, "endpoint", handler->requests[i].endpoint_url);
+    lua_settable(L, -3);
+  }
+  return 1;
+}
+
+/**
+ * :l_pushcolumn
+ * Pushes a single column value of a request, returns 0 when the
+ * request has no value there (the column keeps a hole)
+ */
+static int l_pushcolumn(lua_State* L, request* request, size_t column)
+{
+  switch (column)
+  {
+    case COLUMN_NAMES:        lua_pushlstring(L, request->request_key.ptr, request->request_key.len); break;
+    case COLUMN_URL:          lua_pushstring(L, request->url.ptr); break;
+    case COLUMN_STATUS:       lua_pushnumber(L, (lua_Number)request->response_status); break;
+    case COLUMN_HEADERS:      l_pushheaderstable(L, request->response_headers.ptr); break;
+    case COLUMN_ERROR:        lua_pushstring(L, request->response_err); break;
+    case COLUMN_STATE:        lua_pushstring(L, request_state_name(request->state)); break;
+    case COLUMN_QUEUE_TIME:   lua_pushnumber(L, request->queue_time); break;
+    case COLUMN_TOTAL_TIME:   lua_pushnumber(L, request->total_time); break;
+    case COLUMN_CACHE_STATUS: lua_pushstring(L, cache_status_name(request->cache_status)); break;
+    case COLUMN_RANGES:       lua_pushnumber(L, (lua_Number)request->parts_count); break;
+
+    case COLUMN_BODY:
+      if (request->json == NULL || request->keep_body)
+        lua_pushlstring(L, request->response_body.ptr, request->response_body.len);
+      else lua_pushstring(L, "");
+      break;
+
+    case COLUMN_JSON:
+      if (request->json == NULL) return 0;
+      l_pushjson(L, request);
+      break;
+
+    case COLUMN_DECODE_ERROR:
+      if (request->decode == DECODE_NONE) return 0;
+      lua_pushstring(L, request->decode_error);
+      break;
+
+    case COLUMN_ENDPOINT:
+      if (!is_upstream_url(request->url.ptr)) return 0;
+      lua_pushstring(L, request->endpoint_url);
+      break;
+
+    default: return 0;
+  }
+  return 1;
+}
+
+/**
+ * :generate_columnar_response
+ * Pushes the responses back to lua as parallel arrays (result_format = "columnar"),
+ * one preallocated array per requested column, in the requests order:
+ * no table per response, and requests sharing a name are all kept.
+ */
+int generate_columnar_response(lua_State* L, request_handler* handler)
+{
+  size_t i, column;
+
+  /* DECODED ONCE, BOTH THE BODY AND THE JSON COLUMNS DEPEND ON IT */
+  for (i=0; i<handler->count; i++) decode_response(&handler->requests[i]);
+
+  lua_createtable(L, 0, COLUMNS_COUNT + 1);
+  l_pushtablenumber(L, "count", (double)handler->count);
+  for (column=0; column<COLUMNS_COUNT; column++)
+  {
+    if (!(handler->options.columns & (1u << column))) continue;
+    lua_pushstring(L, column_names[column]);
+    lua_createtable(L, (int)handler->count, 0);
+    for (i=0; i<handler->count; i++) {
+      if (!l_pushcolumn(L, &handler->requests[i], column)) continue;
+      lua_rawseti(L, -2, (int)i+1);
+    }
     lua_settable(L, -3);
   }
   return 1;
 }
 
+/**
+ * :request_state_name
+ * Simply returns the lua name of a request state
+ */
+const char* request_state_name(int state)
+{
+  switch (state)
+  {
+    case REQUEST_PENDING:   return "pending";
+    case REQUEST_RUNNING:   return "running";
+    case REQUEST_DONE:      return "done";
+    case REQUEST_CANCELLED: return "cancelled";
+    case REQUEST_DEADLINE_EXCEEDED: return "deadline_exceeded";
+    case REQUEST_CIRCUIT_OPEN: return "circuit_open";
+  }
+  return "unknown";
+}
+
+/**
+ * :generate_stats
+ * Pushes the batch counters back to lua
+ */
+int generate_stats(lua_State* L, request_handler* handler)
+{
+  lua_newtable(L);
+  l_pushtablenumber(L, "requests",  (double)handler->count);
+  l_pushtablenumber(L, "completed", (double)handler->stats.completed);
+  l_pushtablenumber(L, "succeeded", (double)handler->stats.succeeded);
+  l_pushtablenumber(L, "cancelled", (double)handler->stats.cancelled);
+  l_pushtablenumber(L, "deadline_exceeded", (double)handler->stats.deadline_exceeded);
+  l_pushtablenumber(L, "circuit_open", (double)handler->stats.circuit_open);
+  l_pushtablenumber(L, "coalesced", (double)handler->stats.coalesced);
+  l_pushtablenumber(L, "cache_hits", (double)handler->stats.cache_hits);
+  l_pushtablenumber(L, "cache_misses", (double)handler->stats.cache_misses);
+  l_pushtablenumber(L, "cache_revalidated", (double)handler->stats.cache_revalidated);
+  l_pushtablenumber(L, "threads", (double)handler->stats.threads);
+  l_pushtablenumber(L, "stolen", (double)handler->stats.stolen);
+  lua_pushstring(L, "wait_met");
+  lua_pushboolean(L, handler->stats.wait_met);
+  lua_settable(L, -3);
+  return 1;
+}
+
 /**
  * :init_requests
  * Initiating each request initial data
@@ -90,7 +307,7 @@ int init_requests(request_handler* handler)
 
   for (i=0; i<total_requests; i++)
   {
-    handler->requests[i].timeout              = DEFAULT_REQUEST_TIMEOUT;
+    handler->requests[i].timeout              = DEFAULT_REQUEST_TIMEOUT * MILLISECONDS;
     handler->requests[i].debug                =
     handler->requests[i].expectations         =
     handler->requests[i].verify_host          =
@@ -98,6 +315,45 @@ int init_requests(request_handler* handler)
     handler->requests[i].verify_peer          = 1;
     handler->requests[i].response_err[0]      = '\0';
     handler->requests[i].read_cb_ptr          = NULL;
+    handler->requests[i].resolve_slist        = NULL;
+    handler->requests[i].easy                 = NULL;
+    handler->requests[i].result               = CURLE_OK;
+    handler->requests[i].state                = REQUEST_PENDING;
+    handler->requests[i].priority             = 0;
+    handler->requests[i].host_index           = 0;
+    handler->requests[i].shard                = 0;
+    handler->requests[i].queue_time           = 0;
+    handler->requests[i].total_time           = 0;
+    handler->requests[i].connect_timeout      = 0;
+    handler->requests[i].breaker_probe        = 0;
+    handler->requests[i].upstream             =
+    handler->requests[i].endpoint             = SCHEDULER_NONE;
+    handler->requests[i].endpoint_held        = 0;
+    handler->requests[i].endpoint_url[0]      = '\0';
+    handler->requests[i].leader               =
+    handler->requests[i].next_follower        = SCHEDULER_NONE;
+    handler->requests[i].shared_response      = 0;
+    handler->requests[i].cached               = NULL;
+    handler->requests[i].cache_status         = CACHE_NONE;
+    handler->requests[i].cache_meta.max_age   = -1;
+    handler->requests[i].cache_meta.no_store  =
+    handler->requests[i].cache_meta.no_cache  =
+    handler->requests[i].cache_meta.is_public =
+    handler->requests[i].cache_meta.accept_ranges = 0;
+    handler->requests[i].parallel_ranges      = 0;
+    handler->requests[i].range_chunk_min      = DEFAULT_RANGE_CHUNK_MIN;
+    handler->requests[i].range_phase          = RANGE_NONE;
+    handler->requests[i].parts                = NULL;
+    handler->requests[i].parts_count          =
+    handler->requests[i].parts_running        = 0;
+    handler->requests[i].output_fd            = -1;
+    handler->requests[i].decode               = DECODE_NONE;
+    handler->requests[i].keep_body            = 0;
+    handler->requests[i].json                 = NULL;
+    handler->requests[i].decode_error[0]      = '\0';
+    handler->requests[i].cache_meta.etag[0]   =
+    handler->requests[i].cache_meta.last_modified[0] =
+    handler->requests[i].cache_meta.vary[0]   = '\0';
 
     init_string(&handler->requests[i].request_key);
     init_string(&handler->requests[i].url);
@@ -110,6 +366,8 @@ int init_requests(request_handler* handler)
     init_string(&handler->requests[i].ca_path);
     init_string(&handler->requests[i].key_path);
     init_string(&handler->requests[i].password);
+    init_string(&handler->requests[i].output_file);
+    init_string(&handler->requests[i].target_url);
   }
   return 1;
 }
@@ -133,6 +391,16 @@ void set_request_integers(request* request, const char* key, lua_Number number)
     request->verify_host = i_value;
   else if (strcmp(key, "timeout") == 0)
     request->timeout = (long)(((number > 0) ? number : DEFAULT_REQUEST_TIMEOUT) * MILLISECONDS);                /* 8 seconds timeout by default   */
+  else if (strcmp(key, "priority") == 0)
+    request->priority = i_value;
+  else if (strcmp(key, "connect_timeout") == 0)
+    request->connect_timeout = (number > 0) ? (long)(number * MILLISECONDS) : 0;
+  else if (strcmp(key, "parallel_ranges") == 0)
+    request->parallel_ranges = (l_value > 1) ? l_value : 0;
+  else if (strcmp(key, "range_chunk_min") == 0)
+    request->range_chunk_min = (l_value > 0) ? l_value : DEFAULT_RANGE_CHUNK_MIN;
+  else if (strcmp(key, "keep_body") == 0)
+    request->keep_body = i_value;
 }
 
 /**
@@ -160,6 +428,10 @@ void set_request_data(request* request, const char* key, const char* s_value)
     memcpy_string(s_value, &request->key_path);
   else if (strcmp(key, "password") == 0) 
     memcpy_string(s_value, &request->password);
+  else if (strcmp(key, "output_file") == 0) 
+    memcpy_string(s_value, &request->output_file);
+  else if (strcmp(key, "decode") == 0) 
+    request->decode = (strcmp(s_value, "json") == 0) ? DECODE_JSON : DECODE_NONE;
 }
 
 /**
@@ -212,6 +484,409 @@ int set_request_headers(request* request, const char* key, lua_State* L)
   return 1;
 }
 
+/**
+ * :l_tobool
+ * Reads a flag, either a lua boolean or a (1|0) number
+ */
+int l_tobool(lua_State* L, int index)
+{
+  if (lua_type(L, index) == LUA_TNUMBER) return lua_tonumber(L, index) != 0;
+  return lua_toboolean(L, index);
+}
+
+/**
+ * :l_toudata
+ * Returns the userdata at 'index' when it's of the 'tname' metatable, NULL otherwise
+ */
+void* l_toudata(lua_State* L, int index, const char* tname)
+{
+  void* udata = lua_touserdata(L, index);
+  if (udata == NULL || !lua_getmetatable(L, index)) return NULL;
+  luaL_getmetatable(L, tname);
+  if (!lua_rawequal(L, -1, -2)) udata = NULL;
+  lua_pop(L, 2);
+  return udata;
+}
+
+/**
+ * :l_getnumber
+ * Reads the number field 'key' of the table at 'index' into 'value', when set and >= 'min'
+ */
+static void l_getnumber(lua_State* L, int index, const char* key, double min, double* value)
+{
+  lua_getfield(L, index, key);
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= min) *value = lua_tonumber(L, -1);
+  lua_pop(L, 1);
+}
+
+/**
+ * :l_tohostpolicy
+ * Reads the rate limit ({rate, burst}) and circuit breaker ({failures, error_rate,
+ * min_requests, window_ms, open_ms, half_open_max}) options of the table at 'index'.
+ * Missing options keep their 'policy' value, an off breaker starts from the defaults.
+ */
+void l_tohostpolicy(lua_State* L, int index, host_policy* policy)
+{
+  double value;
+
+  lua_getfield(L, index, "rate_limit");
+  if (lua_istable(L, -1)) {
+    l_getnumber(L, -1, "rate", 0, &policy->rate);
+    policy->burst = (policy->rate > 1) ? policy->rate : 1;
+    l_getnumber(L, -1, "burst", 1, &policy->burst);
+  }
+  else if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1)) policy->rate = 0;
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "breaker");
+  if (lua_istable(L, -1)) {
+    /* A BREAKER TABLE TURNS AN OFF BREAKER ON: 5 CONSECUTIVE FAILURES OR A 50% ERROR RATE */
+    if (policy->failure_threshold == 0 && policy->error_rate == 0) {
+      policy->failure_threshold = DEFAULT_BREAKER_FAILURES;
+      policy->error_rate        = DEFAULT_BREAKER_ERROR_RATE;
+    }
+    value = (double)policy->failure_threshold;
+    l_getnumber(L, -1, "failures", 0, &value);
+    policy->failure_threshold = (size_t)value;
+
+    l_getnumber(L, -1, "error_rate", 0, &policy->error_rate);
+
+    value = (double)policy->min_requests;
+    l_getnumber(L, -1, "min_requests", 1, &value);
+    policy->min_requests = (size_t)value;
+
+    value = (double)policy->window_ms;
+    l_getnumber(L, -1, "window_ms", 1, &value);
+    policy->window_ms = (long)value;
+
+    value = (double)policy->open_ms;
+    l_getnumber(L, -1, "open_ms", 0, &value);
+    policy->open_ms = (long)value;
+
+    value = (double)policy->half_open_max;
+    l_getnumber(L, -1, "half_open_max", 1, &value);
+    policy->half_open_max = (size_t)value;
+  }
+  else if (lua_type(L, -1) == LUA_TBOOLEAN && !lua_toboolean(L, -1)) {
+    policy->failure_threshold = 0;
+    policy->error_rate = 0;
+  }
+  lua_pop(L, 1);
+}
+
+/**
+ * :l_pushhoststate
+ * Pushes a host rate limit / circuit breaker state as a lua table
+ */
+void l_pushhoststate(lua_State* L, host_state* state)
+{
+  refresh_breaker(state, monotonic_ms());
+
+  lua_newtable(L);
+  l_pushtablestring(L, "host", state->host);
+  l_pushtablestring(L, "state", (char*)breaker_state_name(state->breaker));
+  l_pushtablenumber(L, "consecutive_failures", (double)state->consecutive_failures);
+  l_pushtablenumber(L, "window_requests", (double)state->window_requests);
+  l_pushtablenumber(L, "window_failures", (double)state->window_failures);
+  l_pushtablenumber(L, "requests", (double)state->requests);
+  l_pushtablenumber(L, "failures", (double)state->failures);
+  l_pushtablenumber(L, "rejected", (double)state->rejected);
+  if (state->policy.rate > 0) l_pushtablenumber(L, "tokens", state->tokens);
+}
+
+/**
+ * :l_toupstreampolicy
+ * Reads the upstream pool options ({ewma_weight, eject_failures, eject_ms,
+ * max_ejected_percent}) of the table at 'index'. Missing options keep their 'policy' value.
+ */
+void l_toupstreampolicy(lua_State* L, int index, upstream_policy* policy)
+{
+  double value;
+
+  l_getnumber(L, index, "ewma_weight", 0, &policy->ewma_weight);
+  if (policy->ewma_weight <= 0 || policy->ewma_weight > 1) policy->ewma_weight = DEFAULT_EWMA_WEIGHT;
+
+  value = (double)policy->eject_failures;
+  l_getnumber(L, index, "eject_failures", 0, &value);
+  policy->eject_failures = (size_t)value;
+
+  value = (double)policy->eject_ms;
+  l_getnumber(L, index, "eject_ms", 0, &value);
+  policy->eject_ms = (long)value;
+
+  l_getnumber(L, index, "max_ejected_percent", 0, &policy->max_ejected_percent);
+  if (policy->max_ejected_percent > 100) policy->max_ejected_percent = 100;
+}
+
+/**
+ * :l_pushupstream
+ * Pushes an upstream pool state as a lua table, an entry per endpoint
+ */
+void l_pushupstream(lua_State* L, upstream* pool)
+{
+  upstream_endpoint* endpoint;
+  double now = monotonic_ms();
+  size_t i;
+
+  lua_createtable(L, (int)pool->count, 0);
+  for (i=0; i<pool->count; i++) {
+    endpoint = &pool->endpoints[i];
+    lua_newtable(L);
+    l_pushtablestring(L, "url", endpoint->url);
+    l_pushtablenumber(L, "in_flight", (double)endpoint->in_flight);
+    l_pushtablenumber(L, "ewma_ms", endpoint->ewma_ms);
+    l_pushtablenumber(L, "consecutive_failures", (double)endpoint->consecutive_failures);
+    l_pushtablenumber(L, "ejections", (double)endpoint->ejections);
+    l_pushtablenumber(L, "requests", (double)endpoint->requests);
+    l_pushtablenumber(L, "failures", (double)endpoint->failures);
+    lua_pushstring(L, "ejected");
+    lua_pushboolean(L, endpoint->ejected_until > now);
+    lua_settable(L, -3);
+    lua_rawseti(L, -2, (int)i+1);
+  }
+}
+
+/**
+ * :l_drain_log
+ * Hands the queued log records to the lua sink function (set by async.set_logger),
+ * on the lua thread. Only the lua state that set the sink drains it, the records
+ * of every lua state go there. A failing sink function is ignored.
+ */
+void l_drain_log(lua_State* L)
+{
+  log_record record;
+
+  if (!logger_owns_lua_sink(get_context(L))) return;
+  lua_getfield(L, LUA_REGISTRYINDEX, LOG_CALLBACK_KEY);
+  if (!lua_isfunction(L, -1)) {
+    lua_pop(L, 1);
+    return;
+  }
+
+  while (logger_pop(&record)) {
+    lua_pushvalue(L, -1);
+    lua_newtable(L);
+    l_pushtablestring(L, "level", (char*)level_name(record.level));
+    l_pushtablenumber(L, "time", record.time / MILLISECONDS);
+    l_pushtablestring(L, "func", record.func);
+    l_pushtablestring(L, "request", record.name);
+    l_pushtablestring(L, "url", record.url);
+    l_pushtablestring(L, "message", record.message);
+    if (lua_pcall(L, 1, 0, 0) != 0) lua_pop(L, 1);
+    logger_record_written();
+  }
+  lua_pop(L, 1);
+}
+
+/**
+ * :l_toslist
+ * Converts a lua array of strings into a libcurl linked list
+ */
+struct curl_slist* l_toslist(lua_State* L, int index)
+{
+  struct curl_slist* list = NULL;
+  size_t i, count;
+
+  if (!lua_istable(L, index)) return NULL;
+  count = lua_objlen(L, index);
+  for (i=1; i<=count; i++) {
+    lua_rawgeti(L, index, (int)i);
+    if (lua_type(L, -1) == LUA_TSTRING)
+      list = curl_slist_append(list, lua_tostring(L, -1));
+    lua_pop(L, 1);
+  }
+  return list;
+}
+
+/**
+ * :set_success_statuses
+ * Reads the success statuses list at the top of the stack,
+ * each item is either an exact status (200) or a class ("2xx").
+ */
+static void set_success_statuses(lua_State* L, batch_options* options)
+{
+  size_t i, count;
+  const char* status_class;
+
+  if (!lua_istable(L, -1)) return;
+  count = lua_objlen(L, -1);
+  for (i=1; i<=count; i++) {
+    lua_rawgeti(L, -1, (int)i);
+    if (lua_type(L, -1) == LUA_TNUMBER && options->success_codes_count < MAX_SUCCESS_CODES)
+      options->success_codes[options->success_codes_count++] = (long)lua_tonumber(L, -1);
+    else if (lua_type(L, -1) == LUA_TSTRING) {
+      status_class = lua_tostring(L, -1);
+      if (strlen(status_class) == 3 && isdigit(status_class[0]) && tolower(status_class[1]) == 'x' && tolower(status_class[2]) == 'x')
+        options->success_classes |= 1u << (status_class[0] - '0');
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/**
+ * :set_result_columns
+ * Reads the columnar result columns list at the top of the stack (all columns by default)
+ */
+static void set_result_columns(lua_State* L, batch_options* options)
+{
+  size_t i, count, column;
+  const char* name;
+
+  if (!lua_istable(L, -1)) return;
+  options->columns = 0;
+  count = lua_objlen(L, -1);
+  for (i=1; i<=count; i++) {
+    lua_rawgeti(L, -1, (int)i);
+    if ((name = lua_tostring(L, -1)) != NULL) {
+      for (column=0; column<COLUMNS_COUNT; column++)
+        if (strcmp(name, column_names[column]) == 0) options->columns |= 1u << column;
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/**
+ * :set_host_weights
+ * Reads the hosts weights table at the top of the stack ({["host"] = weight})
+ */
+static void set_host_weights(lua_State* L, batch_options* options)
+{
+  size_t count = 0;
+
+  if (!lua_istable(L, -1)) return;
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    count++;
+    lua_pop(L, 1);
+  }
+  if (count == 0) return;
+
+  options->host_weights = (host_weight*) malloc(sizeof(host_weight) * count);
+  if (options->host_weights == NULL) return;
+
+  lua_pushnil(L);
+  while (lua_next(L, -2) != 0) {
+    if (lua_type(L, -2) == LUA_TSTRING && lua_type(L, -1) == LUA_TNUMBER &&
+        lua_tonumber(L, -1) >= 1 && lua_objlen(L, -2) < DNS_HOST_SZ) {
+      host_weight* weight = &options->host_weights[options->host_weights_count++];
+      const char* host = lua_tostring(L, -2);
+      size_t i;
+      for (i=0; host[i] != '\0'; i++) weight->host[i] = tolower(host[i]);
+      weight->host[i] = '\0';
+      weight->weight = (long)lua_tonumber(L, -1);
+    }
+    lua_pop(L, 1);
+  }
+}
+
+/**
+ * :default_batch_options
+ * The batch options defaults (no options table)
+ */
+void default_batch_options(batch_options* options)
+{
+  options->cancel             = NULL;
+  options->deadline_ms        = 0;
+  options->concurrency        = DEFAULT_MAX;
+  options->wait               = WAIT_ALL;
+  options->quorum             = 0;
+  options->success_codes_count = 0;
+  options->success_classes    = 0;
+  options->resolve            = NULL;
+  options->dns_cache_timeout  = -1;
+  options->prefetch_dns       = 0;
+  options->max_per_host       = 0;
+  options->host_weights       = NULL;
+  options->host_weights_count = 0;
+  options->coalesce           = 0;
+  options->coalesce_headers   = NULL;
+  options->cache              = 0;
+  options->threads            = 1;
+  options->preconnect         = 0;
+  options->result_format      = RESULT_ROWS;
+  options->columns            = ALL_COLUMNS;
+}
+
+/**
+ * :batch_options_processor
+ * Reads the (optional) batch options table at 'index'
+ */
+void batch_options_processor(lua_State* L, int index, batch_options* options)
+{
+  default_batch_options(options);
+  if (!lua_istable(L, index)) return;
+
+  lua_getfield(L, index, "deadline_ms");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) > 0) options->deadline_ms = (long)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  /* THE TOKEN USERDATA STAYS REFERENCED BY THE OPTIONS TABLE (KEPT ON THE STACK) */
+  lua_getfield(L, index, "cancel");
+  options->cancel = (cancel_token*) l_toudata(L, -1, CANCEL_TOKEN_MT);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "concurrency");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) options->concurrency = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "threads");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) options->threads = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "wait");
+  if (lua_type(L, -1) == LUA_TSTRING) {
+    if      (strcmp(lua_tostring(L, -1), "any") == 0)    options->wait = WAIT_ANY;
+    else if (strcmp(lua_tostring(L, -1), "quorum") == 0) options->wait = WAIT_QUORUM;
+  }
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "k");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) options->quorum = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "success");
+  set_success_statuses(L, options);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "max_per_host");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 1) options->max_per_host = (size_t)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "host_weights");
+  set_host_weights(L, options);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "resolve");
+  options->resolve = l_toslist(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "dns_cache_timeout");
+  if (lua_type(L, -1) == LUA_TNUMBER && lua_tonumber(L, -1) >= 0) options->dns_cache_timeout = (long)lua_tonumber(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "prefetch_dns");
+  options->prefetch_dns = l_tobool(L, -1);
+  lua_pop(L, 1);
+
+  /* EITHER A FLAG, OR THE HEADER NAMES TELLING IDENTICAL REQUESTS APART */
+  lua_getfield(L, index, "coalesce");
+  options->coalesce = lua_istable(L, -1) || l_tobool(L, -1);
+  options->coalesce_headers = l_toslist(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "cache");
+  options->cache = l_tobool(L, -1);
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "result_format");
+  if (lua_type(L, -1) == LUA_TSTRING && strcmp(lua_tostring(L, -1), "columnar") == 0) options->result_format = RESULT_COLUMNAR;
+  lua_pop(L, 1);
+
+  lua_getfield(L, index, "columns");
+  set_result_columns(L, options);
+  lua_pop(L, 1);
+}
+
 /**
  * @request_handler
  * gets and initiates the request handler by lua params from lua to C
@@ -223,9 +898,23 @@ request_handler* request_processor(lua_State* L)
   request_handler* handler = (request_handler*) malloc(sizeof(request_handler));
   if (handler == NULL) return NULL;
 
+  handler->count    = 0;
+  handler->requests = NULL;
+  handler->context  = get_context(L);
+  handler->deadline = 0;
+  memset(&handler->stats, 0, sizeof(batch_stats));
+  batch_options_processor(L, 2, &handler->options);
+  if (handler->context == NULL) {
+    free_request_handler(handler);
+    return NULL;
+  }
+
   if (lua_istable(L, 1)) {
-    handler->count = lua_objlen(L, -1);                            /* sets the total requests */
+    handler->count = lua_objlen(L, 1);                             /* sets the total requests */
     if (!init_requests(handler)) return NULL;
+
+    /* QUORUM DEFAULTS TO THE BATCH MAJORITY */
+    if (handler->options.quorum == 0) handler->options.quorum = handler->count / 2 + 1;
     
     lua_pushnil(L);
     while (lua_next(L, 1) != 0) {
@@ -238,10 +927,13 @@ request_handler* request_processor(lua_State* L)
             
             switch (lua_type(L, -1)) {                             /* switching on values     */
               case LUA_TNUMBER:
-              case LUA_TBOOLEAN:
                 set_request_integers(&handler->requests[index], key, luaL_checknumber(L, -1));
               break;
 
+              case LUA_TBOOLEAN:
+                set_request_integers(&handler->requests[index], key, (lua_Number)lua_toboolean(L, -1));
+              break;
+
               case LUA_TSTRING:
                 set_request_data(&handler->requests[index], key, luaL_checkstring(L, -1));
               break;
@@ -259,10 +951,122 @@ request_handler* request_processor(lua_State* L)
       lua_pop(L, 1);
     }
   }
-  lua_settop(L, 0);  // clean stack, just to keep things lighter
+  lua_settop(L, 2);  // clean stack, just to keep things lighter (the batch options stay referenced)
   return handler;
 }
 
+/**
+ * :preconnect_processor
+ * Builds a request handler out of preconnect params (urls, options):
+ * 'connections' HEAD requests per url, all started at once so each
+ * one opens its own connection. The options are the request ssl/timeout
+ * keys, so the warm connections match the later requests settings.
+ * They always run on the context multi handle (shard 0), 'threads' is ignored.
+ **/
+request_handler* preconnect_processor(lua_State* L, size_t connections)
+{
+  size_t total_urls, i, j;
+  const char *key, *url;
+  request_handler* handler = (request_handler*) malloc(sizeof(request_handler));
+  if (handler == NULL) return NULL;
+
+  handler->context = get_context(L);
+  handler->deadline = 0;
+  memset(&handler->stats, 0, sizeof(batch_stats));
+  batch_options_processor(L, 2, &handler->options);
+  handler->options.wait = WAIT_ALL;
+  handler->options.coalesce   = 0;                                 /* EACH HEAD OPENS ITS OWN CONNECTION */
+  handler->options.cache      = 0;
+  handler->options.threads    = 1;                                 /* THE CONTEXT MULTI HANDLE, THE ONE LATER BATCHES START ON */
+  handler->options.preconnect = 1;
+  total_urls = lua_objlen(L, 1);
+  handler->count = total_urls * connections;
+  handler->options.concurrency = (handler->count > 0) ? handler->count : 1;
+  if (handler->context == NULL || handler->count == 0 || !init_requests(handler)) {
+    handler->count = 0;
+    handler->requests = NULL;
+    free_request_handler(handler);
+    return NULL;
+  }
+
+  for (i=0; i<total_urls; i++) {
+    lua_rawgeti(L, 1, (int)i+1);
+    url = lua_tostring(L, -1);
+    for (j=0; j<connections; j++) {
+      memcpy_string((url != NULL) ? url : "", &handler->requests[i*connections + j].url);
+      memcpy_string((url != NULL) ? url : "", &handler->requests[i*connections + j].request_key);
+      memcpy_string("HEAD", &handler->requests[i*connections + j].request_method);
+    }
+    lua_pop(L, 1);
+  }
+
+  if (!lua_istable(L, 2)) return handler;
+
+  lua_pushnil(L);
+  while (lua_next(L, 2) != 0) {
+    key = (lua_type(L, -2) == LUA_TSTRING) ? lua_tostring(L, -2) : NULL;
+
+    /* THE REQUEST IDENTITY ISN'T CONFIGURABLE */
+    if (key == NULL || strcmp(key, "name") == 0 || strcmp(key, "url") == 0 || strcmp(key, "method") == 0 ||
+        strcmp(key, "data") == 0 || strcmp(key, "post_params") == 0) {
+      lua_pop(L, 1);
+      continue;
+    }
+
+    for (i=0; i<handler->count; i++) {
+      switch (lua_type(L, -1)) {
+        case LUA_TNUMBER:
+        case LUA_TBOOLEAN:
+          set_request_integers(&handler->requests[i], key, (lua_type(L, -1) == LUA_TBOOLEAN) ? 
+                                                              l_tobool(L, -1) : lua_tonumber(L, -1));
+        break;
+
+        case LUA_TSTRING:
+          set_request_data(&handler->requests[i], key, lua_tostring(L, -1));
+        break;
+      }
+    }
+    lua_pop(L, 1);
+  }
+  return handler;
+}
+
+/**
+ * :generate_preconnect_response
+ * Pushes the preconnect results back to lua, keyed by url:
+ * how many connections were established out of the requested ones.
+ */
+int generate_preconnect_response(lua_State* L, request_handler* handler, size_t connections)
+{
+  size_t i, j, connected;
+  const char* first_error;
+  request* request;
+
+  lua_newtable(L);
+  for (i=0; i<handler->count; i+=connections)
+  {
+    connected = 0;
+    first_error = "";
+    for (j=i; j<i+connections; j++) {
+      request = &handler->requests[j];
+      if (request->result == CURLE_OK) connected++;
+      else if (is_empty(first_error))
+        first_error = is_empty(request->response_err) ? curl_easy_strerror(request->result) : request->response_err;
+    }
+
+    lua_pushstring(L, handler->requests[i].url.ptr);
+    lua_newtable(L);
+    lua_pushstring(L, "ok");
+    lua_pushboolean(L, connected > 0);
+    lua_settable(L, -3);
+    l_pushtablenumber(L, "connected", (double)connected);
+    l_pushtablenumber(L, "requested", (double)connections);
+    l_pushtablestring(L, "error", (char*)first_error);
+    lua_settable(L, -3);
+  }
+  return 1;
+}
+
 /**
  * :free_request_handler
  * Simply freeing all request_handler object
@@ -276,9 +1080,12 @@ void free_request_handler(request_handler* handler)
   for (i=0; i<handler->count; i++)
   {
     free(handler->requests[i].url.ptr);
+    free(handler->requests[i].target_url.ptr);
     free(handler->requests[i].request_key.ptr);
-    free(handler->requests[i].response_body.ptr);
-    free(handler->requests[i].response_headers.ptr);
+    if (!handler->requests[i].shared_response) {
+      free(handler->requests[i].response_body.ptr);
+      free(handler->requests[i].response_headers.ptr);
+    }
     
     free(handler->requests[i].request_method.ptr);
     free(handler->requests[i].post_params.ptr);
@@ -286,11 +1093,19 @@ void free_request_handler(request_handler* handler)
     if (handler->requests[i].read_cb_ptr != NULL)
       free(handler->requests[i].read_cb_ptr);
 
+    curl_slist_free_all(handler->requests[i].resolve_slist);
+    cache_release(&handler->requests[i]);
+
     free(handler->requests[i].certificate_path.ptr);
     free(handler->requests[i].ca_path.ptr);
     free(handler->requests[i].key_path.ptr);
     free(handler->requests[i].password.ptr);
 
+    /* FLUSHES THE DOWNLOADED FILE BEFORE LUA GETS THE RESPONSE */
+    close_output_file(&handler->requests[i]);
+    free(handler->requests[i].output_file.ptr);
+    free_json(handler->requests[i].json);
+
     /* FREE HEADERS */
     if (handler->requests[i].header_fields.count > 0)
     {
@@ -300,6 +1115,9 @@ void free_request_handler(request_handler* handler)
     }
   }
 
+  curl_slist_free_all(handler->options.resolve);
+  curl_slist_free_all(handler->options.coalesce_headers);
+  free(handler->options.host_weights);
   free(handler->requests);
   free(handler);
 }
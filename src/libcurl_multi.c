@@ -95,6 +95,9 @@ struct curl_slist* define_request_headers(CURL *eh, request* request)
 
   for (header_index=0; header_index<request->header_fields.count; header_index++)
     libcurl_headers = curl_slist_append(libcurl_headers, request->header_fields.headers[header_index].ptr);
+
+  /* REVALIDATING A STALE CACHE ENTRY */
+  libcurl_headers = define_cache_headers(libcurl_headers, request);
   
   if (!method_post(request->request_method.ptr) && !method_put(request->request_method.ptr))
     return libcurl_headers;  
@@ -111,29 +114,85 @@ struct curl_slist* define_request_headers(CURL *eh, request* request)
 }
 
 /**
- * :init_curl_handle
- * Initiates each handle with his own settings. 
- * After that, we're adding this handle to the multi handle
- * for farther processing.
+ * :remaining_ms
+ * Milliseconds left until the batch deadline, -1 when there's no deadline.
  */
-void init_curl_handle(CURLM *cm, int i, request* requests)
+static long remaining_ms(request_handler* handler)
 {
-  CURL *eh = curl_easy_init();
-  request* request = &requests[i];
-  struct curl_slist* libcurl_headers = NULL;
+  double remaining;
+  if (handler->deadline <= 0) return -1;
+  remaining = handler->deadline - monotonic_ms();
+  return (remaining > 0) ? (long)remaining : 0;
+}
+
+/**
+ * :setup_transfer
+ * Sets the options every transfer of a request shares
+ * (ssl, redirections, timeouts and dns), download parts included.
+ */
+void setup_transfer(CURL *eh, request_handler* handler, request* request)
+{
+  long remaining;
 
-  curl_easy_setopt(eh, CURLOPT_HEADER, 0L);
-  curl_easy_setopt(eh, CURLOPT_URL, request->url.ptr);
-  curl_easy_setopt(eh, CURLOPT_PRIVATE, request);
-  
   if (request->debug)
     curl_easy_setopt(eh, CURLOPT_VERBOSE, 2L);
   
   /**
    * SSL CONFIGURATIONS
    */
-  if (is_https(request->url.ptr))
+  if (is_https(request_url(request)))
     setup_ssl_request(eh, request);
+
+  /* TELLS LIBCURL TO FOLLOW REDIRECTION / MAXREDIRS: THE MAX REDIRECTIONS ALLOWED */
+  curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
+  curl_easy_setopt(eh, CURLOPT_MAXREDIRS, 2L);
+
+  /* DISABLE SIGNALS TO USE WITH THREADS */
+  curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1L);
+
+  /* A SINGLE REQUEST TIMEOUT (8 SECONDS DEFAULT), NEVER PAST THE BATCH DEADLINE */
+  remaining = remaining_ms(handler);
+  curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, (remaining > 0 && remaining < request->timeout) ? remaining : request->timeout);
+
+  /* CONNECT TIMEOUT, LIBCURL SPLITS IT BETWEEN THE HOST ADDRESSES TO FAIL OVER */
+  if (request->connect_timeout > 0)
+    curl_easy_setopt(eh, CURLOPT_CONNECTTIMEOUT_MS, request->connect_timeout);
+
+  /* SHARED DNS CACHE (KEPT BETWEEN BATCHES), STATIC OVERRIDES AND WARMED ENTRIES */
+  curl_easy_setopt(eh, CURLOPT_SHARE, handler->context->share);
+  curl_easy_setopt(eh, CURLOPT_DNS_CACHE_TIMEOUT, (handler->options.dns_cache_timeout >= 0) ?
+                                                    handler->options.dns_cache_timeout :
+                                                    handler->context->dns_cache_timeout);
+}
+
+/**
+ * :init_curl_handle
+ * Initiates each handle with his own settings. 
+ * After that, we're adding this handle to the multi handle
+ * for farther processing.
+ * Returns 0 when the request output file can't be opened, no transfer is made.
+ */
+int init_curl_handle(CURLM *cm, request_handler* handler, size_t i)
+{
+  CURL *eh;
+  request* request = &handler->requests[i];
+  struct curl_slist* libcurl_headers = NULL;
+
+  /* A RANGED DOWNLOAD FALLING BACK TO A SINGLE STREAM KEEPS ITS QUEUE TIME */
+  if (request->range_phase != RANGE_SINGLE)
+    request->queue_time = (monotonic_ms() - handler->started_at) / MILLISECONDS;
+
+  /* THE OUTPUT FILE IS OPENED FIRST, A RANGED PROBE HAS NO BODY TO FAIL ITS WRITES */
+  if (!is_empty(request->output_file.ptr) && !open_output_file(request)) return 0;
+
+  eh = curl_easy_init();
+  curl_easy_setopt(eh, CURLOPT_HEADER, 0L);
+  curl_easy_setopt(eh, CURLOPT_URL, request_url(request));
+  curl_easy_setopt(eh, CURLOPT_PRIVATE, request);
+  request->easy = eh;
+  request->state = REQUEST_RUNNING;
+
+  setup_transfer(eh, handler, request);
     
   /* SETUP POST/GET/PUT METHODS */
   if (method_post(request->request_method.ptr))
@@ -142,8 +201,17 @@ void init_curl_handle(CURLM *cm, int i, request* requests)
   else if (method_get(request->request_method.ptr))
     curl_easy_setopt(eh, CURLOPT_HTTPGET, 1L);
 
+  else if (method_head(request->request_method.ptr))
+    curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+
   else if (method_put(request->request_method.ptr))
     setup_put_request(eh, request);
+
+  /* LARGE DOWNLOADS ARE PROBED FIRST (HEAD), THEN SPLIT INTO RANGE PARTS */
+  if (is_ranged(request) && request->range_phase == RANGE_NONE) {
+    request->range_phase = RANGE_PROBE;
+    curl_easy_setopt(eh, CURLOPT_NOBODY, 1L);
+  }
   
   /* SETUP REQUEST HEADERS */
   libcurl_headers = define_request_headers(eh, request);
@@ -152,112 +220,614 @@ void init_curl_handle(CURLM *cm, int i, request* requests)
   /* KEEPING A POINTER TO SLIST, WE FREEING THAT LATER ON */
   request->header_fields.slist = libcurl_headers;
 
-  /* TELLS LIBCURL TO FOLLOW REDIRECTION / MAXREDIRS: THE MAX REDIRECTIONS ALLOWED */
-  curl_easy_setopt(eh, CURLOPT_FOLLOWLOCATION, 1L);
-  curl_easy_setopt(eh, CURLOPT_MAXREDIRS, 2L);
-
-  /* DISABLE SIGNALS TO USE WITH THREADS */
-  curl_easy_setopt(eh, CURLOPT_NOSIGNAL, 1L);
-
-  /* FOR BODY RESPONSE */
-  curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writefunc);
-  curl_easy_setopt(eh, CURLOPT_WRITEDATA, &request->response_body);
+  /* FOR BODY RESPONSE, IN MEMORY OR IN THE OUTPUT FILE */
+  if (!is_empty(request->output_file.ptr)) {
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, output_write);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, request);
+  }
+  else {
+    curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, writefunc);
+    curl_easy_setopt(eh, CURLOPT_WRITEDATA, &request->response_body);
+  }
 
-  /* FOR RESPONSE HEADERS */
-  curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, writefunc);
-  curl_easy_setopt(eh, CURLOPT_HEADERDATA, &request->response_headers);
+  /* FOR RESPONSE HEADERS, THE CACHING HEADERS ARE CAPTURED ON THE WAY */
+  curl_easy_setopt(eh, CURLOPT_HEADERFUNCTION, header_callback);
+  curl_easy_setopt(eh, CURLOPT_HEADERDATA, request);
 
-  /* A SINGLE REQUEST TIMEOUT (8 SECONDS DEFAULT) */
-  curl_easy_setopt(eh, CURLOPT_TIMEOUT_MS, request->timeout);
+  request->resolve_slist = define_request_resolve(handler, request);
+  if (request->resolve_slist != NULL)
+    curl_easy_setopt(eh, CURLOPT_RESOLVE, request->resolve_slist);
   
   /* PROVIDES A BUFFER TO STORE ERRORS IN */
   curl_easy_setopt(eh, CURLOPT_ERRORBUFFER, request->response_err);
 
+  /* A WARM-UP REQUEST NEVER WAITS FOR (OR MULTIPLEXES ON) ANOTHER ONE CONNECTION */
+  if (handler->options.preconnect)
+    curl_easy_setopt(eh, CURLOPT_PIPEWAIT, 0L);
+
   /* ADD NEW REQUEST HANDLE */
   curl_multi_add_handle(cm, eh);
+  log_request(L_DEBUG, "init_curl_handle", request, "started after %.3fs in queue", request->queue_time);
+  return 1;
 }
 
 /**
- * :request_pool
- * Handles the multi handler requests.
- * multi handler waits the whole requests to 
- * complete and updates request_handler->requests objects
- * which will pushed later back to lua.
+ * :release_curl_handle
+ * Removes a request handle (and its download parts) from the multi
+ * handle and frees everything libcurl held for it.
  */
-int request_pool(request_handler* request_handler)
+void release_curl_handle(CURLM *cm, request* request)
 {
-  CURLM *multi_handler = NULL;
-  CURLMsg *msg = NULL;
-  long timeout;
+  release_range_parts(cm, request);
+
+  /* A RANGED DOWNLOAD RELEASED ITS PROBE HANDLE ALREADY, NOT ITS LISTS */
+  if (request->easy != NULL) {
+    curl_multi_remove_handle(cm, request->easy);        /* REMOVING CURRENT LIBCURL EASY HANDLE */
+    curl_easy_cleanup(request->easy);
+    request->easy = NULL;
+  }
+
+  curl_slist_free_all(request->header_fields.slist);    /* FREEING LIBCURL HEADERS LINKED LIST  */
+  curl_slist_free_all(request->resolve_slist);          /* FREEING LIBCURL RESOLVE LINKED LIST  */
+  request->header_fields.slist = NULL;
+  request->resolve_slist = NULL;
+}
+
+/**
+ * :is_success
+ * Checks the request completed with one of the batch success statuses
+ * (an exact status or a status class). Defaults to any 2xx.
+ */
+int is_success(request_handler* handler, request* request)
+{
+  size_t i;
+  long status_class = request->response_status / 100;
+
+  if (request->state != REQUEST_DONE || request->result != CURLE_OK) return 0;
+  if (handler->options.success_codes_count == 0 && handler->options.success_classes == 0)
+    return status_class == 2;
+
+  for (i=0; i<handler->options.success_codes_count; i++)
+    if (handler->options.success_codes[i] == request->response_status) return 1;
+  return status_class >= 0 && status_class < 10 && (handler->options.success_classes & (1u << status_class));
+}
+
+/**
+ * :batch_settled
+ * Checks if the batch wait condition is decided: met (any / quorum successes),
+ * or can't be met anymore by the requests that didn't complete yet.
+ * WAIT_ALL always runs the whole batch.
+ */
+int batch_settled(request_handler* handler)
+{
+  size_t needed, remaining = handler->count - handler->stats.completed - handler->stats.circuit_open;
+
+  if (handler->options.wait == WAIT_ALL) return 0;
+  needed = (handler->options.wait == WAIT_ANY) ? 1 : handler->options.quorum;
+
+  handler->stats.wait_met = (handler->stats.succeeded >= needed);
+  return handler->stats.wait_met || handler->stats.succeeded + remaining < needed;
+}
+
+/**
+ * :owner_scheduler
+ * The scheduler queuing a request: the shard owning its batch index
+ */
+static scheduler* owner_scheduler(request_handler* handler, request* request)
+{
+  return &handler->shards[(size_t)(request - handler->requests) % handler->shards_count].sched;
+}
+
+/**
+ * :batch_queued
+ * Queued requests of every shard (the batch lock held)
+ */
+static size_t batch_queued(request_handler* handler)
+{
+  size_t i, queued = 0;
+  for (i=0; i<handler->shards_count; i++) queued += handler->shards[i].sched.queued;
+  return queued;
+}
+
+/**
+ * :cancel_requests
+ * Ends whatever the batch didn't complete yet with the given state:
+ * queued requests are never started, the shard running handles are removed
+ * from its multi handle and cleaned up immediately. The other shards end
+ * their own running handles once they see the batch stopped.
+ * Called with the batch lock held.
+ */
+void cancel_requests(batch_shard* shard, int state, const char* reason)
+{
+  request_handler* handler = shard->handler;
+  size_t i;
+  request* request;
+
+  if (handler->stop_state == 0) {
+    handler->stop_state  = state;
+    handler->stop_reason = reason;
+  }
+
+  for (i=0; i<handler->count; i++) {
+    request = &handler->requests[i];
+    if (request->state != REQUEST_PENDING && request->state != REQUEST_RUNNING) continue;
+    if (request->state == REQUEST_RUNNING && request->shard != shard->index) continue;
+
+    /* AN ABORTED TRANSFER SAYS NOTHING ABOUT THE HOST HEALTH, IT ONLY FREES A BREAKER PROBE (AND ITS ENDPOINT SLOT) */
+    if (request->state == REQUEST_RUNNING) {
+      host_report(handler->context, request, HOST_ABORTED);
+      upstream_report(handler->context, request, HOST_ABORTED);
+    }
+    cache_release(request);
+    release_curl_handle(shard->multi, request);
+    request->state = state;
+    request->response_status = 0;
+    snprintf(request->response_err, CURL_ERROR_SIZE, "%s", reason);
+    if (state == REQUEST_DEADLINE_EXCEEDED) handler->stats.deadline_exceeded++;
+    else handler->stats.cancelled++;
+  }
+}
+
+/**
+ * :batch_interrupted
+ * Checks whether another shard stopped the batch, the batch cancel token
+ * and deadline, ending every request that didn't complete yet when one of them fired.
+ * Called with the batch lock held.
+ */
+static int batch_interrupted(batch_shard* shard)
+{
+  request_handler* handler = shard->handler;
+
+  if (handler->stop_state != 0) {
+    cancel_requests(shard, handler->stop_state, handler->stop_reason);
+    return 1;
+  }
+  if (handler->options.cancel != NULL && cancel_token_cancelled(handler->options.cancel)) {
+    cancel_requests(shard, REQUEST_CANCELLED, "cancelled by the batch cancel token");
+    return 1;
+  }
+  if (remaining_ms(handler) == 0) {
+    cancel_requests(shard, REQUEST_DEADLINE_EXCEEDED, "batch deadline exceeded");
+    return 1;
+  }
+  return 0;
+}
+
+/**
+ * :reject_request
+ * Fails a request fast since its host circuit breaker is open,
+ * no easy handle is ever created for it.
+ */
+static void reject_request(request_handler* handler, request* request)
+{
+  char host[DNS_HOST_SZ];
+  long port;
+
+  if (!url_host_port(request->url.ptr, host, DNS_HOST_SZ, &port)) host[0] = '\0';
+  request->state = REQUEST_CIRCUIT_OPEN;
+  request->response_status = 0;
+  snprintf(request->response_err, CURL_ERROR_SIZE, "circuit breaker open for host '%.200s'", host);
+  log_request(L_INFO, "reject_request", request, "%s", request->response_err);
+  scheduler_done(handler, request);
+  handler->stats.circuit_open++;
+  settle_followers(handler, request);
+}
+
+/**
+ * :pick_request
+ * Picks the next request of the shard queues. Once they're drained (or blocked)
+ * a request queued by another shard is stolen, so a shard stuck on slow hosts
+ * doesn't hold back the rest of its partition. Called with the batch lock held.
+ */
+static size_t pick_request(batch_shard* shard)
+{
+  request_handler* handler = shard->handler;
+  size_t i, index = scheduler_next(handler, &shard->sched);
+
+  for (i=1; index == SCHEDULER_NONE && i<handler->shards_count; i++)
+    if ((index = scheduler_next(handler, &handler->shards[(shard->index + i) % handler->shards_count].sched)) != SCHEDULER_NONE)
+      handler->stats.stolen++;
+  return index;
+}
+
+static int complete_request(batch_shard* shard, request* current, CURLcode result);
+
+/**
+ * :start_next_request
+ * Starts the next request picked by the scheduler, unless the batch was
+ * interrupted, in which case the queued requests are ended and never started.
+ * Requests of an open breaker host fail fast, rate limited hosts are requeued.
+ */
+static int start_next_request(batch_shard* shard)
+{
+  request_handler* handler = shard->handler;
+  request* request;
+  size_t index;
+  double retry_at;
+
+  pthread_mutex_lock(&handler->lock);
+  while (!batch_interrupted(shard)) {
+    if ((index = pick_request(shard)) == SCHEDULER_NONE) break;
+    request = &handler->requests[index];
+
+    switch (host_admit(handler->context, request, &retry_at))
+    {
+      case HOST_REJECTED:
+        reject_request(handler, request);
+        continue;
+
+      case HOST_THROTTLED:
+        scheduler_requeue(handler, owner_scheduler(handler, request), index, retry_at);
+        continue;
+    }
+
+    /* RUNNING BEFORE THE LOCK IS RELEASED, SO NO OTHER SHARD ENDS IT AS A QUEUED REQUEST */
+    request->state = REQUEST_RUNNING;
+    request->shard = shard->index;
+    shard->running++;
+
+    /* SVC:// URLS GET THEIR ENDPOINT AS THE TRANSFER STARTS, ON THE LIVE POOL LOAD */
+    upstream_pick(handler->context, request);
+    pthread_mutex_unlock(&handler->lock);
+
+    /* A REQUEST FAILING BEFORE ITS TRANSFER COMPLETES RIGHT AWAY */
+    if (!init_curl_handle(shard->multi, handler, index)) complete_request(shard, request, CURLE_WRITE_ERROR);
+    return 1;
+  }
+  pthread_mutex_unlock(&handler->lock);
+  return 0;
+}
+
+/**
+ * :fill_request_slots
+ * Starts requests until the shard runs its share of the batch concurrency,
+ * or none can start right now. Returns how many were started.
+ */
+static int fill_request_slots(batch_shard* shard)
+{
+  int started = 0;
+  while (shard->running < shard->max_running && start_next_request(shard)) started++;
+  return started;
+}
+
+/**
+ * :abort_request_pool
+ * The multi handle outlives the batch, so on failure every handle
+ * the shard still runs is released before returning 'status'. Its
+ * running requests end with the batch stop state, the other shards stop too.
+ */
+static int abort_request_pool(batch_shard* shard, int status)
+{
+  request_handler* handler = shard->handler;
+  request* request;
   size_t i;
-  int max_fds, queue_msgs, running_handles = -1;                    /* FDS or FD STANDS FOR FILE DESCRIPTOR */
+
+  pthread_mutex_lock(&handler->lock);
+  if (handler->stop_state == 0) {
+    handler->stop_state  = REQUEST_CANCELLED;
+    handler->stop_reason = "batch aborted";
+  }
+  for (i=0; i<handler->count; i++) {
+    request = &handler->requests[i];
+    if (request->shard != shard->index) continue;
+
+    /* THE RUNNING TRANSFERS END AS THE BATCH STOPPED, THEIR BREAKER PROBE AND ENDPOINT SLOT ARE FREED */
+    if (request->state == REQUEST_RUNNING) {
+      host_report(handler->context, request, HOST_ABORTED);
+      upstream_report(handler->context, request, HOST_ABORTED);
+      cache_release(request);
+      request->state = handler->stop_state;
+      request->response_status = 0;
+      snprintf(request->response_err, CURL_ERROR_SIZE, "%s", handler->stop_reason);
+      if (request->state == REQUEST_DEADLINE_EXCEEDED) handler->stats.deadline_exceeded++;
+      else handler->stats.cancelled++;
+    }
+    release_curl_handle(shard->multi, request);
+  }
+  pthread_mutex_unlock(&handler->lock);
+  return status;
+}
+
+/**
+ * :wait_for_activity
+ * Waits until one of the shard multi handle sockets is ready, or until
+ * libcurl's next timeout (capped by the deadline and the cancel token polling).
+ */
+static int wait_for_activity(batch_shard* shard)
+{
+  request_handler* request_handler = shard->handler;
+  long timeout, remaining;
+  double wake_at = 0, shard_wake_at;
+  int max_fds;                                                      /* FDS or FD STANDS FOR FILE DESCRIPTOR */
   fd_set read_fd, write_fd, exc_fd;
   struct timeval timeout_object;
+  size_t i;
 
-  /**
-   * DEFINE MAX SIMULTANEOUSLY CONNECTIONS:
-   */
-  const int MAX_SIMULTANEOUSLY_CONNECTIONS = (request_handler->count > DEFAULT_MAX) ? 
-                                                DEFAULT_MAX : request_handler->count;
+  FD_ZERO(&read_fd);
+  FD_ZERO(&write_fd);
+  FD_ZERO(&exc_fd);
+
+  if (curl_multi_fdset(shard->multi, &read_fd, &write_fd, &exc_fd, &max_fds))
+    return FDSET_ERROR;
+  
+  if (curl_multi_timeout(shard->multi, &timeout))
+    return MULTI_TIMEOUT;
+
+  if (timeout == -1) timeout = 100;
+
+  /* WAKE UP IN TIME FOR THE DEADLINE, AND POLL THE CANCEL TOKEN */
+  remaining = remaining_ms(request_handler);
+  if (remaining >= 0 && remaining < timeout) timeout = remaining;
+  if (request_handler->options.cancel != NULL && timeout > CANCEL_POLL_MS) timeout = CANCEL_POLL_MS;
+
+  /* WAKE UP ONCE A RATE LIMITED HOST GETS A TOKEN (ANY SHARD QUEUE MAY BE STOLEN FROM) */
+  pthread_mutex_lock(&request_handler->lock);
+  for (i=0; i<request_handler->shards_count; i++)
+    if ((shard_wake_at = scheduler_wake_at(&request_handler->shards[i].sched)) > 0 &&
+        (wake_at == 0 || shard_wake_at < wake_at))
+      wake_at = shard_wake_at;
+  pthread_mutex_unlock(&request_handler->lock);
+
+  if (wake_at > 0) {
+    remaining = (long)(wake_at - monotonic_ms()) + 1;
+    if (remaining < timeout) timeout = (remaining > 0) ? remaining : 0;
+  }
+
+  if (max_fds == -1) usleep((useconds_t) timeout * 1000);
+  else {
+    timeout_object.tv_sec = timeout/1000;
+    timeout_object.tv_usec = (timeout%1000)*1000;
+    if (0 > select(max_fds + 1, &read_fd, &write_fd, &exc_fd, &timeout_object))
+      return INVALID_SELECT_VALUE;
+  }
+  return 1;
+}
+
+/**
+ * :complete_request
+ * Updates a finished transfer request object, which will pushed
+ * later back to lua, and the batch counters.
+ * Returns 1 once the batch wait condition is decided.
+ */
+static int complete_request(batch_shard* shard, request* current, CURLcode result)
+{
+  request_handler* request_handler = shard->handler;
+  int settled, outcome;
+
+  pthread_mutex_lock(&request_handler->lock);
+  current->result = result;
+  current->state = REQUEST_DONE;
+
+  /* THE TRANSFER TIMEOUT WAS CLAMPED BY THE BATCH DEADLINE */
+  if (current->result == CURLE_OPERATION_TIMEDOUT && remaining_ms(request_handler) == 0) {
+    current->state = REQUEST_DEADLINE_EXCEEDED;
+    snprintf(current->response_err, CURL_ERROR_SIZE, "batch deadline exceeded");
+    request_handler->stats.deadline_exceeded++;
+  }
+
+  log_request(L_DEBUG, "perform_requests", current, "completed with status %ld (%s)",
+              current->response_status, curl_easy_strerror(current->result));
 
-  // curl_global_init(CURL_GLOBAL_ALL);
-  multi_handler = curl_multi_init();
+  /* FEEDS THE HOST BREAKER AND THE UPSTREAM ENDPOINT, A DEADLINE CUT ISN'T THE HOST FAULT */
+  outcome = (current->state != REQUEST_DONE) ? HOST_ABORTED : is_host_failure(current) ? HOST_FAILURE : HOST_SUCCESS;
+  host_report(request_handler->context, current, outcome);
+  upstream_report(request_handler->context, current, outcome);
+
+  /* 304 ANSWERS ARE SERVED FROM THE CACHE, CACHEABLE RESPONSES ARE STORED */
+  if (request_handler->options.cache) cache_response(request_handler, current);
+  
+  release_curl_handle(shard->multi, current);
+  scheduler_done(request_handler, current);
+  shard->running--;
+
+  request_handler->stats.completed++;
+  if (is_success(request_handler, current)) request_handler->stats.succeeded++;
+  settle_followers(request_handler, current);
+
+  /* WAIT CONDITION IS DECIDED, NO NEED FOR THE REST OF THE BATCH */
+  if ((settled = batch_settled(request_handler)))
+    cancel_requests(shard, REQUEST_CANCELLED, "cancelled, the batch wait condition was settled");
+  pthread_mutex_unlock(&request_handler->lock);
+  return settled;
+}
 
-  /* WE CAN OPTIONALLY LIMIT THE TOTAL AMOUNT OF CONNECTIONS THIS MULTI HANDLE USES.
-     Basically, that approach is similar to easy setop ('curl_easy_setopt'), but just for multi. */
-  curl_multi_setopt(multi_handler, CURLMOPT_MAXCONNECTS, (long)MAX_SIMULTANEOUSLY_CONNECTIONS);
+/**
+ * :perform_requests
+ * Handles the shard multi handler requests.
+ * The shard runs until its requests completed and no other
+ * shard has queued requests left to steal, or the batch stopped.
+ */
+static int perform_requests(batch_shard* shard)
+{
+  request_handler* request_handler = shard->handler;
+  CURLM *multi_handler = shard->multi;
+  CURLMsg *msg = NULL;
+  request* current;
+  CURLcode result;
+  int queue_msgs, returned_status, running_handles, stopped, pending;
 
-  for (i=0; i<MAX_SIMULTANEOUSLY_CONNECTIONS; ++i)
-    init_curl_handle(multi_handler, i, request_handler->requests);
+  fill_request_slots(shard);
 
-  while (running_handles) 
+  while (1) 
   {
     curl_multi_perform(multi_handler, &running_handles);
 
-    if (running_handles) {
-      FD_ZERO(&read_fd);
-      FD_ZERO(&write_fd);
-      FD_ZERO(&exc_fd);
-
-      if (curl_multi_fdset(multi_handler, &read_fd, &write_fd, &exc_fd, &max_fds))
-        return FDSET_ERROR;
-      
-      if (curl_multi_timeout(multi_handler, &timeout))
-        return MULTI_TIMEOUT;
-
-      if (timeout == -1) timeout = 100;
-      if (max_fds == -1) sleep((unsigned int) timeout / 1000);
-      else {
-        timeout_object.tv_sec = timeout/1000;
-        timeout_object.tv_usec = (timeout%1000)*1000;
-        if (0 > select(max_fds + 1, &read_fd, &write_fd, &exc_fd, &timeout_object))
-          return INVALID_SELECT_VALUE;
-      }
-    }
-
     /* READS FINISHED REQUESTS DATA HANDLES */
     while ((msg = curl_multi_info_read(multi_handler, &queue_msgs))) {
-      if (msg->msg == CURLMSG_DONE) {
-        request* current = NULL;
-        CURL *e = msg->easy_handle;
-
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &current);
-
-        /* SETS THE CURRENT REQUEST HANDLE RESPONSE STATUS */
-        curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &current->response_status);
-        
-        curl_slist_free_all(current->header_fields.slist);    /* FREEING LIBCURL HEADERS LINKED LIST  */
-        curl_multi_remove_handle(multi_handler, e);           /* REMOVING CURRENT LIBCURL EASY HANDLE */
-        curl_easy_cleanup(e);
-      }
-      
-      if (i < request_handler->count) {
-        init_curl_handle(multi_handler, i++, request_handler->requests);
-        running_handles++; /* just to prevent it from remaining at 0 if there are more requests to get    */
+      if (msg->msg != CURLMSG_DONE) continue;
+
+      /* SETS THE CURRENT REQUEST HANDLE RESPONSE STATUS */
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &current);
+      result = msg->data.result;
+
+      /* A RANGED DOWNLOAD COMPLETES ONCE ITS PROBE AND ALL OF ITS PARTS DID */
+      if (current->range_phase == RANGE_PROBE || current->range_phase == RANGE_PARTS) {
+        if (!range_transfer_done(request_handler, multi_handler, current, msg->easy_handle, &result)) continue;
       }
+      else curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE, &current->response_status);
+      current->total_time = (monotonic_ms() - request_handler->started_at) / MILLISECONDS - current->queue_time;
+
+      stopped = complete_request(shard, current, result);
+
+      /* DECODED ON THE SHARD THREAD, OUTSIDE THE BATCH LOCK (304 ANSWERS CARRY THE CACHED BODY BY NOW) */
+      decode_response(current);
+      if (stopped) return 1;
     }
+
+    fill_request_slots(shard);
+
+    pthread_mutex_lock(&request_handler->lock);
+
+    /* FAST FAILED (CIRCUIT OPEN) REQUESTS MAY SETTLE THE WAIT CONDITION TOO */
+    if ((stopped = batch_settled(request_handler)))
+      cancel_requests(shard, REQUEST_CANCELLED, "cancelled, the batch wait condition was settled");
+
+    /* DEADLINE PASSED, CANCEL TOKEN FIRED OR ANOTHER SHARD STOPPED THE BATCH */
+    else stopped = batch_interrupted(shard);
+
+    /* RATE LIMITED (OR OTHER SHARDS) REQUESTS MAY STILL BE QUEUED WHILE NOTHING RUNS */
+    pending = shard->running || batch_queued(request_handler);
+    pthread_mutex_unlock(&request_handler->lock);
+    if (stopped || !pending) return 1;
+
+    /* WAITING FOR ACTIVITY ONLY ONCE THE COMPLETED REQUESTS SLOTS WERE REFILLED */
+    if ((returned_status = wait_for_activity(shard)) < 0)
+      return abort_request_pool(shard, returned_status);
+  }
+}
+
+/**
+ * :shard_worker
+ * The thread running a batch shard
+ */
+static void* shard_worker(void* arg)
+{
+  batch_shard* shard = (batch_shard*) arg;
+  shard->status = perform_requests(shard);
+  return NULL;
+}
+
+/**
+ * :init_shards
+ * Partitions the batch between 'count' shards, each with its own multi handle,
+ * scheduler and share of the batch concurrency. The hosts in-flight counts
+ * and weights stay batch wide.
+ */
+static int init_shards(request_handler* request_handler, size_t count)
+{
+  async_context* ctx = request_handler->context;
+  size_t i, concurrency = (request_handler->count > request_handler->options.concurrency) ?
+                            request_handler->options.concurrency : request_handler->count;
+  batch_shard* shard;
+
+  /* THE HOSTS IN FLIGHT AND WEIGHTS ARE BATCH WIDE, EVERY SHARD SCHEDULER QUEUES ON THEM */
+  if (!scheduler_hosts(request_handler)) return 0;
+  request_handler->shards = (batch_shard*) calloc(count, sizeof(batch_shard));
+  if (request_handler->shards == NULL) return 0;
+  request_handler->shards_count = count;
+
+  for (i=0; i<count; i++) {
+    shard = &request_handler->shards[i];
+    shard->handler     = request_handler;
+    shard->index       = i;
+    shard->status      = 1;
+    shard->max_running = concurrency / count + (i < concurrency % count);
+    if ((shard->multi = context_multi(ctx, i)) == NULL) return 0;
+
+    /* WE CAN OPTIONALLY LIMIT THE TOTAL AMOUNT OF CONNECTIONS THIS MULTI HANDLE USES.
+       Basically, that approach is similar to easy setop ('curl_easy_setopt'), but just for multi.
+       The multi handle is persistent, so idle (and pre-warmed) connections outlive the batch. */
+    curl_multi_setopt(shard->multi, CURLMOPT_MAXCONNECTS, 
+                      (long)((shard->max_running > (size_t)ctx->max_connects) ? shard->max_running : (size_t)ctx->max_connects));
+
+    /* A PRECONNECT BATCH OPENS A CONNECTION PER REQUEST, HTTP/2 WOULD RUN THEM ALL ON ONE */
+    curl_multi_setopt(shard->multi, CURLMOPT_PIPELINING,
+                      request_handler->options.preconnect ? (long)CURLPIPE_NOTHING : (long)CURLPIPE_MULTIPLEX);
+
+    if (!scheduler_init(request_handler, &shard->sched, i, count)) return 0;
   }
-  curl_multi_cleanup(multi_handler);
-  // curl_global_cleanup();
   return 1;
 }
+
+/**
+ * :free_shards
+ * Simply freeing the batch shards (their multi handles belong to the context)
+ */
+static void free_shards(request_handler* request_handler)
+{
+  size_t i;
+  for (i=0; i<request_handler->shards_count; i++) free_scheduler(&request_handler->shards[i].sched);
+  free_scheduler_hosts(request_handler);
+  free(request_handler->shards);
+  request_handler->shards = NULL;
+  request_handler->shards_count = 0;
+}
+
+/**
+ * :request_pool
+ * Runs a whole batch: queues the requests by priority and host, then performs
+ * them on the context multi handle. With the threads option the batch is
+ * partitioned between shards, each performed by its own thread and multi handle.
+ */
+int request_pool(request_handler* request_handler)
+{
+  pthread_t threads[MAX_BATCH_THREADS];
+  int started[MAX_BATCH_THREADS];
+  size_t i, count;
+  int returned_status = 1;
+
+  request_handler->started_at   = monotonic_ms();
+  request_handler->hosts        = NULL;
+  request_handler->hosts_count  = 0;
+  request_handler->shards       = NULL;
+  request_handler->shards_count = 0;
+  request_handler->stop_state   = 0;
+  request_handler->stop_reason  = NULL;
+
+  /* THE BATCH DEADLINE COVERS THE WHOLE CALL, DNS PREFETCH INCLUDED */
+  if (request_handler->options.deadline_ms > 0)
+    request_handler->deadline = request_handler->started_at + (double)request_handler->options.deadline_ms;
+
+  /* IDENTICAL IDEMPOTENT REQUESTS SHARE A SINGLE TRANSFER (AND A SINGLE CACHE LOOKUP) */
+  if (request_handler->options.coalesce && !coalesce_requests(request_handler))
+    return SCHEDULER_ERROR;
+
+  /* FRESH CACHED RESPONSES ARE SERVED WITHOUT EVER BEING QUEUED */
+  if (request_handler->options.cache) cache_lookup(request_handler);
+
+  /* A SHARD PER THREAD, NEVER MORE THAN THE REQUESTS (OR THE CONCURRENCY) */
+  count = request_handler->options.threads;
+  if (count > MAX_BATCH_THREADS) count = MAX_BATCH_THREADS;
+  if (count > request_handler->count) count = request_handler->count;
+  if (count > request_handler->options.concurrency) count = request_handler->options.concurrency;
+  if (count < 1) count = 1;
+
+  if (!init_shards(request_handler, count)) {
+    free_shards(request_handler);
+    return SCHEDULER_ERROR;
+  }
+  pthread_mutex_init(&request_handler->lock, NULL);
+  request_handler->stats.threads = count;
+
+  /* RESOLVE EACH DISTINCT BATCH HOST ONCE, BEFORE THE TRANSFERS RACE ON IT */
+  if (request_handler->options.prefetch_dns)
+    prefetch_dns(request_handler);
+
+  /* THE CALLING THREAD RUNS THE FIRST SHARD */
+  for (i=1; i<count; i++)
+    started[i] = (pthread_create(&threads[i], NULL, shard_worker, &request_handler->shards[i]) == 0);
+  request_handler->shards[0].status = perform_requests(&request_handler->shards[0]);
+
+  /* A SHARD THREAD THAT FAILED TO START, HAD ITS QUEUES STOLEN BY NOW */
+  for (i=1; i<count; i++) {
+    if (started[i]) pthread_join(threads[i], NULL);
+    else request_handler->shards[i].status = perform_requests(&request_handler->shards[i]);
+  }
+
+  for (i=0; i<count; i++)
+    if (request_handler->shards[i].status < 0 && returned_status == 1) returned_status = request_handler->shards[i].status;
+
+  pthread_mutex_destroy(&request_handler->lock);
+  free_shards(request_handler);
+  return returned_status;
+}
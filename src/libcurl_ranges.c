@@ -0,0 +1,307 @@
+#include "libcurl_async.h"
+
+#include <fcntl.h>
+
+/**
+ * :is_ranged
+ * Only GET downloads without a body are split into Range parts
+ */
+int is_ranged(request* request)
+{
+  if (request->parallel_ranges < 2) return 0;
+  if (!is_empty(request->request_method.ptr) && !method_get(request->request_method.ptr)) return 0;
+  return is_empty(request->post_params.ptr) && is_empty(request->request_body.ptr);
+}
+
+/**
+ * :open_output_file
+ * Opens (truncates) the request output file once, the first transfer writing it.
+ * A failed open is the request error.
+ */
+int open_output_file(request* request)
+{
+  if (request->output_fd >= 0) return 1;
+
+  request->output_fd = open(request->output_file.ptr, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (request->output_fd < 0) {
+    snprintf(request->response_err, CURL_ERROR_SIZE, "can't open '%.200s': %s", request->output_file.ptr, strerror(errno));
+    log_request(L_ERROR, "open_output_file", request, "%s", request->response_err);
+  }
+  return request->output_fd >= 0;
+}
+
+/**
+ * :close_output_file
+ * Simply closing the request output file
+ */
+void close_output_file(request* request)
+{
+  if (request->output_fd < 0) return;
+  close(request->output_fd);
+  request->output_fd = -1;
+}
+
+/**
+ * :output_write
+ * A single stream body write callback, appends to the output file.
+ * Returning less than the given size fails the transfer (CURLE_WRITE_ERROR).
+ */
+size_t output_write(void* ptr, size_t size, size_t nmemb, request* request)
+{
+  size_t len = size*nmemb;
+  if (request->output_fd < 0) return 0;
+  return (write(request->output_fd, ptr, len) == (ssize_t)len) ? len : 0;
+}
+
+/**
+ * :range_write
+ * A download part write callback, writes at the part offset of the
+ * output file or of the preallocated body. A part answering more
+ * than its range (the server ignored it) fails right away.
+ */
+size_t range_write(void* ptr, size_t size, size_t nmemb, void* userp)
+{
+  range_part* part = (range_part*)userp;
+  request* request = part->parent;
+  size_t len = size*nmemb;
+
+  if (part->written + len > part->length) return 0;
+  if (request->output_fd >= 0) {
+    if (pwrite(request->output_fd, ptr, len, (off_t)(part->offset + part->written)) != (ssize_t)len) return 0;
+  }
+  else memcpy(request->response_body.ptr + part->offset + part->written, ptr, len);
+
+  part->written += len;
+  return len;
+}
+
+/**
+ * :release_part
+ * Removes a download part handle from the multi handle and frees it
+ */
+static void release_part(CURLM *cm, range_part* part)
+{
+  if (part->easy == NULL) return;
+  curl_multi_remove_handle(cm, part->easy);
+  curl_easy_cleanup(part->easy);
+  curl_slist_free_all(part->headers);
+  part->easy = NULL;
+  part->headers = NULL;
+}
+
+/**
+ * :release_range_parts
+ * Releases every download part of a request (completed, failed or cancelled)
+ */
+void release_range_parts(CURLM *cm, request* request)
+{
+  size_t i;
+  if (request->parts == NULL) return;
+  for (i=0; i<request->parts_count; i++) release_part(cm, &request->parts[i]);
+  free(request->parts);
+  request->parts = NULL;
+  request->parts_running = 0;
+}
+
+/**
+ * :define_part_headers
+ * The request headers, the part Range and an If-Range validator of the probed
+ * object, so a part of an object that changed meanwhile isn't stitched in.
+ */
+static struct curl_slist* define_part_headers(request* request, range_part* part)
+{
+  struct curl_slist* headers = NULL;
+  char line[RANGE_HEADER_SZ];
+  size_t i;
+
+  for (i=0; i<request->header_fields.count; i++)
+    headers = curl_slist_append(headers, request->header_fields.headers[i].ptr);
+
+  snprintf(line, sizeof(line), "Range: bytes=%zu-%zu", part->offset, part->offset + part->length - 1);
+  headers = curl_slist_append(headers, line);
+
+  /* WEAK ETAGS CAN'T VALIDATE A RANGE */
+  if (!is_empty(request->cache_meta.etag) && strncmp(request->cache_meta.etag, "W/", 2) != 0) {
+    snprintf(line, sizeof(line), "If-Range: %s", request->cache_meta.etag);
+    headers = curl_slist_append(headers, line);
+  }
+  else if (!is_empty(request->cache_meta.last_modified)) {
+    snprintf(line, sizeof(line), "If-Range: %s", request->cache_meta.last_modified);
+    headers = curl_slist_append(headers, line);
+  }
+  return headers;
+}
+
+/**
+ * :init_range_part
+ * Initiates a download part handle, on the probe final url (redirections already followed)
+ */
+static CURL* init_range_part(request_handler* handler, request* request, range_part* part, const char* url)
+{
+  CURL *eh = curl_easy_init();
+  if (eh == NULL) return NULL;
+
+  curl_easy_setopt(eh, CURLOPT_HEADER, 0L);
+  curl_easy_setopt(eh, CURLOPT_URL, (url != NULL) ? url : request_url(request));
+  curl_easy_setopt(eh, CURLOPT_PRIVATE, request);
+  curl_easy_setopt(eh, CURLOPT_HTTPGET, 1L);
+  setup_transfer(eh, handler, request);
+
+  part->headers = define_part_headers(request, part);
+  curl_easy_setopt(eh, CURLOPT_HTTPHEADER, part->headers);
+  curl_easy_setopt(eh, CURLOPT_WRITEFUNCTION, range_write);
+  curl_easy_setopt(eh, CURLOPT_WRITEDATA, part);
+  curl_easy_setopt(eh, CURLOPT_ERRORBUFFER, part->error);
+
+  /* THE PROBE RESOLVE OVERRIDES OUTLIVE IT, THEY'RE FREED WITH THE REQUEST HANDLE */
+  if (request->resolve_slist != NULL)
+    curl_easy_setopt(eh, CURLOPT_RESOLVE, request->resolve_slist);
+  return eh;
+}
+
+/**
+ * :start_range_parts
+ * Splits the probed object into (at most 'parallel_ranges') parts of at least
+ * 'range_chunk_min' bytes each, and adds them all to the multi handle.
+ * The destination (output file or body) is allocated upfront at its final size.
+ */
+static int start_range_parts(request_handler* handler, CURLM *cm, request* request, CURL* probe, size_t length)
+{
+  size_t count = (size_t)request->parallel_ranges, chunk, i;
+  const char* url = NULL;
+  range_part* part;
+  char* body;
+
+  if (count > length / (size_t)request->range_chunk_min) count = length / (size_t)request->range_chunk_min;
+
+  if (!is_empty(request->output_file.ptr)) {
+    if (request->output_fd < 0 || ftruncate(request->output_fd, (off_t)length) != 0) return 0;
+  }
+  else {
+    if ((body = realloc(request->response_body.ptr, length + 1)) == NULL) return 0;
+    request->response_body.ptr = body;
+    request->response_body.ptr[length] = '\0';
+    request->response_body.len = length;
+  }
+
+  request->parts = (range_part*) calloc(count, sizeof(range_part));
+  if (request->parts == NULL) return 0;
+  request->parts_count = count;
+
+  curl_easy_getinfo(probe, CURLINFO_EFFECTIVE_URL, &url);
+  chunk = length / count;
+  for (i=0; i<count; i++) {
+    part = &request->parts[i];
+    part->parent = request;
+    part->offset = i * chunk;
+    part->length = (i == count - 1) ? length - part->offset : chunk;
+    if ((part->easy = init_range_part(handler, request, part, url)) == NULL) {
+      release_range_parts(cm, request);
+      request->parts_count = 0;
+      return 0;
+    }
+  }
+
+  for (i=0; i<count; i++) curl_multi_add_handle(cm, request->parts[i].easy);
+  request->parts_running = count;
+  request->range_phase = RANGE_PARTS;
+  log_request(L_DEBUG, "start_range_parts", request, "downloading %zu bytes in %zu parts", length, count);
+  return 1;
+}
+
+/**
+ * :probe_done
+ * The probe completed: either the object is split into parts, or the request
+ * falls back to a single stream (no Accept-Ranges, unknown or small length).
+ * Returns 1 only when the request completed (the probe transfer failed).
+ */
+static int probe_done(request_handler* handler, CURLM *cm, request* request, CURL* easy, CURLcode* result)
+{
+  curl_off_t length = -1;
+
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &request->response_status);
+  curl_easy_getinfo(easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+
+  /* THE HOST ISN'T REACHABLE, A SINGLE STREAM WOULDN'T DO BETTER */
+  if (*result != CURLE_OK) return 1;
+
+  request->result = CURLE_OK;
+  if (request->response_status / 100 == 2 && request->cache_meta.accept_ranges &&
+      length >= 2 * (curl_off_t)request->range_chunk_min &&
+      start_range_parts(handler, cm, request, easy, (size_t)length)) {
+
+    /* ONLY THE PROBE HANDLE GOES, ITS RESOLVE OVERRIDES ARE SHARED BY THE PARTS */
+    curl_multi_remove_handle(cm, easy);
+    curl_easy_cleanup(easy);
+    request->easy = NULL;
+    return 0;
+  }
+
+  log_request(L_DEBUG, "probe_done", request, "single stream download (status %ld, length %ld, ranges %d)",
+              request->response_status, (long)length, request->cache_meta.accept_ranges);
+
+  release_curl_handle(cm, request);
+  request->range_phase = RANGE_SINGLE;
+  request->response_body.len = request->response_headers.len = 0;
+  request->response_body.ptr[0] = request->response_headers.ptr[0] = '\0';
+  init_curl_handle(cm, handler, (size_t)(request - handler->requests));
+  return 0;
+}
+
+/**
+ * :part_done
+ * A download part completed. The first failing part (a transfer error, or an
+ * answer other than 206 with the whole range) fails the download and ends the
+ * other parts. Returns 1 once the last part completed.
+ */
+static int part_done(CURLM *cm, request* request, CURL* easy, CURLcode* result)
+{
+  range_part* part = NULL;
+  long status = 0;
+  size_t i;
+
+  for (i=0; i<request->parts_count && part == NULL; i++)
+    if (request->parts[i].easy == easy) part = &request->parts[i];
+  if (part == NULL) return 0;
+
+  curl_easy_getinfo(easy, CURLINFO_RESPONSE_CODE, &status);
+  /* A SERVER IGNORING THE RANGE OVERFLOWS THE PART (A WRITE ERROR) */
+  if ((*result == CURLE_OK || *result == CURLE_WRITE_ERROR) && (status != 206 || part->written != part->length)) {
+    *result = CURLE_RANGE_ERROR;
+    snprintf(part->error, CURL_ERROR_SIZE, "range part %zu answered with status %ld (%zu of %zu bytes)",
+             (size_t)(part - request->parts), status, part->written, part->length);
+  }
+  release_part(cm, part);
+  request->parts_running--;
+
+  if (*result != CURLE_OK && request->result == CURLE_OK) {
+    request->result = *result;
+    request->response_status = status;
+    snprintf(request->response_err, CURL_ERROR_SIZE, "%s", part->error);
+
+    /* THE DOWNLOAD FAILED, NO NEED FOR THE REST OF THE PARTS */
+    for (i=0; i<request->parts_count; i++) release_part(cm, &request->parts[i]);
+    request->parts_running = 0;
+
+    /* NOTHING OF THE PARTLY WRITTEN OBJECT IS RETURNED */
+    if (request->output_fd >= 0 && ftruncate(request->output_fd, 0) != 0)
+      log_request(L_ERROR, "part_done", request, "can't truncate '%s': %s", request->output_file.ptr, strerror(errno));
+    request->response_body.len = 0;
+    request->response_body.ptr[0] = '\0';
+  }
+
+  if (request->parts_running > 0) return 0;
+  *result = request->result;
+  return 1;
+}
+
+/**
+ * :range_transfer_done
+ * Moves a ranged download forward once one of its transfers (probe or part) completed.
+ * Returns 1 when the request completed, with its status and 'result' set.
+ */
+int range_transfer_done(request_handler* handler, CURLM *cm, request* request, CURL* easy, CURLcode* result)
+{
+  if (request->range_phase == RANGE_PROBE) return probe_done(handler, cm, request, easy, result);
+  return part_done(cm, request, easy, result);
+}
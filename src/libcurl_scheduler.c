@@ -0,0 +1,268 @@
+#include "libcurl_async.h"
+
+#include <limits.h>
+
+typedef struct {
+  int     priority;
+  size_t  index;
+} queue_order;
+
+/**
+ * :compare_priority
+ * Highest priority first, keeping the batch order on ties
+ */
+static int compare_priority(const void* a, const void* b)
+{
+  const queue_order* left = (const queue_order*)a, *right = (const queue_order*)b;
+  if (left->priority != right->priority) return (left->priority > right->priority) ? -1 : 1;
+  return (left->index < right->index) ? -1 : (left->index > right->index);
+}
+
+/**
+ * :weight_of_host
+ * Returns the batch weight of a host (default 1)
+ */
+static long weight_of_host(request_handler* handler, const char* host)
+{
+  size_t i;
+  for (i=0; i<handler->options.host_weights_count; i++)
+    if (strcmp(handler->options.host_weights[i].host, host) == 0) return handler->options.host_weights[i].weight;
+  return 1;
+}
+
+/**
+ * :batch_host_index
+ * Returns the batch host index of host:port, adding a new host when missing
+ */
+static size_t batch_host_index(request_handler* handler, const char* host, long port)
+{
+  batch_host* entry;
+  size_t i;
+
+  for (i=0; i<handler->hosts_count; i++)
+    if (handler->hosts[i].port == port && strcmp(handler->hosts[i].host, host) == 0) return i;
+
+  entry = &handler->hosts[handler->hosts_count];
+  strcpy(entry->host, host);
+  entry->port           = port;
+  entry->in_flight      = 0;
+  entry->weight         = weight_of_host(handler, host);
+  entry->current_weight = 0;
+  return handler->hosts_count++;
+}
+
+/**
+ * :is_queued
+ * Checks the request goes through the scheduler: coalesced requests (followers)
+ * never run, their leader does, and requests served by the cache are done already
+ */
+static int is_queued(request* request)
+{
+  return request->leader == SCHEDULER_NONE && request->state == REQUEST_PENDING;
+}
+
+/**
+ * :scheduler_hosts
+ * Builds the batch hosts (host:port) of the queued requests. Their in-flight
+ * counts and round robin weights are shared by every shard, so max_per_host
+ * and the host weights hold for the whole batch, whatever the threads count.
+ * Returns 0 on allocation failure.
+ */
+int scheduler_hosts(request_handler* handler)
+{
+  char host[DNS_HOST_SZ];
+  long port;
+  size_t i;
+
+  handler->hosts_count = 0;
+  handler->hosts = (batch_host*) malloc(sizeof(batch_host) * (handler->count + 1));
+  if (handler->hosts == NULL) return 0;
+
+  for (i=0; i<handler->count; i++) {
+    if (!is_queued(&handler->requests[i])) continue;
+    if (!url_host_port(handler->requests[i].url.ptr, host, DNS_HOST_SZ, &port)) {
+      host[0] = '\0';
+      port = 0;
+    }
+    handler->requests[i].host_index = batch_host_index(handler, host, port);
+  }
+  return 1;
+}
+
+/**
+ * :scheduler_init
+ * Queues the requests of a shard (batch index % shards == shard) by their batch host,
+ * each host queue ordered by priority and then by the batch order.
+ */
+int scheduler_init(request_handler* handler, scheduler* sched, size_t shard, size_t shards)
+{
+  queue_order* order;
+  host_queue* queue;
+  size_t i, index;
+
+  sched->count  = handler->hosts_count;
+  sched->queued = 0;
+  sched->hosts = (host_queue*) malloc(sizeof(host_queue) * (handler->hosts_count + 1));
+  sched->next  = (size_t*) malloc(sizeof(size_t) * (handler->count + 1));
+  order        = (queue_order*) malloc(sizeof(queue_order) * (handler->count + 1));
+  if (sched->hosts == NULL || sched->next == NULL || order == NULL) {
+    free(order);
+    return 0;
+  }
+
+  for (i=0; i<sched->count; i++) {
+    sched->hosts[i].head          =
+    sched->hosts[i].tail          = SCHEDULER_NONE;
+    sched->hosts[i].blocked_until = 0;
+  }
+
+  for (i=0; i<handler->count; i++) {
+    order[i].priority = handler->requests[i].priority;
+    order[i].index    = i;
+  }
+  qsort(order, handler->count, sizeof(queue_order), compare_priority);
+
+  for (i=0; i<handler->count; i++) {
+    index = order[i].index;
+    if (index % shards != shard || !is_queued(&handler->requests[index])) continue;
+
+    queue = &sched->hosts[handler->requests[index].host_index];
+    sched->next[index] = SCHEDULER_NONE;
+    if (queue->tail == SCHEDULER_NONE) queue->head = index;
+    else sched->next[queue->tail] = index;
+    queue->tail = index;
+    sched->queued++;
+  }
+
+  free(order);
+  return 1;
+}
+
+/**
+ * :is_eligible
+ * Checks a host queue has a request that may start now (not rate limited, under max_per_host)
+ */
+static int is_eligible(request_handler* handler, scheduler* sched, size_t i, double now)
+{
+  return sched->hosts[i].head != SCHEDULER_NONE && sched->hosts[i].blocked_until <= now &&
+         (handler->options.max_per_host == 0 || handler->hosts[i].in_flight < handler->options.max_per_host);
+}
+
+/**
+ * :scheduler_next
+ * Picks the next request to start: the highest queued priority first,
+ * then a smooth weighted round robin between the hosts queuing that priority.
+ * Hosts at their in-flight cap (counted over every shard), or rate limited,
+ * are skipped. Returns SCHEDULER_NONE when nothing can start right now.
+ * Called with the batch lock held.
+ */
+size_t scheduler_next(request_handler* handler, scheduler* sched)
+{
+  batch_host* host, *chosen = NULL;
+  host_queue* queue;
+  int best_priority = INT_MIN, found = 0;
+  long total_weight = 0;
+  double now = monotonic_ms();
+  size_t i, index, chosen_index = 0;
+
+  for (i=0; i<sched->count; i++) {
+    if (!is_eligible(handler, sched, i, now)) continue;
+    if (!found || handler->requests[sched->hosts[i].head].priority > best_priority) {
+      best_priority = handler->requests[sched->hosts[i].head].priority;
+      found = 1;
+    }
+  }
+  if (!found) return SCHEDULER_NONE;
+
+  /* SMOOTH WEIGHTED ROUND ROBIN BETWEEN THE ELIGIBLE HOSTS, THE WEIGHTS ARE THE BATCH ONES */
+  for (i=0; i<sched->count; i++) {
+    if (!is_eligible(handler, sched, i, now)) continue;
+    if (handler->requests[sched->hosts[i].head].priority != best_priority) continue;
+
+    host = &handler->hosts[i];
+    host->current_weight += host->weight;
+    total_weight += host->weight;
+    if (chosen == NULL || host->current_weight > chosen->current_weight) {
+      chosen = host;
+      chosen_index = i;
+    }
+  }
+  chosen->current_weight -= total_weight;
+  chosen->in_flight++;
+
+  queue = &sched->hosts[chosen_index];
+  index = queue->head;
+  queue->head = sched->next[index];
+  if (queue->head == SCHEDULER_NONE) queue->tail = SCHEDULER_NONE;
+  sched->queued--;
+  return index;
+}
+
+/**
+ * :scheduler_requeue
+ * Puts a picked request back at the head of its host queue,
+ * the host is skipped until 'until' (monotonic ms).
+ */
+void scheduler_requeue(request_handler* handler, scheduler* sched, size_t index, double until)
+{
+  size_t host_index = handler->requests[index].host_index;
+  host_queue* queue = &sched->hosts[host_index];
+
+  sched->next[index] = queue->head;
+  queue->head = index;
+  if (queue->tail == SCHEDULER_NONE) queue->tail = index;
+  if (handler->hosts[host_index].in_flight > 0) handler->hosts[host_index].in_flight--;
+  queue->blocked_until = until;
+  sched->queued++;
+}
+
+/**
+ * :scheduler_wake_at
+ * Returns the earliest time a blocked host with queued requests unblocks (0 for none)
+ */
+double scheduler_wake_at(scheduler* sched)
+{
+  double wake_at = 0, now = monotonic_ms();
+  size_t i;
+
+  for (i=0; i<sched->count; i++)
+    if (sched->hosts[i].head != SCHEDULER_NONE && sched->hosts[i].blocked_until > now &&
+        (wake_at == 0 || sched->hosts[i].blocked_until < wake_at))
+      wake_at = sched->hosts[i].blocked_until;
+  return wake_at;
+}
+
+/**
+ * :scheduler_done
+ * Releases the batch host in-flight slot of a completed request (whatever shard ran it)
+ */
+void scheduler_done(request_handler* handler, request* request)
+{
+  batch_host* host = &handler->hosts[request->host_index];
+  if (host->in_flight > 0) host->in_flight--;
+}
+
+/**
+ * :free_scheduler
+ * Simply freeing the scheduler queues
+ */
+void free_scheduler(scheduler* sched)
+{
+  free(sched->hosts);
+  free(sched->next);
+  sched->hosts = NULL;
+  sched->next  = NULL;
+  sched->count = 0;
+  sched->queued = 0;
+}
+
+/**
+ * :free_scheduler_hosts
+ * Simply freeing the batch hosts
+ */
+void free_scheduler_hosts(request_handler* handler)
+{
+  free(handler->hosts);
+  handler->hosts = NULL;
+  handler->hosts_count = 0;
+}
@@ -0,0 +1,268 @@
+#include "libcurl_async.h"
+
+/**
+ * :default_upstream_policy
+ * Initiating the upstream pools default policy
+ */
+void default_upstream_policy(upstream_policy* policy)
+{
+  policy->ewma_weight         = DEFAULT_EWMA_WEIGHT;
+  policy->eject_failures      = DEFAULT_EJECT_FAILURES;
+  policy->eject_ms            = DEFAULT_EJECT_MS;
+  policy->max_ejected_percent = DEFAULT_MAX_EJECTED_PERCENT;
+}
+
+/**
+ * :is_upstream_url
+ * Checks the url targets an upstream pool (svc://name/path)
+ */
+int is_upstream_url(const char* url)
+{
+  return url != NULL && strncmp(url, UPSTREAM_SCHEME, strlen(UPSTREAM_SCHEME)) == 0;
+}
+
+/**
+ * :upstream_name
+ * Extracts the (lower case) pool name of a svc:// url,
+ * returns the rest of the url (path and query), NULL for an invalid name.
+ */
+static const char* upstream_name(const char* url, char* name)
+{
+  const char* start = url + strlen(UPSTREAM_SCHEME);
+  size_t len = strcspn(start, "/?#"), i;
+
+  if (len == 0 || len >= UPSTREAM_NAME_SZ) return NULL;
+  for (i=0; i<len; i++) name[i] = tolower(start[i]);
+  name[len] = '\0';
+  return start + len;
+}
+
+/**
+ * :find_upstream
+ * Returns the pool of the given name, case insensitive (and its 'index' when not NULL), NULL when unknown.
+ */
+upstream* find_upstream(async_context* context, const char* name, size_t* index)
+{
+  size_t i;
+
+  for (i=0; i<context->upstreams_count; i++) {
+    if (strcasecmp(context->upstreams[i].name, name) != 0) continue;
+    if (index != NULL) *index = i;
+    return &context->upstreams[i];
+  }
+  return NULL;
+}
+
+/**
+ * :define_upstream
+ * Creates a pool, or replaces the endpoints of an existing one. Endpoints
+ * kept by the new list keep their state (latency EWMA, ejection), the
+ * policy stays the pool one. Returns NULL for an invalid name or url.
+ * Never called while a batch runs, the requests refer to the pools by index.
+ */
+upstream* define_upstream(async_context* context, const char* name, const char** urls, size_t count)
+{
+  upstream* pool;
+  upstream_endpoint* endpoints;
+  char host[DNS_HOST_SZ], lower_name[UPSTREAM_NAME_SZ];
+  long port;
+  size_t i, j, len = strlen(name);
+
+  if (len == 0 || len >= UPSTREAM_NAME_SZ || name[strcspn(name, "/?#:")] != '\0') return NULL;
+  for (i=0; i<=len; i++) lower_name[i] = tolower(name[i]);
+
+  for (i=0; i<count; i++)
+    if (strlen(urls[i]) >= UPSTREAM_URL_SZ || is_upstream_url(urls[i]) ||
+        !url_host_port(urls[i], host, DNS_HOST_SZ, &port)) return NULL;
+
+  endpoints = (upstream_endpoint*) calloc((count > 0) ? count : 1, sizeof(upstream_endpoint));
+  if (endpoints == NULL) return NULL;
+
+  if ((pool = find_upstream(context, lower_name, NULL)) == NULL) {
+    pool = (upstream*) realloc(context->upstreams, sizeof(upstream) * (context->upstreams_count + 1));
+    if (pool == NULL) {
+      free(endpoints);
+      return NULL;
+    }
+    context->upstreams = pool;
+    pool = &context->upstreams[context->upstreams_count++];
+    strcpy(pool->name, lower_name);
+    default_upstream_policy(&pool->policy);
+    pool->endpoints = NULL;
+    pool->count     = 0;
+    pool->cursor    = 0;
+  }
+
+  for (i=0; i<count; i++) {
+    strcpy(endpoints[i].url, urls[i]);
+    for (j=0; j<pool->count; j++)
+      if (strcmp(pool->endpoints[j].url, urls[i]) == 0) endpoints[i] = pool->endpoints[j];
+  }
+  free(pool->endpoints);
+  pool->endpoints = endpoints;
+  pool->count     = count;
+  pool->cursor    = 0;
+  return pool;
+}
+
+/**
+ * :pool_ewma
+ * The mean latency EWMA of the pool sampled endpoints (1ms when none is),
+ * stands for the endpoints without a sample yet
+ */
+static double pool_ewma(upstream* pool)
+{
+  double sum = 0;
+  size_t i, sampled = 0;
+
+  for (i=0; i<pool->count; i++)
+    if (pool->endpoints[i].ewma_ms > 0) {
+      sum += pool->endpoints[i].ewma_ms;
+      sampled++;
+    }
+  return (sampled > 0) ? sum / sampled : 1;
+}
+
+/**
+ * :upstream_pick
+ * Picks the endpoint of a svc:// request right before its transfer starts:
+ * the lowest (in flight + 1) * latency EWMA, so the least outstanding
+ * requests win, weighted by how fast the endpoint answers. Ejected endpoints
+ * are skipped, unless every endpoint is ejected (the pool then panics and
+ * uses them all). The scan starts from a rotating cursor, spreading the ties.
+ * A request without an endpoint keeps its svc:// url, libcurl fails it.
+ * Called with the batch lock held.
+ */
+void upstream_pick(async_context* context, request* request)
+{
+  char name[UPSTREAM_NAME_SZ];
+  const char* path;
+  upstream* pool;
+  upstream_endpoint* endpoint;
+  size_t i, k, pass, best = SCHEDULER_NONE;
+  double now = monotonic_ms(), unsampled, score, best_score = 0;
+
+  if (!is_upstream_url(request->url.ptr) || request->endpoint_held) return;
+  if ((path = upstream_name(request->url.ptr, name)) == NULL ||
+      (pool = find_upstream(context, name, &request->upstream)) == NULL || pool->count == 0) {
+    log_request(L_ERROR, "upstream_pick", request, "no upstream endpoint for the request");
+    return;
+  }
+
+  unsampled = pool_ewma(pool);
+  for (pass=0; pass<2 && best == SCHEDULER_NONE; pass++)
+    for (k=0; k<pool->count; k++) {
+      i = (pool->cursor + k) % pool->count;
+      endpoint = &pool->endpoints[i];
+      if (pass == 0 && endpoint->ejected_until > now) continue;
+
+      score = (endpoint->in_flight + 1) * ((endpoint->ewma_ms > 0) ? endpoint->ewma_ms : unsampled);
+      if (best == SCHEDULER_NONE || score < best_score) {
+        best = i;
+        best_score = score;
+      }
+    }
+  pool->cursor = (pool->cursor + 1) % pool->count;
+
+  endpoint = &pool->endpoints[best];
+  endpoint->in_flight++;
+  request->endpoint      = best;
+  request->endpoint_held = 1;
+  strcpy(request->endpoint_url, endpoint->url);
+
+  /* THE ENDPOINT URL, THEN THE REQUEST PATH AND QUERY (A SINGLE SLASH BETWEEN THEM) */
+  request->target_url.len = 0;
+  request->target_url.ptr[0] = '\0';
+  memcpy_string(endpoint->url, &request->target_url);
+  if (*path == '/' && request->target_url.len > 0 && request->target_url.ptr[request->target_url.len - 1] == '/') path++;
+  memcpy_string(path, &request->target_url);
+}
+
+/**
+ * :can_eject
+ * Checks one more ejection keeps the pool within its max_ejected_percent
+ */
+static int can_eject(upstream* pool, double now)
+{
+  size_t i, ejected = 0;
+
+  for (i=0; i<pool->count; i++)
+    if (pool->endpoints[i].ejected_until > now) ejected++;
+  return (ejected + 1) * 100 <= pool->policy.max_ejected_percent * pool->count;
+}
+
+/**
+ * :upstream_report
+ * Feeds a request outcome to its endpoint: releases its in flight slot
+ * (once, a released request is ignored), updates the latency EWMA and
+ * ejects the endpoint after eject_failures consecutive failures.
+ * A failure weighs at least the request timeout in the EWMA, so a fast
+ * failing endpoint doesn't draw the traffic. The ejection period grows
+ * with each ejection in a row. HOST_ABORTED only releases the slot.
+ * Called with the batch lock held.
+ */
+void upstream_report(async_context* context, request* request, int outcome)
+{
+  upstream* pool;
+  upstream_endpoint* endpoint;
+  double now = monotonic_ms(), sample;
+  size_t multiplier;
+
+  if (!request->endpoint_held) {
+    if (outcome != HOST_ABORTED && request->endpoint == SCHEDULER_NONE && is_upstream_url(request->url.ptr))
+      snprintf(request->response_err, CURL_ERROR_SIZE, "no upstream endpoint for '%.200s'", request->url.ptr);
+    return;
+  }
+  pool = &context->upstreams[request->upstream];
+  endpoint = &pool->endpoints[request->endpoint];
+  request->endpoint_held = 0;
+  if (endpoint->in_flight > 0) endpoint->in_flight--;
+  if (outcome == HOST_ABORTED) return;
+
+  sample = request->total_time * MILLISECONDS;
+  if (outcome == HOST_FAILURE && sample < request->timeout) sample = (double)request->timeout;
+  endpoint->ewma_ms = (endpoint->ewma_ms > 0) ? endpoint->ewma_ms + pool->policy.ewma_weight * (sample - endpoint->ewma_ms)
+                                              : sample;
+  endpoint->requests++;
+
+  if (outcome == HOST_SUCCESS) {
+    endpoint->consecutive_failures = 0;
+    if (endpoint->ejected_until <= now) endpoint->ejections = 0;
+    return;
+  }
+  endpoint->failures++;
+  endpoint->consecutive_failures++;
+
+  if (pool->policy.eject_failures == 0 || endpoint->consecutive_failures < pool->policy.eject_failures ||
+      endpoint->ejected_until > now || !can_eject(pool, now)) return;
+
+  endpoint->ejections++;
+  endpoint->consecutive_failures = 0;
+  multiplier = (endpoint->ejections < MAX_EJECT_MULTIPLIER) ? endpoint->ejections : MAX_EJECT_MULTIPLIER;
+  endpoint->ejected_until = now + (double)pool->policy.eject_ms * multiplier;
+  log_info("upstream_report", "endpoint '%s' of upstream '%s' ejected for %ldms",
+           endpoint->url, pool->name, pool->policy.eject_ms * (long)multiplier);
+}
+
+/**
+ * :request_url
+ * The url the request transfer goes to, the picked endpoint one for svc:// urls
+ */
+const char* request_url(request* request)
+{
+  return (request->target_url.len > 0) ? request->target_url.ptr : request->url.ptr;
+}
+
+/**
+ * :free_upstreams
+ * Simply freeing the upstream pools
+ */
+void free_upstreams(async_context* context)
+{
+  size_t i;
+
+  for (i=0; i<context->upstreams_count; i++) free(context->upstreams[i].endpoints);
+  free(context->upstreams);
+  context->upstreams       = NULL;
+  context->upstreams_count = 0;
+}
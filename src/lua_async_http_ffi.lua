@@ -0,0 +1,387 @@
+-- LuaJIT FFI fast path of lua_async_http.
+-- Takes the same requests and batch options as async.request and returns the same
+-- responses and stats, but the batch is marshaled through plain C structs
+-- (lua_async_http_execute), so the whole Lua side can be JIT compiled.
+-- Without LuaJIT, the module is simply lua_async_http.
+--
+-- usage: local async = require("lua_async_http_ffi")
+--        local res, stats = async.request(requests, options)
+local async = require("lua_async_http")
+
+local has_ffi, ffi = pcall(require, "ffi")
+if not has_ffi then return async end
+
+local bit = require("bit")
+local has_table_new, table_new = pcall(require, "table.new")
+if not has_table_new then table_new = function() return {} end end
+
+-- mirrors the ffi abi of src/libcurl_async.h (change both)
+ffi.cdef[[
+typedef struct {
+  const char* ptr;
+  size_t len;
+} lua_async_http_buffer;
+
+typedef struct {
+  unsigned char type;
+  unsigned char escaped;
+  size_t len;
+  size_t offset;
+  double number;
+} lua_async_http_json_token;
+
+typedef struct {
+  const char* strings[11];
+  double numbers[10];
+  unsigned int numbers_set;
+  const char* const* headers;
+  size_t headers_count;
+} lua_async_http_request;
+
+typedef struct {
+  void* cancel;
+  double deadline_ms;
+  double concurrency;
+  double threads;
+  double quorum;
+  double max_per_host;
+  double dns_cache_timeout;
+  int wait;
+  int prefetch_dns;
+  int coalesce;
+  int cache;
+  long success_codes[32];
+  size_t success_codes_count;
+  unsigned int success_classes;
+} lua_async_http_batch;
+
+typedef struct {
+  lua_async_http_buffer name;
+  lua_async_http_buffer url;
+  lua_async_http_buffer body;
+  lua_async_http_buffer headers;
+  lua_async_http_buffer error;
+  lua_async_http_buffer decode_error;
+  const char* state;
+  const char* cache_status;
+  long status;
+  double queue_time;
+  size_t ranges;
+  int decode;
+  const lua_async_http_json_token* json;
+  size_t json_count;
+  const char* json_strings;
+  const char* json_body;
+  double total_time;
+  lua_async_http_buffer endpoint;
+} lua_async_http_response;
+
+typedef struct {
+  size_t requests;
+  size_t completed;
+  size_t succeeded;
+  size_t cancelled;
+  size_t deadline_exceeded;
+  size_t circuit_open;
+  size_t coalesced;
+  size_t cache_hits;
+  size_t cache_misses;
+  size_t cache_revalidated;
+  size_t threads;
+  size_t stolen;
+  int wait_met;
+} lua_async_http_stats;
+
+typedef struct {
+  lua_async_http_response* responses;
+  size_t count;
+  lua_async_http_stats stats;
+  void* handler;
+} lua_async_http_result;
+
+int lua_async_http_execute(void* context, const lua_async_http_request* requests, size_t count,
+                           const lua_async_http_batch* batch, lua_async_http_result** result);
+void lua_async_http_release(lua_async_http_result* result);
+]]
+
+-- the module library itself (already loaded by require, dlopen hands the same one)
+local lib = ffi.load(package.searchpath("lua_async_http", package.cpath))
+
+-- the request keys, in the FFI_STRINGS / FFI_NUMBERS order
+local STRING_KEYS = { "name", "method", "post_params", "data", "url", "certificate",
+                      "cafile", "key", "password", "output_file", "decode" }
+local NUMBER_KEYS = { "timeout", "connect_timeout", "expectations", "priority", "parallel_ranges",
+                      "range_chunk_min", "verify_peer", "verify_host", "debug", "keep_body" }
+
+-- the request_pool errors (ERR), as raised by async.request
+local ERRORS = {
+  [-1] = "error in file descriptors set operation",
+  [-2] = "multi interface timeout",
+  [-3] = "file descriptors select result is invalid",
+  [-4] = "requests scheduling allocation failed",
+  [-5] = "requests allocation failed",
+}
+
+-- the columnar result columns, in the RESULT_COLUMNS order
+local COLUMNS = { "names", "url", "status", "body", "headers", "error", "state",
+                  "queue_time", "total_time", "cache_status", "ranges", "json", "decode_error", "endpoint" }
+
+local TBL_KEY_SZ, TBL_VAL_SZ, HEADER_SPACING = 256, 1024, 2
+local MAX_SUCCESS_CODES = 32
+local CANCEL_TOKEN_MT = getmetatable(async.cancel_token())
+local null = async.null
+
+local result_ptr = ffi.new("lua_async_http_result*[1]")
+
+-- a flag, either a lua boolean or a (1|0) number (l_tobool)
+local function tobool(value)
+  if type(value) == "number" then return value ~= 0 end
+  return value ~= nil and value ~= false
+end
+
+-- the batch options, read as batch_options_processor does
+local function batch_descriptor(options)
+  local batch = ffi.new("lua_async_http_batch")
+  batch.dns_cache_timeout = -1
+  if type(options) ~= "table" then return batch end
+
+  if type(options.deadline_ms) == "number" then batch.deadline_ms = options.deadline_ms end
+  if type(options.concurrency) == "number" then batch.concurrency = options.concurrency end
+  if type(options.threads) == "number" then batch.threads = options.threads end
+  if type(options.k) == "number" then batch.quorum = options.k end
+  if type(options.max_per_host) == "number" then batch.max_per_host = options.max_per_host end
+  if type(options.dns_cache_timeout) == "number" then batch.dns_cache_timeout = options.dns_cache_timeout end
+  if type(options.cancel) == "userdata" and getmetatable(options.cancel) == CANCEL_TOKEN_MT then batch.cancel = options.cancel end
+
+  if options.wait == "any" then batch.wait = 1
+  elseif options.wait == "quorum" then batch.wait = 2 end
+
+  batch.prefetch_dns = tobool(options.prefetch_dns) and 1 or 0
+  batch.coalesce = tobool(options.coalesce) and 1 or 0
+  batch.cache = tobool(options.cache) and 1 or 0
+
+  if type(options.success) == "table" then
+    for i = 1, #options.success do
+      local status = options.success[i]
+      if type(status) == "number" and batch.success_codes_count < MAX_SUCCESS_CODES then
+        batch.success_codes[batch.success_codes_count] = status
+        batch.success_codes_count = batch.success_codes_count + 1
+      elseif type(status) == "string" and status:match("^%d[xX][xX]$") then
+        batch.success_classes = bit.bor(batch.success_classes, bit.lshift(1, tonumber(status:sub(1, 1))))
+      end
+    end
+  end
+  return batch
+end
+
+-- fills a request descriptor, 'anchors' keeps the strings built here alive during the call
+local function request_descriptor(descriptor, request, anchors)
+  for i = 1, #STRING_KEYS do
+    local value = request[STRING_KEYS[i]]
+    if type(value) == "string" then descriptor.strings[i - 1] = value end
+  end
+
+  for i = 1, #NUMBER_KEYS do
+    local value = request[NUMBER_KEYS[i]]
+    if type(value) == "boolean" then value = value and 1 or 0 end
+    if type(value) == "number" then
+      descriptor.numbers[i - 1] = value
+      descriptor.numbers_set = bit.bor(descriptor.numbers_set, bit.lshift(1, i - 1))
+    end
+  end
+
+  -- headers = { { ["Name"] = "value" }, ... }, as set_request_headers reads them
+  local headers = request.headers
+  if type(headers) == "table" then
+    local count = #headers
+    local lines = ffi.new("const char*[?]", count + 1)
+    for i = 1, count do
+      local line = ""
+      if type(headers[i]) == "table" then
+        for name, value in pairs(headers[i]) do
+          if type(name) == "string" and type(value) == "string" then line = line .. name .. ": " .. value end
+        end
+      end
+      anchors[#anchors + 1] = line
+      lines[i - 1] = line
+    end
+    anchors[#anchors + 1] = lines
+    descriptor.headers = lines
+    descriptor.headers_count = count
+  end
+end
+
+-- the response headers table, parsed as l_pushheaders does
+local function headers_table(buffer)
+  local headers = {}
+  if buffer.len == 0 then return headers end
+  for line in ffi.string(buffer.ptr, buffer.len):gmatch("[^\r\n]+") do
+    local colon = line:find(":", 1, true)
+    if colon and colon - 1 < TBL_KEY_SZ and #line - colon + 1 < TBL_VAL_SZ - HEADER_SPACING then
+      headers[line:sub(1, colon - 1):lower()] = line:sub(colon + HEADER_SPACING)
+    end
+  end
+  return headers
+end
+
+-- builds the decoded value at 'index' of the response tape, returns it with the next index
+local function json_value(response, index)
+  local token = response.json[index]
+  local token_type = token.type
+
+  if token_type == 0 then return null, index + 1
+  elseif token_type == 1 then return false, index + 1
+  elseif token_type == 2 then return true, index + 1
+  elseif token_type == 3 then return token.number, index + 1
+  elseif token_type == 4 then
+    local base = (token.escaped ~= 0) and response.json_strings or response.json_body
+    return ffi.string(base + token.offset, token.len), index + 1
+  end
+
+  local count, value = tonumber(token.len), nil
+  index = index + 1
+  if token_type == 5 then
+    local array = table_new(count, 0)
+    for i = 1, count do
+      value, index = json_value(response, index)
+      array[i] = value
+    end
+    return array, index
+  end
+
+  local object, key = table_new(0, count), nil
+  for _ = 1, count do
+    key, index = json_value(response, index)
+    value, index = json_value(response, index)
+    object[key] = value
+  end
+  return object, index
+end
+
+-- svc:// urls target an upstream pool, as is_upstream_url checks
+local function is_upstream_url(response)
+  return response.url.len >= 6 and ffi.string(response.url.ptr, 6) == "svc://"
+end
+
+-- a single column value of a response (nil leaves a hole), as l_pushcolumn pushes it
+local function column_value(response, column)
+  if column == "names" then return ffi.string(response.name.ptr, response.name.len)
+  elseif column == "url" then return ffi.string(response.url.ptr, response.url.len)
+  elseif column == "status" then return tonumber(response.status)
+  elseif column == "body" then return ffi.string(response.body.ptr, response.body.len)
+  elseif column == "headers" then return headers_table(response.headers)
+  elseif column == "error" then return ffi.string(response.error.ptr, response.error.len)
+  elseif column == "state" then return ffi.string(response.state)
+  elseif column == "queue_time" then return response.queue_time
+  elseif column == "total_time" then return response.total_time
+  elseif column == "cache_status" then return ffi.string(response.cache_status)
+  elseif column == "ranges" then return tonumber(response.ranges)
+  elseif column == "json" then
+    if response.json ~= nil then return (json_value(response, 0)) end
+  elseif column == "decode_error" then
+    if response.decode ~= 0 then return ffi.string(response.decode_error.ptr, response.decode_error.len) end
+  elseif column == "endpoint" then
+    if is_upstream_url(response) then return ffi.string(response.endpoint.ptr, response.endpoint.len) end
+  end
+  return nil
+end
+
+-- the parallel arrays of result_format = "columnar", as generate_columnar_response pushes them
+local function generate_columnar_response(result, columns)
+  local count = tonumber(result.count)
+  local res = table_new(0, #COLUMNS + 1)
+  res.count = count
+  for c = 1, #COLUMNS do
+    local column = COLUMNS[c]
+    if columns[column] then
+      local values = table_new(count, 0)
+      for i = 1, count do values[i] = column_value(result.responses[i - 1], column) end
+      res[column] = values
+    end
+  end
+  return res
+end
+
+-- the responses table, as generate_response pushes it
+local function generate_response(result)
+  local res = {}
+  for i = 0, tonumber(result.count) - 1 do
+    local response = result.responses[i]
+    local fields = {
+      url              = ffi.string(response.url.ptr, response.url.len),
+      response_status  = tonumber(response.status),
+      response_body    = ffi.string(response.body.ptr, response.body.len),
+      response_headers = headers_table(response.headers),
+      response_error   = ffi.string(response.error.ptr, response.error.len),
+      response_state   = ffi.string(response.state),
+      queue_time       = response.queue_time,
+      total_time       = response.total_time,
+      cache_status     = ffi.string(response.cache_status),
+      ranges           = tonumber(response.ranges),
+    }
+    if response.json ~= nil then fields.response_json = json_value(response, 0) end
+    if response.decode ~= 0 then fields.decode_error = ffi.string(response.decode_error.ptr, response.decode_error.len) end
+    if is_upstream_url(response) then fields.endpoint = ffi.string(response.endpoint.ptr, response.endpoint.len) end
+    res[ffi.string(response.name.ptr, response.name.len)] = fields
+  end
+  return res
+end
+
+-- the result columns set (all of them by default), as set_result_columns reads them
+local function result_columns(options)
+  local columns = {}
+  if type(options.columns) ~= "table" then
+    for c = 1, #COLUMNS do columns[COLUMNS[c]] = true end
+    return columns
+  end
+  for i = 1, #options.columns do
+    if type(options.columns[i]) == "string" then columns[options.columns[i]] = true end
+  end
+  return columns
+end
+
+-- the responses (rows or columns) and the stats table, as generate_stats pushes it
+local function generate_result(result, options)
+  local res
+  if type(options) == "table" and options.result_format == "columnar" then
+    res = generate_columnar_response(result, result_columns(options))
+  else res = generate_response(result) end
+
+  local stats = result.stats
+  return res, {
+    requests = tonumber(stats.requests), completed = tonumber(stats.completed), succeeded = tonumber(stats.succeeded),
+    cancelled = tonumber(stats.cancelled), deadline_exceeded = tonumber(stats.deadline_exceeded),
+    circuit_open = tonumber(stats.circuit_open), coalesced = tonumber(stats.coalesced),
+    cache_hits = tonumber(stats.cache_hits), cache_misses = tonumber(stats.cache_misses),
+    cache_revalidated = tonumber(stats.cache_revalidated), threads = tonumber(stats.threads),
+    stolen = tonumber(stats.stolen), wait_met = stats.wait_met ~= 0,
+  }
+end
+
+-- async.request, through the ffi abi
+local function request(requests, options)
+  -- the options the abi doesn't carry (host tables) take the lua C API path
+  if type(options) == "table" and (type(options.resolve) == "table" or type(options.host_weights) == "table" or
+                                   type(options.coalesce) == "table") then
+    return async.request(requests, options)
+  end
+
+  local count = (type(requests) == "table") and #requests or 0
+  local descriptors = ffi.new("lua_async_http_request[?]", count + 1)
+  local anchors = {}
+  for i = 1, count do
+    if type(requests[i]) == "table" then request_descriptor(descriptors[i - 1], requests[i], anchors) end
+  end
+
+  local status = lib.lua_async_http_execute(async.context(), descriptors, count, batch_descriptor(options), result_ptr)
+  if status ~= 0 then error(ERRORS[status] or "requests allocation failed", 0) end
+
+  local result = result_ptr[0]
+  local ok, res, stats = pcall(generate_result, result, options)
+  lib.lua_async_http_release(result)
+  async.drain_log()
+  if not ok then error(res, 0) end
+  return res, stats
+end
+
+return setmetatable({ request = request }, { __index = async })
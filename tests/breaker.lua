@@ -0,0 +1,99 @@
+#!/usr/bin/lua
+-- Circuit breaker test against an httpbin server: the breaker is opt-in,
+-- opens on consecutive failures or on the window error rate, fails fast
+-- while open, lets a single probe through once half open, and closes on
+-- a successful probe. A new rate limit grants its burst right away.
+--
+-- usage: lua breaker.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+local host = url:match("^%a+://([^/:]+)")
+
+local function call(...)
+  local requests = {}
+  for i, status in ipairs({...}) do
+    requests[i] = { name = "r"..i, url = url.."/status/"..status, method = "GET", timeout = 10 }
+  end
+  return async_http.request(requests, { concurrency = #requests })
+end
+
+local function expect_state(expected, label)
+  local st = async_http.breaker_state(host)
+  assert(st.state == expected, string.format("%s: breaker %q, expected %q", label, st.state, expected))
+  return st
+end
+
+local function sleep(seconds)
+  os.execute("sleep "..seconds)
+end
+
+-- opt-in: without a breaker table the host never opens
+async_http.reset_breaker(host)
+for _ = 1, 6 do call(500) end
+expect_state("closed", "default policy")
+
+-- consecutive failures
+async_http.host_policy(host, { breaker = { failures = 2, open_ms = 500 } })
+async_http.reset_breaker(host)
+call(500)
+call(200)                                     -- a success resets the streak
+call(500)
+expect_state("closed", "interrupted streak")
+call(500)
+expect_state("open", "two failures in a row")
+
+-- open: fail fast, no connection is made
+local res, stats = call(200, 200)
+assert(res.r1.response_state == "circuit_open" and res.r2.response_state == "circuit_open", "open breaker let a request through")
+assert(stats.circuit_open == 2, "circuit_open stat")
+assert(async_http.breaker_state(host).rejected >= 2, "rejected counter")
+
+-- half open: a failed probe opens the breaker again
+sleep(0.6)
+expect_state("half_open", "after open_ms")
+call(500)
+expect_state("open", "failed probe")
+
+-- half open: a single probe at a time, a successful one closes the breaker
+sleep(0.6)
+res = call(200, 200, 200)
+local probes, rejected = 0, 0
+for i = 1, 3 do
+  if res["r"..i].response_state == "circuit_open" then rejected = rejected + 1
+  elseif res["r"..i].response_status == 200 then probes = probes + 1 end
+end
+assert(probes == 1 and rejected == 2, string.format("half open: %d probes, %d rejected", probes, rejected))
+local st = expect_state("closed", "successful probe")
+assert(st.consecutive_failures == 0, "closed breaker keeps its failures")
+
+-- error rate: half of at least 4 requests in the window
+async_http.host_policy(host, { breaker = { failures = 0, error_rate = 0.5, min_requests = 4, window_ms = 10000, open_ms = 500 } })
+async_http.reset_breaker(host)
+call(200)
+call(500)
+call(200)
+expect_state("closed", "under min_requests")
+call(500)
+st = expect_state("open", "error rate reached")
+assert(st.window_requests == 4 and st.window_failures == 2, "error rate window counters")
+
+-- breaker = false turns it off
+async_http.host_policy(host, { breaker = false })
+async_http.reset_breaker(host)
+for _ = 1, 6 do call(500) end
+expect_state("closed", "disabled breaker")
+
+-- rate limit: a new policy starts from a full bucket, the burst goes out at once
+async_http.host_policy(host, { rate_limit = { rate = 1, burst = 3 } })
+res = call(200, 200, 200, 200)
+for i = 1, 3 do assert(res["r"..i].queue_time < 0.5, "burst request r"..i.." was throttled") end
+assert(res.r4.queue_time >= 0.5, "the request past the burst wasn't throttled")
+async_http.host_policy(host, { rate_limit = false })
+
+print("breaker ok")
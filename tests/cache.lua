@@ -0,0 +1,87 @@
+#!/usr/bin/lua
+-- Response cache test against an httpbin server: freshness, revalidation,
+-- the Authorization rule and the LRU eviction (cache_size).
+--
+-- usage: lua cache.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+
+local function get(path, headers)
+  local res, stats = async_http.request({
+    { name = "r", url = url..path, method = "GET", timeout = 10, headers = headers }
+  }, { cache = true })
+  assert(res.r.response_status == 200, path..": status "..tostring(res.r.response_status).." "..res.r.response_error)
+  return res.r.cache_status, stats
+end
+
+local function expect(path, expected, headers)
+  local status = get(path, headers)
+  assert(status == expected, string.format("%s: cache_status %q, expected %q", path, status, expected))
+end
+
+local function sleep(seconds)
+  os.execute("sleep "..seconds)
+end
+
+async_http.configure({ cache_size = 32 * 1024 * 1024 })
+async_http.cache_clear()
+
+-- freshness: served without a network call until max-age, then fetched again
+expect("/cache/1", "miss")
+expect("/cache/1", "hit")
+sleep(1.2)
+expect("/cache/1", "miss")
+
+-- revalidation: an ETag without max-age is stale right away, a 304 serves the cached body
+expect("/etag/v1", "miss")
+expect("/etag/v1", "revalidated")
+
+-- coalesced copies of a revalidation are served along with their leader
+local requests = {}
+for i = 1, 3 do requests[i] = { name = "r"..i, url = url.."/etag/v1", method = "GET", timeout = 10 } end
+local res, stats = async_http.request(requests, { cache = true, coalesce = true })
+for i = 1, 3 do assert(res["r"..i].cache_status == "revalidated", "coalesced r"..i..": "..res["r"..i].cache_status) end
+assert(stats.cache_revalidated == 3 and stats.cache_misses == 0 and stats.coalesced == 2, "coalesced revalidation stats")
+
+-- uncacheable responses
+expect("/response-headers?Cache-Control=no-store", "miss")
+expect("/response-headers?Cache-Control=no-store", "miss")
+expect("/cache/60", "", { { ["Cache-Control"] = "no-cache" } })   -- bypasses the cache
+
+-- Authorization: only public responses are stored
+local auth = { { ["Authorization"] = "Bearer token" } }
+expect("/response-headers?Cache-Control=max-age%3D60", "miss", auth)
+expect("/response-headers?Cache-Control=max-age%3D60", "miss", auth)
+expect("/cache/60?auth=1", "miss", auth)
+expect("/cache/60?auth=1", "hit", auth)
+
+-- LRU eviction: room for two entries of the same size
+async_http.cache_clear()
+expect("/cache/60?id=a", "miss")
+local one = async_http.cache_stats().bytes
+async_http.configure({ cache_size = math.floor(one * 2.5) })
+
+expect("/cache/60?id=b", "miss")
+expect("/cache/60?id=a", "hit")           -- 'a' is the most recently used, 'b' the least
+expect("/cache/60?id=c", "miss")          -- evicts 'b'
+local cs = async_http.cache_stats()
+assert(cs.entries == 2 and cs.evictions >= 1, "lru: entries "..cs.entries)
+expect("/cache/60?id=a", "hit")
+expect("/cache/60?id=c", "hit")
+expect("/cache/60?id=b", "miss")          -- evicts 'a'
+
+-- a smaller cache_size evicts from the LRU tail down to it, the recent entries stay
+async_http.configure({ cache_size = math.floor(one * 1.5) })
+cs = async_http.cache_stats()
+assert(cs.entries == 1 and cs.bytes <= cs.max_bytes, "resize: entries "..cs.entries)
+expect("/cache/60?id=b", "hit")
+
+async_http.configure({ cache_size = 32 * 1024 * 1024 })
+async_http.cache_clear()
+print("cache ok")
@@ -0,0 +1,64 @@
+#!/usr/bin/lua
+-- Batch deadline and cancel token test against an httpbin server: the
+-- deadline aborts the in-flight requests and never starts the queued ones,
+-- a fired token ends the batch right away and a reset one is armed again.
+--
+-- usage: lua deadline.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+
+local function batch(...)
+  local requests = {}
+  for i, path in ipairs({...}) do
+    requests[i] = { name = "r"..i, url = url..path, method = "GET", timeout = 10 }
+  end
+  return requests
+end
+
+local function expect_states(res, expected, label)
+  for i, state in ipairs(expected) do
+    local got = res["r"..i].response_state
+    assert(got == state, string.format("%s: r%d is %q, expected %q", label, i, got, state))
+  end
+end
+
+-- deadline: the slow transfers are aborted once it expires
+local res, stats = async_http.request(batch("/get", "/delay/5", "/delay/5"), { deadline_ms = 500 })
+expect_states(res, { "done", "deadline_exceeded", "deadline_exceeded" }, "deadline")
+assert(stats.deadline_exceeded == 2 and stats.succeeded == 1 and stats.cancelled == 0, "deadline stats")
+for i = 2, 3 do
+  local r = res["r"..i]
+  assert(r.response_status == 0 and r.response_error:find("deadline", 1, true), "r"..i.." error: "..r.response_error)
+  assert(r.total_time < 2, string.format("r%d ran %.2fs past the deadline", i, r.total_time))
+end
+
+-- deadline: the queued requests are never started past it
+res, stats = async_http.request(batch("/delay/1", "/delay/1", "/delay/1"), { deadline_ms = 1500, concurrency = 1 })
+expect_states(res, { "done", "deadline_exceeded", "deadline_exceeded" }, "queued past the deadline")
+assert(stats.deadline_exceeded == 2, "queued past the deadline: stats")
+assert(res.r3.queue_time == 0 and res.r3.response_status == 0, "a request started past the deadline")
+
+-- a fired token: nothing starts, every request is cancelled
+local token = async_http.cancel_token()
+assert(not token:cancelled(), "a new token is fired")
+token:cancel()
+assert(token:cancelled(), "token:cancel()")
+res, stats = async_http.request(batch("/get", "/get"), { cancel = token })
+expect_states(res, { "cancelled", "cancelled" }, "fired token")
+assert(stats.cancelled == 2 and stats.succeeded == 0 and stats.deadline_exceeded == 0, "fired token stats")
+assert(res.r1.response_status == 0 and res.r1.response_error:find("cancel", 1, true), "fired token error: "..res.r1.response_error)
+
+-- a reset token lets the batch run
+token:reset()
+assert(not token:cancelled(), "token:reset()")
+res, stats = async_http.request(batch("/get", "/get"), { cancel = token, deadline_ms = 5000 })
+expect_states(res, { "done", "done" }, "reset token")
+assert(stats.succeeded == 2 and stats.cancelled == 0 and stats.deadline_exceeded == 0, "reset token stats")
+
+print("deadline ok")
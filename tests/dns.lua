@@ -0,0 +1,79 @@
+#!/usr/bin/lua
+-- DNS test against an httpbin server: resolve warms the shared DNS cache,
+-- static overrides pin a made up host to the server address (the batch ones
+-- over the module ones), a zero TTL turns prefetch_dns off and a negative
+-- TTL (libcurl's "forever") is ignored.
+--
+-- usage: lua dns.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+local host = url:match("^%a+://([^/:]+)")
+local port = url:match("^%a+://[^/]+:(%d+)") or (url:match("^https") and "443" or "80")
+local pinned_url = url:gsub(host, "pinned.test", 1)
+local unknown = "nonexistent.invalid"
+
+-- resolve: every target gets its addresses, an unknown host its error
+local res = async_http.resolve({ host, url, host..":"..port, unknown })
+for _, target in ipairs({ host, url, host..":"..port }) do
+  assert(#res[target].addresses > 0 and res[target].error == "", target.." wasn't resolved: "..res[target].error)
+end
+assert(#res[unknown].addresses == 0 and res[unknown].error:find(unknown, 1, true), "unknown host resolved")
+
+-- the server address, as pinned below
+local address = res[host].addresses[1]
+if address:find(":", 1, true) then address = "["..address.."]" end
+
+local function get(request_url, options)
+  return async_http.request({ { name = "r", url = request_url.."/get", method = "GET", timeout = 5 } }, options).r
+end
+
+-- a batch override pins a host nothing else resolves
+local r = get(pinned_url)
+assert(r.response_status == 0, "pinned.test resolved without an override")
+r = get(pinned_url, { resolve = { "pinned.test:"..port..":"..address } })
+assert(r.response_status == 200, "batch pin: "..r.response_error)
+
+-- the batch override wins over the module one for the same host:port
+async_http.configure({ resolve = { "pinned.test:"..port..":192.0.2.1" } })   -- TEST-NET, never answers
+r = get(pinned_url, { resolve = { "pinned.test:"..port..":"..address } })
+assert(r.response_status == 200, "batch pin over the module pin: "..r.response_error)
+async_http.configure({ resolve = {} })
+
+-- prefetch_dns: a lookup failure is logged by prefetch_dns, so the lua sink tells whether it ran
+local prefetched
+async_http.set_logger(function(record)
+  if record.func == "prefetch_dns" then prefetched = true end
+end)
+
+local function prefetch(options)
+  prefetched = false
+  options.prefetch_dns = true
+  async_http.request({
+    { name = "ok", url = url.."/get", method = "GET", timeout = 5 },
+    { name = "unknown", url = "http://"..unknown.."/get", method = "GET", timeout = 5 },
+  }, options)
+  async_http.flush_log()
+  return prefetched
+end
+
+assert(prefetch({}), "prefetch_dns didn't run")
+assert(not prefetch({ dns_cache_timeout = 0 }), "a zero batch TTL prefetched")
+
+-- negative TTLs are ignored: the batch falls back to the module TTL, configure keeps it
+async_http.configure({ dns_cache_timeout = 0 })
+assert(not prefetch({}), "a zero module TTL prefetched")
+assert(not prefetch({ dns_cache_timeout = -1 }), "a negative batch TTL overrode the module TTL")
+async_http.configure({ dns_cache_timeout = -1 })
+assert(not prefetch({}), "a negative module TTL was applied")
+async_http.configure({ dns_cache_timeout = 60 })
+assert(prefetch({ dns_cache_timeout = -1 }), "a negative batch TTL over a 60s module TTL")
+
+async_http.set_logger("stderr")
+
+print("dns ok")
@@ -0,0 +1,77 @@
+#!/usr/bin/luajit
+-- FFI parity test: the same batch through lua_async_http (lua C API) and
+-- lua_async_http_ffi (LuaJIT FFI) must give the same responses and stats.
+-- Then both paths are timed on small request batches.
+--
+-- usage: luajit ffi_parity.lua [url] [batches] [batch_size]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+package.path = package.path..";../src/?.lua;src/?.lua"
+local async_http = require("lua_async_http")
+local async_ffi  = require("lua_async_http_ffi")
+assert(async_ffi ~= async_http, "the ffi path needs LuaJIT")
+
+local url        = arg[1] or "http://127.0.0.1:8080/"
+local batches    = tonumber(arg[2]) or 200
+local batch_size = tonumber(arg[3]) or 20
+
+-- varies between two answers of the same request
+local VOLATILE = { queue_time = true, total_time = true, date = true }
+
+local function compare(expected, actual, path)
+  if type(expected) ~= "table" or type(actual) ~= "table" then
+    assert(expected == actual, string.format("%s: %s ~= %s", path, tostring(expected), tostring(actual)))
+    return
+  end
+  for key, value in pairs(expected) do
+    if not VOLATILE[key] then compare(value, actual[key], path.."."..tostring(key)) end
+  end
+  for key in pairs(actual) do
+    assert(VOLATILE[key] or expected[key] ~= nil, path.."."..tostring(key).." is only in the ffi response")
+  end
+end
+
+local function batch()
+  return {
+    { name = "get", url = url, method = "GET", timeout = 10, headers = { { ["X-Parity"] = "1" } } },
+    { name = "head", url = url, method = "HEAD", verify_peer = false, priority = 2 },
+    { name = "decoded", url = url, method = "GET", decode = "json", keep_body = true },
+    { name = "post", url = url, method = "POST", data = "{\"parity\":true}", expectations = 0 },
+    { name = "unreachable", url = "http://127.0.0.1:1/", method = "GET", timeout = 1 },
+  }
+end
+
+local BATCH_OPTIONS = {
+  {}, { threads = 2, concurrency = 3 }, { wait = "any" }, { cache = true }, { success = { "2xx", 404 } },
+  { result_format = "columnar" }, { result_format = "columnar", columns = { "names", "status", "json" } },
+}
+
+for _, options in ipairs(BATCH_OPTIONS) do
+  async_http.cache_clear()
+  local expected, expected_stats = async_http.request(batch(), options)
+  async_http.cache_clear()
+  local actual, actual_stats = async_ffi.request(batch(), options)
+
+  -- the first answer settles a wait any batch, which one differs between runs
+  if options.wait ~= "any" then
+    compare(expected, actual, "res")
+    compare(expected_stats, actual_stats, "stats")
+  end
+end
+print("parity ok")
+
+local function run(async, label)
+  local started = os.clock()
+  for _ = 1, batches do
+    local requests = {}
+    for i = 1, batch_size do requests[i] = { name = "r"..i, url = url, method = "GET", timeout = 10 } end
+    local res = async.request(requests, { concurrency = batch_size })
+    assert(res.r1.response_status == 200, "request failed")
+  end
+  local elapsed = os.clock() - started
+  print(string.format("%s: %d batches of %d, cpu=%.3fs", label, batches, batch_size, elapsed))
+  return elapsed
+end
+
+local c_api = run(async_http, "lua C API")
+local ffi = run(async_ffi, "LuaJIT FFI")
+print(string.format("  ffi cpu x%.2f of the lua C API", ffi / c_api))
@@ -0,0 +1,122 @@
+#!/usr/bin/lua
+-- JSON decoder test: bodies are served from local files (file:// urls),
+-- so no server is needed. Each body either decodes to the expected value,
+-- or fails with the expected decode_error.
+--
+-- usage: lua json_decode.lua
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local null = async_http.null
+
+local CASES = {
+  -- values
+  { body = '{"a": [1, -2.5e3, true, false, null], "b": {"c": "x"}}',
+    value = { a = { 1, -2500, true, false, null }, b = { c = "x" } } },
+  { body = '  [ ]  ', value = {} },
+  { body = '{}', value = {} },
+  { body = '0', value = 0 },
+  { body = '-0.125', value = -0.125 },
+  { body = '1E2', value = 100 },
+  { body = '2e-2', value = 0.02 },
+  { body = '[1.5, 10.25]', value = { 1.5, 10.25 } },
+
+  -- escapes
+  { body = '"tab\\t nl\\n cr\\r bs\\b ff\\f q\\" sl\\/ bsl\\\\"', value = "tab\t nl\n cr\r bs\b ff\f q\" sl/ bsl\\" },
+  { body = '"\\u0041\\u00e9\\u20ac"', value = "A\195\169\226\130\172" },
+  { body = '"a fairly long string that spans more than sixteen bytes\\nwith an escape late in it"',
+    value = "a fairly long string that spans more than sixteen bytes\nwith an escape late in it" },
+
+  -- surrogate pairs
+  { body = '"\\ud83d\\ude00"', value = "\240\159\152\128" },
+  { body = '"\\uD834\\uDD1E clef"', value = "\240\157\132\158 clef" },
+  { body = '"\\ud800"', error = "invalid unicode surrogate pair" },
+  { body = '"\\ud800\\u0041"', error = "invalid unicode surrogate pair" },
+  { body = '"\\udc00"', error = "invalid unicode surrogate pair" },
+  { body = '"\\u12"', error = "invalid unicode escape" },
+  { body = '"\\x41"', error = "invalid escape" },
+  { body = '"ctl\1"', error = "control character in string" },
+  { body = '"open', error = "unterminated string" },
+
+  -- depth limit (512)
+  { body = string.rep("[", 512)..string.rep("]", 512), depth = 512 },
+  { body = string.rep("[", 513)..string.rep("]", 513), error = "nesting too deep at offset 512" },
+
+  -- malformed numbers
+  { body = '01', error = "trailing characters at offset 1" },
+  { body = '-', error = "invalid number" },
+  { body = '1.', error = "invalid number" },
+  { body = '1.e5', error = "invalid number" },
+  { body = '1e', error = "invalid number" },
+  { body = '1e+', error = "invalid number" },
+  { body = '.5', error = "unexpected character at offset 0" },
+  { body = '+1', error = "unexpected character at offset 0" },
+  { body = '[1, 2,]', error = "unexpected character at offset 6" },
+
+  -- malformed documents
+  { body = '', error = "unexpected end of body at offset 0" },
+  { body = '{"a" 1}', error = "expected ':' at offset 5" },
+  { body = '{1: 2}', error = "expected an object key" },
+  { body = 'nul', error = "invalid literal" },
+  { body = '[1] x', error = "trailing characters at offset 4" },
+}
+
+local function equals(expected, actual)
+  if type(expected) ~= "table" or type(actual) ~= "table" then return expected == actual end
+  for key, value in pairs(expected) do
+    if not equals(value, actual[key]) then return false end
+  end
+  for key in pairs(actual) do
+    if expected[key] == nil then return false end
+  end
+  return true
+end
+
+local function depth(value)
+  local d = 0
+  while type(value) == "table" do
+    d = d + 1
+    value = value[1]
+  end
+  return d
+end
+
+-- numbers must not follow a comma decimal LC_NUMERIC
+os.setlocale("de_DE.UTF-8", "numeric")
+
+local files, requests = {}, {}
+for i, case in ipairs(CASES) do
+  files[i] = os.tmpname()
+  local file = assert(io.open(files[i], "wb"))
+  file:write(case.body)
+  file:close()
+  requests[i] = { name = "case"..i, url = "file://"..files[i], method = "GET", decode = "json" }
+end
+
+local res = async_http.request(requests)
+os.setlocale("C", "numeric")
+for _, path in ipairs(files) do os.remove(path) end
+
+local failed = 0
+for i, case in ipairs(CASES) do
+  local r = res["case"..i]
+  local ok
+  if case.error then
+    ok = r.response_json == nil and r.decode_error:find(case.error, 1, true) ~= nil
+  elseif case.depth then
+    ok = r.decode_error == "" and depth(r.response_json) == case.depth
+  else
+    ok = r.decode_error == "" and equals(case.value, r.response_json)
+  end
+  if not ok then
+    failed = failed + 1
+    print(string.format("FAIL case %d %q: decode_error = %q", i, case.body:sub(1, 40), r.decode_error))
+  end
+end
+
+assert(failed == 0, failed.." json cases failed")
+print("json decode ok ("..#CASES.." cases)")
@@ -0,0 +1,75 @@
+#!/usr/bin/lua
+-- Multi-state stress test: each lane runs the module in its own lua state
+-- (and OS thread), with its own context. Throughput should scale with the lanes.
+--
+-- usage: lua multi_state_stress.lua [url] [lanes] [batches] [batch_size]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local lanes = require("lanes").configure()
+
+local url        = arg[1] or "http://127.0.0.1:8080/"
+local max_lanes  = tonumber(arg[2]) or 4
+local batches    = tonumber(arg[3]) or 50
+local batch_size = tonumber(arg[4]) or 20
+
+-- runs 'batches' batches on a fresh lua state, returns the successes and failures
+local worker = lanes.gen("*", function(url, batches, batch_size, lane_id)
+  package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+  local async_http = require("lua_async_http")
+  local succeeded, failed = 0, 0
+
+  -- per state options, must not leak into the other lanes
+  async_http.configure({ max_connects = batch_size })
+
+  for batch = 1, batches do
+    local requests = {}
+    for i = 1, batch_size do
+      requests[i] = { name = "lane"..lane_id.."_"..i, url = url, method = "GET", timeout = 10 }
+    end
+
+    local ok, res = pcall(async_http.request, requests, { concurrency = batch_size, cache = (batch % 2 == 0) })
+    if not ok then error(res) end
+
+    for _, response in pairs(res) do
+      if response.response_status == 200 then succeeded = succeeded + 1
+      else failed = failed + 1 end
+    end
+  end
+  return succeeded, failed
+end)
+
+local function run(total_lanes)
+  local started = lanes.now_secs()
+  local handles, succeeded, failed = {}, 0, 0
+
+  for i = 1, total_lanes do handles[i] = worker(url, batches, batch_size, i) end
+  for i = 1, total_lanes do
+    local ok, lane_failed = handles[i]:join()
+    if ok == nil then error(string.format("lane %d failed: %s", i, tostring(lane_failed))) end
+    succeeded, failed = succeeded + ok, failed + lane_failed
+  end
+
+  local elapsed = lanes.now_secs() - started
+  print(string.format("lanes=%d requests=%d succeeded=%d failed=%d elapsed=%.2fs throughput=%.0f req/s",
+                      total_lanes, succeeded + failed, succeeded, failed, elapsed, (succeeded + failed) / elapsed))
+  assert(failed == 0, "some requests failed")
+  assert(succeeded == total_lanes * batches * batch_size, "missing responses")
+  return (succeeded + failed) / elapsed
+end
+
+local single = run(1)
+local lanes_count = 2
+while lanes_count <= max_lanes do
+  local throughput = run(lanes_count)
+  print(string.format("  scaling x%.2f over a single lane", throughput / single))
+  lanes_count = lanes_count * 2
+end
+
+-- loading the module and closing lua states concurrently (context __gc)
+local loaders = {}
+for i = 1, max_lanes * 4 do loaders[i] = worker(url, 1, 1, i) end
+for i = 1, #loaders do assert(loaders[i]:join() == 1) end
+print("ok")
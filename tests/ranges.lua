@@ -0,0 +1,70 @@
+#!/usr/bin/lua
+-- Ranged downloads test against an httpbin server: /range/n answers Range
+-- requests with a known body ('a' to 'z' repeated), so the parts must be
+-- put back together at their offsets, in memory or in the output file.
+--
+-- usage: lua ranges.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+
+local SIZE = 100 * 1024                   -- the httpbin /range maximum
+local CHUNK = 16 * 1024
+
+local function expected_body(size)
+  local alphabet = "abcdefghijklmnopqrstuvwxyz"
+  return string.rep(alphabet, math.floor(size / 26))..alphabet:sub(1, size % 26)
+end
+
+local function get(request)
+  request.name, request.method, request.timeout = "r", "GET", 30
+  return async_http.request({ request }).r
+end
+
+local function read_file(path)
+  local file = assert(io.open(path, "rb"))
+  local content = file:read("*a")
+  file:close()
+  return content
+end
+
+-- single stream reference
+local r = get({ url = url.."/range/"..SIZE })
+assert(r.response_status == 200 and r.ranges == 0, "single stream")
+assert(r.response_body == expected_body(SIZE), "single stream body")
+
+-- parallel parts into memory
+r = get({ url = url.."/range/"..SIZE, parallel_ranges = 4, range_chunk_min = CHUNK })
+assert(r.response_status == 200 and r.ranges == 4, "ranged: status "..r.response_status..", ranges "..r.ranges.." "..r.response_error)
+assert(r.response_body == expected_body(SIZE), "ranged body")
+
+-- the parts never go below range_chunk_min
+r = get({ url = url.."/range/"..SIZE, parallel_ranges = 16, range_chunk_min = 40 * 1024 })
+assert(r.ranges == 2 and r.response_body == expected_body(SIZE), "range_chunk_min: ranges "..r.ranges)
+
+-- parallel parts into the output file
+local path = os.tmpname()
+r = get({ url = url.."/range/"..SIZE, parallel_ranges = 4, range_chunk_min = CHUNK, output_file = path })
+assert(r.response_status == 200 and r.ranges == 4 and r.response_body == "", "ranged output_file")
+assert(read_file(path) == expected_body(SIZE), "ranged output_file content")
+os.remove(path)
+
+-- an object smaller than two parts is a single stream
+r = get({ url = url.."/range/1000", parallel_ranges = 4, range_chunk_min = CHUNK })
+assert(r.ranges == 0 and r.response_body == expected_body(1000), "small object")
+
+-- no Accept-Ranges: a single stream
+r = get({ url = url.."/bytes/"..SIZE, parallel_ranges = 4, range_chunk_min = CHUNK })
+assert(r.response_status == 200 and r.ranges == 0 and #r.response_body == SIZE, "no range support")
+
+-- an output file that can't be opened fails the request, no fallback to memory
+r = get({ url = url.."/range/"..SIZE, parallel_ranges = 4, range_chunk_min = CHUNK, output_file = "/nonexistent/dir/out.bin" })
+assert(r.response_status == 0 and r.response_body == "", "unopenable output_file")
+assert(r.response_error:find("can't open", 1, true), "unopenable output_file error: "..r.response_error)
+
+print("ranges ok")
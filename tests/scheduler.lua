@@ -0,0 +1,61 @@
+#!/usr/bin/lua
+-- Scheduler order test against an httpbin server: with a single slot the
+-- requests run one after the other, so their queue_time gives the order
+-- they started in. Higher priorities start first, then the hosts share
+-- the slot by weighted round robin.
+--
+-- usage: lua scheduler.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+local host = url:match("^%a+://([^/:]+)")
+
+-- the same server under a second host name, so it gets its own queue
+local other_host = (host == "localhost") and "127.0.0.1" or "localhost"
+local other_url = url:gsub(host, other_host, 1)
+
+-- returns the request names in the order they started
+local function start_order(requests, options)
+  local res = async_http.request(requests, options)
+  local order = {}
+  for i, request in ipairs(requests) do
+    assert(res[request.name].response_status == 200, request.name..": "..res[request.name].response_error)
+    order[i] = { name = request.name, queued = res[request.name].queue_time }
+  end
+  table.sort(order, function(a, b) return a.queued < b.queued end)
+  for i, started in ipairs(order) do order[i] = started.name end
+  return order
+end
+
+-- priorities: higher first, batch order between equals
+local order = start_order({
+  { name = "p0", url = url.."/get", method = "GET", priority = 0 },
+  { name = "p5a", url = url.."/get", method = "GET", priority = 5 },
+  { name = "p1", url = url.."/get", method = "GET", priority = 1 },
+  { name = "p5b", url = url.."/get", method = "GET", priority = 5 },
+}, { concurrency = 1 })
+assert(table.concat(order, " ") == "p5a p5b p1 p0", "priority order: "..table.concat(order, " "))
+
+-- weighted round robin: 2 slots of the weighted host for 1 of the other one
+local requests = {}
+for i = 1, 6 do requests[#requests + 1] = { name = "a"..i, url = url.."/get", method = "GET" } end
+for i = 1, 6 do requests[#requests + 1] = { name = "b"..i, url = other_url.."/get", method = "GET" } end
+order = start_order(requests, { concurrency = 1, host_weights = { [host] = 2 } })
+
+local weighted = 0
+for i = 1, 6 do
+  if order[i]:sub(1, 1) == "a" then weighted = weighted + 1 end
+end
+assert(weighted == 4, "weighted round robin: "..table.concat(order, " "))
+
+-- a priority wins over the host weights
+requests[#requests + 1] = { name = "urgent", url = other_url.."/get", method = "GET", priority = 1 }
+order = start_order(requests, { concurrency = 1, host_weights = { [host] = 2 } })
+assert(order[1] == "urgent", "priority over weights: "..table.concat(order, " "))
+
+print("scheduler ok")
@@ -0,0 +1,58 @@
+#!/usr/bin/lua
+-- Threaded batches test against an httpbin server: the shards steal the
+-- queued requests of a shard stuck on a slow host, max_per_host holds for
+-- the whole batch (not per shard), and the results match a single thread run.
+--
+-- usage: lua threads.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+local host = url:match("^%a+://([^/:]+)")
+
+-- the same server under a second host name, so it gets its own queue
+local other_host = (host == "localhost") and "127.0.0.1" or "localhost"
+local other_url = url:gsub(host, other_host, 1)
+
+-- request i goes to shard i % threads: with 2 threads the slow requests all land on one shard
+local function skewed_batch()
+  local requests = {}
+  for i = 1, 16 do
+    local slow = (i % 2 == 1)
+    requests[i] = { name = "r"..i, method = "GET", timeout = 10,
+                    url = slow and (url.."/delay/1?i="..i) or (other_url.."/anything?i="..i) }
+  end
+  return requests
+end
+
+-- work stealing: the fast shard takes the slow shard queued requests
+local single, single_stats = async_http.request(skewed_batch(), { concurrency = 4, threads = 1 })
+local threaded, stats = async_http.request(skewed_batch(), { concurrency = 4, threads = 2 })
+assert(stats.threads == 2 and single_stats.threads == 1, "threads stat")
+assert(stats.stolen > 0, "no request was stolen")
+assert(stats.completed == 16 and stats.succeeded == single_stats.succeeded, "threaded stats")
+
+for i = 1, 16 do
+  local expected, actual = single["r"..i], threaded["r"..i]
+  assert(actual.response_status == expected.response_status and actual.response_state == expected.response_state,
+         string.format("r%d: %s/%s ~= %s/%s", i, actual.response_state, tostring(actual.response_status),
+                       expected.response_state, tostring(expected.response_status)))
+  assert(actual.url == expected.url, "r"..i.." url")
+end
+
+-- max_per_host is batch wide: 8 one second requests, 2 at a time, whatever the shards
+local requests = {}
+for i = 1, 8 do requests[i] = { name = "r"..i, url = url.."/delay/1?i="..i, method = "GET", timeout = 10 } end
+local res
+res, stats = async_http.request(requests, { concurrency = 8, threads = 4, max_per_host = 2 })
+assert(stats.threads == 4 and stats.succeeded == 8, "max_per_host batch")
+
+local max_queued = 0
+for i = 1, 8 do max_queued = math.max(max_queued, res["r"..i].queue_time) end
+assert(max_queued >= 2.9, string.format("max_per_host exceeded: the last request queued %.2fs only", max_queued))
+
+print("threads ok")
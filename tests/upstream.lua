@@ -0,0 +1,67 @@
+#!/usr/bin/lua
+-- Upstream pool test against an httpbin server, paired with an endpoint that
+-- refuses connections: concurrent requests spread by outstanding requests,
+-- the failing endpoint is ejected (its latency EWMA weighs at least the
+-- request timeout) and the pool traffic goes to the healthy one.
+--
+-- usage: lua upstream.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+local refused = "http://127.0.0.1:1"
+
+local function batch(count, path)
+  local requests = {}
+  for i = 1, count do requests[i] = { name = "r"..i, url = "svc://httpbin"..path, method = "GET", timeout = 2 } end
+  return async_http.request(requests, { concurrency = count })
+end
+
+async_http.upstream("httpbin", { url, refused }, { eject_failures = 1, eject_ms = 2000 })
+
+-- least outstanding requests: two concurrent requests go to both endpoints
+local res = batch(2, "/get")
+assert(res.r1.endpoint ~= res.r2.endpoint, "both requests went to "..res.r1.endpoint)
+for i = 1, 2 do
+  local r = res["r"..i]
+  if r.endpoint == url then assert(r.response_status == 200, "healthy endpoint: "..r.response_error)
+  else assert(r.endpoint == refused and r.response_status == 0, "refused endpoint answered") end
+end
+
+-- passive ejection after eject_failures, the failure weighs the 2s timeout
+local st = async_http.upstream_state("httpbin")
+assert(st[1].url == url and not st[1].ejected and st[1].failures == 0, "healthy endpoint state")
+assert(st[2].url == refused and st[2].ejected and st[2].ejections == 1, "refused endpoint wasn't ejected")
+assert(st[2].ewma_ms >= 2000, "failure EWMA "..st[2].ewma_ms)
+assert(st[1].ewma_ms > 0 and st[1].ewma_ms < st[2].ewma_ms, "healthy EWMA "..st[1].ewma_ms)
+
+-- the ejected endpoint gets no traffic
+res = batch(4, "/get")
+for i = 1, 4 do
+  assert(res["r"..i].endpoint == url and res["r"..i].response_status == 200, "r"..i.." went to "..res["r"..i].endpoint)
+end
+st = async_http.upstream_state("httpbin")
+assert(st[1].requests == 5 and st[1].in_flight == 0 and st[2].requests == 1, "endpoint counters")
+
+-- the request path and query follow the endpoint url
+res = batch(1, "/anything/a/b?q=1")
+assert(res.r1.response_body:find("/anything/a/b?q=1", 1, true), "svc path: "..res.r1.response_body)
+
+-- a pool name is case insensitive, an unknown pool fails the request
+res = async_http.request({
+  { name = "upper", url = "svc://HTTPBIN/get", method = "GET" },
+  { name = "unknown", url = "svc://nope/get", method = "GET" },
+})
+assert(res.upper.response_status == 200, "upper case pool name")
+assert(res.unknown.response_status == 0 and res.unknown.response_error:find("no upstream endpoint", 1, true), "unknown pool")
+
+-- redefining the pool keeps the state of the endpoints it keeps
+async_http.upstream("httpbin", { url })
+st = async_http.upstream_state("httpbin")
+assert(#st == 1 and st[1].requests == 7, "redefined pool")
+
+print("upstream ok")
@@ -0,0 +1,71 @@
+#!/usr/bin/lua
+-- Batch wait modes test against an httpbin server: "any" and "quorum" return
+-- once their condition is met (or can no longer be met), the requests left
+-- are cancelled instead of waited for.
+--
+-- usage: lua wait_modes.lua [httpbin_url]
+package.cpath = package.cpath..";/usr/lib/lua/5.1/?.so;"
+local paths = {
+  package.path -- the good ol' package.path
+}
+package.path = table.concat(paths, ";")
+local async_http = require("lua_async_http")
+
+local url = (arg[1] or "http://127.0.0.1:8080"):gsub("/$", "")
+
+local function batch(...)
+  local requests = {}
+  for i, path in ipairs({...}) do
+    requests[i] = { name = "r"..i, url = url..path, method = "GET", timeout = 10 }
+  end
+  return requests
+end
+
+local function expect_states(res, expected, label)
+  for i, state in ipairs(expected) do
+    local got = res["r"..i].response_state
+    assert(got == state, string.format("%s: r%d is %q, expected %q", label, i, got, state))
+  end
+end
+
+-- any: the first success settles the batch, the slow transfers are aborted
+local res, stats = async_http.request(batch("/status/200", "/delay/5", "/delay/5"), { wait = "any" })
+expect_states(res, { "done", "cancelled", "cancelled" }, "any")
+assert(stats.succeeded == 1 and stats.cancelled == 2, "any stats")
+
+-- any: failures don't settle it, the batch waits for a success
+res, stats = async_http.request(batch("/status/500", "/delay/1", "/delay/5"), { wait = "any" })
+expect_states(res, { "done", "done", "cancelled" }, "any after a failure")
+assert(stats.succeeded == 1, "any after a failure: succeeded")
+
+-- any: no success at all, every request completes
+res, stats = async_http.request(batch("/status/500", "/status/404"), { wait = "any" })
+expect_states(res, { "done", "done" }, "any without a success")
+assert(stats.succeeded == 0 and stats.cancelled == 0, "any without a success: stats")
+
+-- quorum: k successes settle the batch
+res, stats = async_http.request(batch("/status/200", "/status/204", "/delay/5"), { wait = "quorum", k = 2 })
+expect_states(res, { "done", "done", "cancelled" }, "quorum")
+assert(stats.succeeded == 2, "quorum: succeeded")
+
+-- quorum: the default k is the batch majority
+res, stats = async_http.request(batch("/status/200", "/status/200", "/status/200", "/delay/5", "/delay/5"), { wait = "quorum" })
+assert(stats.succeeded == 3 and stats.cancelled == 2, "quorum majority")
+
+-- quorum: settled as soon as k can no longer be reached
+res, stats = async_http.request(batch("/status/500", "/status/503", "/delay/5"), { wait = "quorum", k = 2 })
+expect_states(res, { "done", "done", "cancelled" }, "unreachable quorum")
+assert(stats.succeeded == 0, "unreachable quorum: succeeded")
+
+-- success: the statuses counted as a success
+res, stats = async_http.request(batch("/status/404", "/delay/5"), { wait = "any", success = { 404 } })
+expect_states(res, { "done", "cancelled" }, "any with success = {404}")
+res, stats = async_http.request(batch("/status/418", "/delay/5"), { wait = "any", success = { "4xx" } })
+expect_states(res, { "done", "cancelled" }, "any with success = {\"4xx\"}")
+
+-- queued requests are never started once the batch is settled
+res, stats = async_http.request(batch("/status/200", "/delay/5", "/get", "/get"), { wait = "any", concurrency = 2 })
+assert(res.r3.response_state == "cancelled" and res.r4.response_state == "cancelled", "queued requests started")
+assert(res.r3.queue_time == 0 and res.r3.response_status == 0, "a queued request ran")
+
+print("wait modes ok")